@@ -0,0 +1 @@
+#include "../../../src/archive/archivetrace.h"
@@ -24,9 +24,12 @@
 
 #include "archive.h"
 #include "archive_p.h"
+#include "archivetrace.h"
 
 #include "archivemanager.h"
 
+#include <QFile>
+
 
 
 
@@ -90,6 +93,33 @@ namespace Grim {
  *
  * You can block archive, waiting for this delay manually by passing Block flag into open() method.
  * In this case open() method blocks until initialization step will not be passed.
+ *
+ * \b Nested \b archives
+ *
+ * File name of the archive can point inside other already mounted archive.
+ * If such inner archive is stored without compression it is read directly from the outer archive file
+ * at the appropriate offset, without extracting it and without passing data thru the outer archive.
+ * Compressed inner archives cannot be mounted, because archive requires random access to its contents.
+ *
+ * \code
+ * Archive outer( "data.zip" );
+ * outer.open( Archive::ReadOnly );
+ * Archive inner( "data.zip/levels.zip" );
+ * inner.open( Archive::ReadOnly );
+ * \endcode
+ *
+ * \b Memory \b archives
+ *
+ * Archive contents can be read from the memory buffer with setData() or from any random access device
+ * with setDevice() instead of the file. File name then only names mount point.
+ * Stored files of the memory archive are read right from the buffer, without copying,
+ * and QFile::map() returns pointer right inside the buffer for them. Mapped memory must not be written to.
+ *
+ * \code
+ * Archive archive( ":/embedded" );
+ * archive.setData( downloadedPack );
+ * archive.open( Archive::ReadOnly );
+ * \endcode
  */
 
 
@@ -105,7 +135,9 @@ namespace Grim {
  * Open archive for reading. All contents inside archive will be readable.
  */
 /**\var Archive::OpenMode Archive::WriteOnly
- * Open archive for writing. All contents inside archive will be writable.
+ * Open archive for writing. Files opened with QIODevice::WriteOnly replace contents of files with the same paths
+ * or add new ones, see commit(). Only zip archive files can be written, not nested archives, memory buffers or devices.
+ * Missing or empty archive file is written as a new archive. Writable archive is always locked.
  */
 /**\var Archive::OpenMode Archive::ReadWrite
  * Open archive for both reading and writing. All contents inside archive will be readable and writable.
@@ -120,6 +152,31 @@ namespace Grim {
  * Normally you should not use this flag.
  * See stateChanged() signal for alternate asynchronous way to know when archive will be initialized.
  */
+/**\var Archive::OpenMode Archive::Sealed
+ * Declares that archive will never change while it is opened, which is true for most of shipped data packs.
+ * Archive is parsed once and then its contents are published as immutable table, so file information
+ * queries read it without taking any locks. Files stored without compression are read directly from
+ * the calling thread with positional I/O, bypassing archive worker. Request priorities, tracing and
+ * prefetching apply only to compressed files of the sealed archive.
+ * Implies locked mode, DontLock flag is ignored.
+ */
+/**\var Archive::OpenMode Archive::LazyEntries
+ * Keeps raw central directory of Zip archive in memory together with compact hash of file names,
+ * and constructs entries only for files and directories that are actually queried or listed.
+ * Opening is faster and takes less memory for large archives of which only small part is used per session.
+ * Lookups of not yet constructed files are serialized by archive.
+ * Ignored together with Sealed flag, which needs complete contents, and for Grim packs,
+ * which index is loaded as a whole anyway.
+ */
+/**\var Archive::OpenMode Archive::CaseInsensitive
+ * Files inside archive are found regardless of case of their paths, as on case insensitive file systems
+ * the content was authored on. Case folded paths of all entries are computed once on every update,
+ * so lookup folds only the requested path and only when it does not match exactly.
+ * Listings and file infos keep original names. Mount point is still matched case sensitively.
+ * If several paths differ only in case, the one that sorts first wins.
+ * Cannot be combined with LazyEntries, which does not know paths of entries until they are accessed,
+ * so LazyEntries flag is ignored.
+ */
 
 
 /**
@@ -151,6 +208,242 @@ namespace Grim {
 /**\var Archive::Type Archive::Type_Zip
  * PKWARE ZIP archive format.
  */
+/**\var Archive::Type Archive::Type_GrimPack
+ * Native Grim block-pack format, written by GrimPack utility with \c {--format grim}.
+ * Entry data is split into fixed-size blocks compressed independently from each other,
+ * so seeking inside compressed entry costs the same as inside stored one,
+ * blocks of large reads are inflated in parallel and identical blocks are kept only once.
+ * The whole index is loaded with a single read.
+ */
+
+
+/**
+ * \enum Archive::Priority
+ *
+ * This enum specifies priority class of file operations (open, seek, read, close) inside archive.
+ *
+ * All file operations of the archive are serialized in the single worker thread. When several threads
+ * read from the same archive simultaneously the worker serves request of the higher class first.
+ * Inside the same class requests with earlier deadline are served first, and requests without deadline
+ * are served in order of arrival. Request that missed its deadline is served before requests of any class.
+ *
+ * \sa setRequestPriority(), setFilePriority(), requestStatistics()
+ */
+/**\var Archive::Priority Archive::Priority_Background
+ * Prefetching and other work nobody waits for.
+ */
+/**\var Archive::Priority Archive::Priority_Normal
+ * Default class for all file operations.
+ */
+/**\var Archive::Priority Archive::Priority_High
+ * Operations that should not be delayed by the normal traffic, like audio streaming.
+ */
+/**\var Archive::Priority Archive::Priority_Realtime
+ * Operations on which frame rendering depends.
+ */
+
+
+/**
+ * \enum Archive::Method
+ *
+ * This enum specifies how entry data is kept inside archive.
+ *
+ * \sa EntryInfo
+ */
+/**\var Archive::Method Archive::Method_Unknown
+ * Compression method that could not be read.
+ */
+/**\var Archive::Method Archive::Method_Store
+ * Data is stored as is.
+ */
+/**\var Archive::Method Archive::Method_Deflate
+ * Data is compressed with Deflate algorithm as a whole.
+ */
+/**\var Archive::Method Archive::Method_Blocks
+ * Data is split into independently compressed blocks of Grim pack.
+ */
+
+
+/**
+ * \enum Archive::QueryFlag
+ *
+ * This enum specifies options of query().
+ */
+/**\var Archive::QueryFlag Archive::Query_Recursive
+ * Entries of all subdirectories under prefix are matched, not only direct children.
+ */
+/**\var Archive::QueryFlag Archive::Query_Dirs
+ * Directories are matched too, by default only files are.
+ */
+/**\var Archive::QueryFlag Archive::Query_CaseInsensitive
+ * Name filters are matched case insensitively. Prefix is always case sensitive.
+ */
+
+
+/**
+ * \enum Archive::ReadFlag
+ *
+ * This enum specifies options of readEntry().
+ */
+/**\var Archive::ReadFlag Archive::Read_Direct
+ * Bypass page cache with unbuffered I/O where the platform supports it.
+ * Applied only to the part of range whose offset inside archive file, destination address and size
+ * are multiples of 4096, the rest is read as usual.
+ * Useful for huge assets that are read once, so they do not evict useful pages.
+ */
+
+
+/**
+ * \class Archive::RequestStatistics
+ *
+ * \brief The Archive::RequestStatistics class holds counters of file requests of single priority class.
+ *
+ * \sa requestStatistics()
+ */
+
+
+/**
+ * Constructs empty statistics.
+ */
+
+Archive::RequestStatistics::RequestStatistics() :
+	requests( 0 ),
+	missedDeadlines( 0 ),
+	totalWaitTime( 0 ),
+	maxWaitTime( 0 )
+{
+}
+
+
+/**
+ * \class Archive::PrefetchStatistics
+ *
+ * \brief The Archive::PrefetchStatistics class holds counters of prefetching.
+ *
+ * \sa prefetchStatistics()
+ */
+
+
+/**
+ * Constructs empty statistics.
+ */
+
+Archive::PrefetchStatistics::PrefetchStatistics() :
+	queuedFiles( 0 ),
+	prefetchedFiles( 0 ),
+	skippedFiles( 0 ),
+	cachedBytes( 0 ),
+	hits( 0 ),
+	misses( 0 )
+{
+}
+
+
+/**
+ * \class Archive::LatencyHistogram
+ *
+ * \brief The Archive::LatencyHistogram class holds distribution of durations in power of two buckets.
+ *
+ * Buckets are cheap to fill from the worker and precise enough to tell a stall from a usual read.
+ *
+ * \sa Statistics
+ */
+
+
+/**
+ * Constructs empty histogram.
+ */
+
+Archive::LatencyHistogram::LatencyHistogram() :
+	count( 0 ),
+	totalTime( 0 ),
+	maxTime( 0 )
+{
+	for ( int i = 0; i < BucketCount; ++i )
+		buckets[ i ] = 0;
+}
+
+
+/**
+ * Returns duration in microseconds which is not exceeded by the given \a percent of accounted durations,
+ * for example 50 for median or 99 for tail latency.
+ * Result is the upper bound of the bucket, so it is overestimated at most twice.
+ * Returns 0 if histogram is empty.
+ */
+
+qint64 Archive::LatencyHistogram::percentile( int percent ) const
+{
+	if ( count == 0 )
+		return 0;
+
+	const qint64 rank = (qint64( count ) * qBound( 0, percent, 100 ) + 99) / 100;
+
+	qint64 accounted = 0;
+	for ( int i = 0; i < BucketCount; ++i )
+	{
+		accounted += buckets[ i ];
+		if ( accounted >= rank && accounted > 0 )
+			return i == BucketCount - 1 ? maxTime : qMin( (Q_INT64_C(1) << i) - 1, maxTime );
+	}
+
+	return maxTime;
+}
+
+
+/**
+ * \class Archive::Statistics
+ *
+ * \brief The Archive::Statistics class holds snapshot of runtime counters of archive.
+ *
+ * \sa statistics()
+ */
+
+
+/**
+ * Constructs empty statistics.
+ */
+
+Archive::Statistics::Statistics() :
+	openRequests( 0 ),
+	closeRequests( 0 ),
+	seekRequests( 0 ),
+	readRequests( 0 ),
+	writeRequests( 0 ),
+	flushRequests( 0 ),
+	bytesRead( 0 ),
+	bytesInflated( 0 ),
+	queueDepth( 0 ),
+	maxQueueDepth( 0 ),
+	cacheHits( 0 ),
+	openFiles( 0 ),
+	workerBusyTime( 0 ),
+	mountTime( 0 )
+{
+}
+
+
+/**
+ * \class Archive::EntryInfo
+ *
+ * \brief The Archive::EntryInfo class describes single entry of archive.
+ *
+ * \sa query()
+ */
+
+
+/**
+ * Constructs empty entry info.
+ */
+
+Archive::EntryInfo::EntryInfo() :
+	isDir( false ),
+	size( 0 ),
+	compressedSize( 0 ),
+	method( Method_Unknown ),
+	offset( -1 ),
+	crc32( 0 )
+{
+}
 
 
 /**
@@ -198,6 +491,10 @@ Archive::~Archive()
  *
  * This signal is emitted if state of broken flag is changed with the current archive state in \a state variable.
  *
+ * Changes detected by the background worker are delivered through archive's event loop.
+ * Worker keeps serving file requests meanwhile, so state() could lag behind
+ * until archive's thread gets back to its event loop.
+ *
  * \sa state(), isBroken()
  */
 
@@ -245,6 +542,9 @@ bool Archive::isBroken() const
  * If Block flag was specified than open() call blocks until archive contents will not be updated.
  * Use this to ensure that later file operations will not block later spontaneously.
  *
+ * If Sealed flag was specified then archive contents are never updated after opening,
+ * in exchange file operations on the archive avoid locking.
+ *
  * \b Note: Current implementation supports only ReadOnly flag, prohibiting opening archive for write.
  *
  * Call actualMountPoint() to obtain path where archive contents were actually mounted.
@@ -348,6 +648,71 @@ void Archive::setMountPoint( const QString & mountPoint )
 }
 
 
+/**
+ * Returns device archive contents are read from or 0 if device was not set.
+ *
+ * \sa setDevice()
+ */
+
+QIODevice * Archive::device() const
+{
+	return d_->customDevice_;
+}
+
+
+/**
+ * Sets archive contents to be read from \a device instead of fileName().
+ * File name is used only as default mount point in this case.
+ * Device must be random access. If it is not opened it will be opened for reading on open()
+ * and closed on close(). Device should not be used by anybody else while archive is opened
+ * and must outlive it, archive does not take ownership.
+ *
+ * Archive mounted from device cannot observe outside changes, so DontLock flag is ignored.
+ * Pass 0 to read archive from file again. Custom device takes precedence over data().
+ *
+ * Changing device while archive is opened is prohibited.
+ *
+ * \sa device(), setData()
+ */
+
+void Archive::setDevice( QIODevice * device )
+{
+	d_->setDevice( device );
+}
+
+
+/**
+ * Returns memory buffer with archive contents or null byte array if it was not set.
+ *
+ * \sa setData()
+ */
+
+QByteArray Archive::data() const
+{
+	return d_->archiveData_;
+}
+
+
+/**
+ * Sets archive contents to be read from the memory buffer \a data instead of fileName().
+ * File name is used only as default mount point in this case.
+ * Data is shared, not copied, so buffer with archive embedded in the executable with QByteArray::fromRawData()
+ * is mounted without any copying at all. Stored files are then read right from \a data.
+ *
+ * Archive mounted from memory cannot observe outside changes, so DontLock flag is ignored.
+ * Pass null byte array to read archive from file again.
+ *
+ * Changing data while archive is opened is prohibited.
+ *
+ * \sa data(), setDevice()
+ */
+
+void Archive::setData( const QByteArray & data )
+{
+	d_->setData( data );
+}
+
+
 /**
  * Returns path where archive will be actually mounted in file system.
  * This would be either one of mountPoint() or fileName(), depending whether mount point was set
@@ -391,6 +756,373 @@ void Archive::setTreatAsDir( bool set )
 }
 
 
+/**
+ * Returns maximum number of compressed files that are inflated simultaneously.
+ *
+ * \sa setMaxInflateContexts()
+ */
+
+int Archive::maxInflateContexts() const
+{
+	return d_->maxInflateContexts();
+}
+
+
+/**
+ * Limits number of inflate contexts that archive keeps for compressed files to \a count.
+ *
+ * Each inflate context holds decompression state and read buffer, about 64 KB of memory.
+ * Contexts are attached to opened compressed files only when they are read, so memory cost
+ * depends on number of actively read files, rather than on number of opened ones.
+ * When all contexts are in use, the least recently read file is suspended and gives its context away.
+ * Suspended file is transparently resumed on the next read, but this requires to inflate
+ * its contents again from the beginning up to the current position, so do not set
+ * this limit lower than number of files you normally read simultaneously.
+ *
+ * Default limit is 32 contexts.
+ *
+ * \sa maxInflateContexts()
+ */
+
+void Archive::setMaxInflateContexts( int count )
+{
+	d_->setMaxInflateContexts( count );
+}
+
+
+/**
+ * Returns time in milliseconds archive file stays opened in DontLock mode after the last file was closed.
+ *
+ * \sa setLingerTime()
+ */
+
+int Archive::lingerTime() const
+{
+	return d_->lingerTime();
+}
+
+
+/**
+ * Keeps archive file opened in DontLock mode for \a msecs milliseconds after the last file was closed.
+ *
+ * Without lingering every opening of a file in idle archive reopens archive file and checks
+ * its modification time after closing, which is expensive for loops of short-lived files.
+ * Files opened while archive file lingers reuse its handle without any system calls.
+ * Modification time is still checked every update interval, and replaced archive file is reopened.
+ * Note that on some platforms opened handle prevents archive file from being replaced,
+ * use 0 to close archive file right after the last file was closed.
+ *
+ * Default linger time is 100 milliseconds. Has no effect in locked modes.
+ *
+ * \sa lingerTime()
+ */
+
+void Archive::setLingerTime( int msecs )
+{
+	d_->setLingerTime( msecs );
+}
+
+
+/**
+ * Returns size in bytes up to which files are loaded into memory on update.
+ *
+ * \sa setSmallFileThreshold()
+ */
+
+int Archive::smallFileThreshold() const
+{
+	return d_->smallFileThreshold();
+}
+
+
+/**
+ * Loads contents of all files not larger than \a size bytes into memory on each update.
+ *
+ * Small files are read in one sequential sweep ordered by their offsets inside archive
+ * and compressed ones are inflated at once into a single contiguous block of memory.
+ * Opening, reading and seeking such files is done right in the calling thread without worker,
+ * and in DontLock mode archive file is not reopened for them.
+ * The sweep happens while contents are updated, so in Block mode open() waits for it to finish.
+ *
+ * Has no effect for Grim pack archives and in LazyEntries mode.
+ * Stored files of sealed archives and archives set with setData() are not loaded,
+ * because they are read directly anyway.
+ * Files are opened through the worker as usual while access trace is written.
+ *
+ * Default threshold is 0, which disables loading.
+ * Should be set before opening, otherwise takes effect on the next update.
+ *
+ * \sa smallFileThreshold()
+ */
+
+void Archive::setSmallFileThreshold( int size )
+{
+	d_->setSmallFileThreshold( size );
+}
+
+
+/**
+ * Returns size in bytes from which compressed files are inflated on thread pool.
+ *
+ * \sa setBackgroundInflateThreshold()
+ */
+
+int Archive::backgroundInflateThreshold() const
+{
+	return d_->backgroundInflateThreshold();
+}
+
+
+/**
+ * Inflates compressed files of \a size bytes and larger as a whole on global thread pool.
+ *
+ * By default single worker both reads archive and inflates every opened file of it,
+ * so decompression of one huge file delays all other files of archive.
+ * With this threshold set worker only reads compressed data of large file when it is opened
+ * and hands inflating to QThreadPool::globalInstance(), so several files are inflated concurrently
+ * while worker keeps serving other requests. The first read waits until the whole file is inflated
+ * in the calling thread, after that file is read and seeked in memory without worker.
+ *
+ * Whole uncompressed contents are kept in memory while file is opened,
+ * so the threshold trades memory for latency of other files. Files larger than 2 GB
+ * and Grim pack entries, which are already inflated by blocks in parallel, are streamed as usual.
+ *
+ * Default threshold is 0, which disables inflating on thread pool.
+ * Takes effect for files opened after the call.
+ *
+ * \sa backgroundInflateThreshold(), setSmallFileThreshold()
+ */
+
+void Archive::setBackgroundInflateThreshold( int size )
+{
+	d_->setBackgroundInflateThreshold( size );
+}
+
+
+/**
+ * Returns whether archive gives kernel hints about how archive file will be read.
+ *
+ * \sa setUseCacheHints()
+ */
+
+bool Archive::useCacheHints() const
+{
+	return d_->useCacheHints();
+}
+
+
+/**
+ * Turns kernel cache hints on if \a set is \c true and off if \a set is \c false.
+ *
+ * When hints are on archive advises kernel page cache about its access pattern:
+ * data of entry starts loading in background as soon as file is opened,
+ * readahead is turned off while small entries are read and turned on while large streams are read,
+ * and large streams that were read once from start to end are dropped from page cache after closing.
+ * Turn hints off to compare cold load timings or if page cache is managed by application itself.
+ *
+ * Hints are supported only on platforms with posix_fadvise(), on others this setting has no effect.
+ * Hints are on by default.
+ *
+ * \sa useCacheHints()
+ */
+
+void Archive::setUseCacheHints( bool set )
+{
+	d_->setUseCacheHints( set );
+}
+
+
+/**
+ * Starts recording of file operations inside archive into trace file with the given \a fileName.
+ *
+ * Each open, read and close of file inside archive is written with the time it was issued at,
+ * time it took, thread that issued it and byte range that was read. Recording costs one buffered
+ * write per operation, so it can be left on during whole level load.
+ * Use ArchiveTrace to read the trace back.
+ *
+ * Previous trace is stopped if it was recording. Recording continues if archive is reopened.
+ *
+ * Returns \c false if trace file cannot be opened for writing.
+ *
+ * \sa stopTrace(), isTracing(), ArchiveTrace
+ */
+
+bool Archive::startTrace( const QString & fileName )
+{
+	return d_->startTrace( fileName );
+}
+
+
+/**
+ * Stops recording of file operations and closes trace file.
+ *
+ * \sa startTrace()
+ */
+
+void Archive::stopTrace()
+{
+	d_->stopTrace();
+}
+
+
+/**
+ * Returns \c true if file operations are being recorded into trace file.
+ *
+ * \sa startTrace()
+ */
+
+bool Archive::isTracing() const
+{
+	return d_->isTracing();
+}
+
+
+/**
+ * Starts loading of files with the given \a filePaths in background, in the given order,
+ * so that later opening of them will not wait for disk and decompression.
+ * File paths are relative to archive root, as ArchiveTrace::filePaths() returns them.
+ *
+ * Prefetching is done by archive worker only while no file operations are pending, so it never delays them.
+ * Compressed files are inflated into memory cache limited with \a budget bytes. When cache is full,
+ * prefetching pauses until prefetched files will be opened, which moves data from cache to the file.
+ * Files that are bigger than the whole \a budget are skipped.
+ * Stored files are not cached in memory, instead kernel is asked to load them into page cache.
+ *
+ * Calling prefetch() again replaces the list of files, data prefetched earlier is kept if it fits into the new budget.
+ *
+ * \sa cancelPrefetch(), prefetchStatistics(), startTrace()
+ */
+
+void Archive::prefetch( const QStringList & filePaths, qint64 budget )
+{
+	d_->prefetch( filePaths, budget );
+}
+
+
+/**
+ * Starts prefetching of files in order they were first opened in the given \a trace.
+ * This is a convenience overload, \a budget has the same meaning.
+ *
+ * \code
+ * ArchiveTrace trace;
+ * trace.load( "level1.trace" );
+ * archive.open( Archive::ReadOnly );
+ * archive.prefetch( trace, 64*1024*1024 );
+ * \endcode
+ */
+
+void Archive::prefetch( const ArchiveTrace & trace, qint64 budget )
+{
+	d_->prefetch( trace.filePaths(), budget );
+}
+
+
+/**
+ * Stops prefetching and releases all prefetched data that was not used yet.
+ * Prefetching is also canceled when archive is closed.
+ *
+ * \sa prefetch()
+ */
+
+void Archive::cancelPrefetch()
+{
+	d_->cancelPrefetch();
+}
+
+
+/**
+ * Returns counters of prefetching.
+ * Each listed file is accounted once: as hit if it was prefetched before opening, otherwise as miss.
+ *
+ * \sa prefetch()
+ */
+
+Archive::PrefetchStatistics Archive::prefetchStatistics() const
+{
+	return d_->prefetchStatistics();
+}
+
+
+/**
+ * Returns format of the archive detected on the initial update
+ * or Type_Unknown if archive is not initialized yet or is broken.
+ */
+
+Archive::Type Archive::type() const
+{
+	return d_->type();
+}
+
+
+/**
+ * Returns descriptors of entries under directory \a prefix, which is relative to archive root,
+ * with file names matching any of wildcard \a nameFilters, or all of them if no filters given.
+ * Empty \a prefix means the whole archive. Use \a flags to match subdirectories and directories themselves.
+ *
+ * Query runs over the sorted index of all paths, built once after each update of contents,
+ * so prefix range is located with binary search and neither file engines nor directory listings are involved.
+ * With LazyEntries open mode descriptors are read from central directory without constructing entries.
+ * Entries are returned in order of their paths.
+ *
+ * Blocks until initial update is finished. Returns empty list if archive is not opened.
+ *
+ * \sa EntryInfo
+ */
+
+QList<Archive::EntryInfo> Archive::query( const QString & prefix, const QStringList & nameFilters, QueryFlags flags ) const
+{
+	return d_->query( prefix, nameFilters, flags );
+}
+
+
+/**
+ * Reads up to \a maxlen bytes of stored file with the given \a filePath, starting at \a offset inside it,
+ * right into \a data supplied by the caller, like a mapped staging buffer of graphics or audio device.
+ * Returns number of bytes read, which is less than \a maxlen only at the end of file, or -1 on error.
+ *
+ * Path is relative to archive root, like the one returned by query().
+ * Data is read with positional I/O in the calling thread, so neither worker nor intermediate buffers
+ * are involved and several threads could read concurrently. Pass \a flags with Read_Direct
+ * to bypass page cache for huge aligned reads.
+ *
+ * Works only for files stored without compression in archive that is a plain file opened in locked mode,
+ * on platforms that support positional I/O. Returns -1 for the others, which should be read through QFile.
+ *
+ * \sa query(), ReadFlag
+ */
+
+qint64 Archive::readEntry( const QString & filePath, qint64 offset, char * data, qint64 maxlen, ReadFlags flags ) const
+{
+	return d_->readEntry( filePath, offset, data, maxlen, flags );
+}
+
+
+/**
+ * Makes files written since the last commit visible in archive. Returns \c true on success.
+ *
+ * Data of written files is appended to the end of archive file as it is written, one file at a time,
+ * without touching existing contents. Commit writes new central directory after them, which lists
+ * all committed files except replaced ones, and then the end record that refers to it.
+ * Both are flushed to disk before the call returns, so archive either stays as it was before commit
+ * or has all written files, even if application or system crashes meanwhile.
+ * While files are written, committed size of archive is kept in file with \c .uncommitted suffix
+ * next to archive file, so data written after the last successful commit is found and cut off
+ * on the next opening for writing.
+ * Space of replaced files and previous central directories is not reclaimed, repack archive to compact it.
+ *
+ * Fails if some file is still opened for writing. Written files are also committed by close().
+ * Commit is done by archive worker thread, calling thread is blocked until it finishes.
+ * Archive contents are updated right after commit, so committed files could be opened for reading.
+ *
+ * \sa WriteOnly
+ */
+
+bool Archive::commit()
+{
+	return d_->commit();
+}
+
+
 /**
  * Returns archive global comment.
 */
@@ -401,6 +1133,133 @@ QString Archive::globalComment() const
 }
 
 
+/**
+ * Returns statistics of file requests of the given \a priority class processed since archive construction
+ * or last call to resetRequestStatistics().
+ * Statistics are accounted by the class the request was queued with, regardless of deadline promotion.
+ *
+ * \sa resetRequestStatistics()
+ */
+
+Archive::RequestStatistics Archive::requestStatistics( Priority priority ) const
+{
+	if ( priority < Priority_Background || priority > Priority_Realtime )
+		return RequestStatistics();
+
+	return d_->requestStatistics( priority );
+}
+
+
+/**
+ * Clears statistics of file requests for all priority classes.
+ *
+ * \sa requestStatistics()
+ */
+
+void Archive::resetRequestStatistics()
+{
+	d_->resetRequestStatistics();
+}
+
+
+/**
+ * Returns snapshot of runtime counters of archive accumulated since archive construction
+ * or last call to resetStatistics().
+ * Snapshot is cheap and consistent, so it could be polled every frame to catch I/O stalls.
+ * Worker publishes its counters after each update, file request and prefetched file,
+ * so bytes being read by request in progress are not accounted yet.
+ *
+ * \sa resetStatistics(), requestStatistics(), prefetchStatistics()
+ */
+
+Archive::Statistics Archive::statistics() const
+{
+	return d_->statistics();
+}
+
+
+/**
+ * Clears accumulated counters and histograms.
+ * Values describing current state, like number of opened files and mount time, are kept.
+ *
+ * \sa statistics()
+ */
+
+void Archive::resetStatistics()
+{
+	d_->resetStatistics();
+}
+
+
+/**
+ * Returns priority class of file operations issued from the calling thread.
+ *
+ * \sa setRequestPriority()
+ */
+
+Archive::Priority Archive::requestPriority()
+{
+	return (Priority)archiveThreadCache()->requestPriority;
+}
+
+
+/**
+ * Returns deadline in milliseconds of file operations issued from the calling thread or -1 if not set.
+ *
+ * \sa setRequestPriority()
+ */
+
+int Archive::requestDeadline()
+{
+	return archiveThreadCache()->requestDeadline;
+}
+
+
+/**
+ * Sets \a priority class and \a deadline in milliseconds for file operations issued from the calling thread.
+ * Deadline is measured from the moment each single operation is issued, -1 means no deadline.
+ *
+ * Files opened afterwards in this thread inherit these settings. For already opened files these settings
+ * can only raise priority and shorten deadline of operations called from this thread.
+ *
+ * \code
+ * Archive::setRequestPriority( Archive::Priority_Realtime, 5 );
+ * QByteArray frame = audioFile.read( 4096 );
+ * Archive::setRequestPriority( Archive::Priority_Normal );
+ * \endcode
+ *
+ * \sa setFilePriority(), requestStatistics()
+ */
+
+void Archive::setRequestPriority( Priority priority, int deadline )
+{
+	archiveThreadCache()->requestPriority = qBound<int>( Priority_Background, priority, Priority_Realtime );
+	archiveThreadCache()->requestDeadline = deadline < 0 ? -1 : deadline;
+}
+
+
+/**
+ * Sets \a priority class and \a deadline in milliseconds for all operations of the given \a file.
+ * Returns \c false if \a file does not point inside archive.
+ *
+ * \sa setRequestPriority()
+ */
+
+bool Archive::setFilePriority( QFile * file, Priority priority, int deadline )
+{
+	QAbstractFileEngine * fileEngine = file->fileEngine();
+
+	if ( !fileEngine || !fileEngine->supportsExtension( (QAbstractFileEngine::Extension)ArchiveFile::PriorityExtension ) )
+		return false;
+
+	ArchiveFilePriorityOption option;
+	option.priority = qBound<int>( Priority_Background, priority, Priority_Realtime );
+	option.deadline = deadline < 0 ? -1 : deadline;
+
+	return fileEngine->extension( (QAbstractFileEngine::Extension)ArchiveFile::PriorityExtension, &option, 0 );
+}
+
+
 
 
 } // namespace Grim
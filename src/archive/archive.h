@@ -27,8 +27,12 @@
 #include "archiveglobal.h"
 
 #include <QObject>
+#include <QDateTime>
 #include <QStringList>
 
+class QFile;
+class QIODevice;
+
 
 
 
@@ -38,6 +42,7 @@ namespace Grim {
 
 
 class ArchivePrivate;
+class ArchiveTrace;
 
 
 
@@ -52,15 +57,23 @@ public:
 	Q_PROPERTY( QString mountPoint READ mountPoint WRITE setMountPoint )
 	Q_PROPERTY( QString actualMountPoint READ actualMountPoint )
 	Q_PROPERTY( bool treatAsDir READ treatAsDir WRITE setTreatAsDir )
+	Q_PROPERTY( int maxInflateContexts READ maxInflateContexts WRITE setMaxInflateContexts )
+	Q_PROPERTY( int lingerTime READ lingerTime WRITE setLingerTime )
+	Q_PROPERTY( int smallFileThreshold READ smallFileThreshold WRITE setSmallFileThreshold )
+	Q_PROPERTY( int backgroundInflateThreshold READ backgroundInflateThreshold WRITE setBackgroundInflateThreshold )
+	Q_PROPERTY( bool useCacheHints READ useCacheHints WRITE setUseCacheHints )
 
 	enum OpenModeFlag
 	{
-		NotOpen     = 0x0000,
-		ReadOnly    = 0x0001,
-		WriteOnly   = 0x0002,
-		ReadWrite   = ReadOnly | WriteOnly,
-		DontLock    = 0x0004,
-		Block       = 0x0008,
+		NotOpen         = 0x0000,
+		ReadOnly        = 0x0001,
+		WriteOnly       = 0x0002,
+		ReadWrite       = ReadOnly | WriteOnly,
+		DontLock        = 0x0004,
+		Block           = 0x0008,
+		Sealed          = 0x0010,
+		LazyEntries     = 0x0020,
+		CaseInsensitive = 0x0040
 	};
 	Q_DECLARE_FLAGS( OpenMode, OpenModeFlag )
 
@@ -75,7 +88,115 @@ public:
 	enum Type
 	{
 		Type_Unknown = 0,
-		Type_Zip
+		Type_Zip,
+		Type_GrimPack
+	};
+
+	enum Priority
+	{
+		Priority_Background = 0,
+		Priority_Normal,
+		Priority_High,
+		Priority_Realtime
+	};
+
+	enum Method
+	{
+		Method_Unknown = -1,
+		Method_Store   = 0,
+		Method_Deflate = 8,
+		Method_Blocks  = 0x100
+	};
+
+	enum QueryFlag
+	{
+		Query_Recursive       = 0x0001,
+		Query_Dirs            = 0x0002,
+		Query_CaseInsensitive = 0x0004
+	};
+	Q_DECLARE_FLAGS( QueryFlags, QueryFlag )
+
+	enum ReadFlag
+	{
+		Read_Direct = 0x0001
+	};
+	Q_DECLARE_FLAGS( ReadFlags, ReadFlag )
+
+	class GRIM_ARCHIVE_EXPORT RequestStatistics
+	{
+	public:
+		RequestStatistics();
+
+		int requests;         // number of processed file requests
+		int missedDeadlines;  // number of requests completed after their deadline
+		qint64 totalWaitTime; // total time requests spent in queue, in microseconds
+		qint64 maxWaitTime;   // longest time single request spent in queue, in microseconds
+	};
+
+	class GRIM_ARCHIVE_EXPORT PrefetchStatistics
+	{
+	public:
+		PrefetchStatistics();
+
+		int queuedFiles;     // files waiting in prefetch queue
+		int prefetchedFiles; // compressed files inflated into cache and stored files hinted to kernel
+		int skippedFiles;    // files that were not found, unreadable or exceeded budget
+		qint64 cachedBytes;  // inflated bytes held in cache and not used yet
+		int hits;            // openings of prefetched files
+		int misses;          // openings of listed files that were not prefetched in time
+	};
+
+	class GRIM_ARCHIVE_EXPORT LatencyHistogram
+	{
+	public:
+		enum { BucketCount = 32 };
+
+		LatencyHistogram();
+
+		qint64 percentile( int percent ) const;
+
+		int count;                  // number of accounted durations
+		qint64 totalTime;           // sum of all durations, in microseconds
+		qint64 maxTime;             // longest duration, in microseconds
+		int buckets[ BucketCount ]; // bucket i counts durations from 2^(i-1) to 2^i - 1 microseconds, bucket 0 counts zeros
+	};
+
+	class GRIM_ARCHIVE_EXPORT Statistics
+	{
+	public:
+		Statistics();
+
+		int openRequests;
+		int closeRequests;
+		int seekRequests;
+		int readRequests;
+		int writeRequests;
+		int flushRequests;
+		qint64 bytesRead;      // bytes of entries data read from archive file by worker
+		qint64 bytesInflated;  // bytes produced by decompression
+		int queueDepth;        // requests waiting for worker at the moment of snapshot
+		int maxQueueDepth;     // largest number of requests waiting for worker at once
+		int cacheHits;         // openings served from small file arena or prefetch cache, counted once per opening
+		int openFiles;         // files opened by worker at the moment of snapshot
+		qint64 workerBusyTime; // time worker spent on updates, file requests and prefetching, in microseconds
+		qint64 mountTime;      // duration of initial update in microseconds or 0 if it was not finished yet
+		LatencyHistogram requestLatency; // time callers were blocked on file requests, including queueing
+		LatencyHistogram updateLatency;  // durations of archive contents updates
+	};
+
+	class GRIM_ARCHIVE_EXPORT EntryInfo
+	{
+	public:
+		EntryInfo();
+
+		QString filePath;      // path relative to archive root
+		bool isDir;
+		qint64 size;
+		qint64 compressedSize;
+		Method method;
+		qint64 offset;         // offset of local file header for Zip entries or of the first block for Grim pack ones
+		quint32 crc32;
+		QDateTime modTime;
 	};
 
 	Archive( QObject * parent = 0 );
@@ -97,13 +218,63 @@ public:
 	QString mountPoint() const;
 	void setMountPoint( const QString & mountPoint );
 
+	QIODevice * device() const;
+	void setDevice( QIODevice * device );
+
+	QByteArray data() const;
+	void setData( const QByteArray & data );
+
 	QString actualMountPoint() const;
 
 	bool treatAsDir() const;
 	void setTreatAsDir( bool set );
 
+	int maxInflateContexts() const;
+	void setMaxInflateContexts( int count );
+
+	int lingerTime() const;
+	void setLingerTime( int msecs );
+
+	int smallFileThreshold() const;
+	void setSmallFileThreshold( int size );
+
+	int backgroundInflateThreshold() const;
+	void setBackgroundInflateThreshold( int size );
+
+	bool useCacheHints() const;
+	void setUseCacheHints( bool set );
+
+	bool startTrace( const QString & fileName );
+	void stopTrace();
+	bool isTracing() const;
+
+	void prefetch( const QStringList & filePaths, qint64 budget );
+	void prefetch( const ArchiveTrace & trace, qint64 budget );
+	void cancelPrefetch();
+	PrefetchStatistics prefetchStatistics() const;
+
+	Type type() const;
 	QString globalComment() const;
 
+	QList<EntryInfo> query( const QString & prefix, const QStringList & nameFilters = QStringList(),
+		QueryFlags flags = Query_Recursive ) const;
+
+	qint64 readEntry( const QString & filePath, qint64 offset, char * data, qint64 maxlen, ReadFlags flags = 0 ) const;
+
+	bool commit();
+
+	RequestStatistics requestStatistics( Priority priority ) const;
+	void resetRequestStatistics();
+
+	Statistics statistics() const;
+	void resetStatistics();
+
+	static Priority requestPriority();
+	static int requestDeadline();
+	static void setRequestPriority( Priority priority, int deadline = -1 );
+
+	static bool setFilePriority( QFile * file, Priority priority, int deadline = -1 );
+
 signals:
 	void stateChanged( int state );
 
@@ -125,3 +296,5 @@ private:
 
 Q_DECLARE_OPERATORS_FOR_FLAGS( Grim::Archive::OpenMode )
 Q_DECLARE_OPERATORS_FOR_FLAGS( Grim::Archive::State )
+Q_DECLARE_OPERATORS_FOR_FLAGS( Grim::Archive::QueryFlags )
+Q_DECLARE_OPERATORS_FOR_FLAGS( Grim::Archive::ReadFlags )
@@ -26,13 +26,28 @@
 
 #include "archivemanager.h"
 #include "archivemanager_p.h"
+#include "archivetrace_p.h"
 
-#include <QPointer>
 #include <QCoreApplication>
 #include <QDebug>
+#include <QRegExp>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QtEndian>
+#include <QtConcurrentMap>
 
 #ifdef Q_WS_WIN
 #include <objbase.h>
+#elif defined(Q_OS_MAC)
+#include <sys/time.h>
+#else
+#include <time.h>
+#include <fcntl.h>
+#endif
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#include <errno.h>
 #endif
 
 
@@ -156,9 +171,43 @@ extern QString toSoftCleanPath( const QString & path )
 }
 
 
+/** \internal
+ * Returns monotonic time in microseconds, used for scheduling file requests.
+ */
+extern qint64 archiveTimestamp()
+{
+#ifdef Q_WS_WIN
+	static LARGE_INTEGER frequency = { 0 };
+	if ( frequency.QuadPart == 0 )
+		QueryPerformanceFrequency( &frequency );
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter( &counter );
+	return qint64( counter.QuadPart / frequency.QuadPart ) * 1000000 +
+		qint64( counter.QuadPart % frequency.QuadPart ) * 1000000 / frequency.QuadPart;
+#elif defined(Q_OS_MAC)
+	struct timeval tv;
+	gettimeofday( &tv, 0 );
+	return qint64( tv.tv_sec ) * 1000000 + tv.tv_usec;
+#else
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return qint64( ts.tv_sec ) * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+
 
 
 static const int UpdateInterval = 1000; // interval for updating non locked archive
+static const int DefaultLingerTime = 100; // time to keep non locked archive opened after the last file was closed
+static const int MaxSmallFileArenaSize = 0x7fffffff; // limited by QByteArray
+
+static const int DefaultMaxInflateContexts = 32; // number of simultaneously inflated files per archive
+static const int InflateBufferSize = 16384;      // size of buffer for reading compressed data
+
+static const qint64 LargeEntrySize = 1024*1024; // entries of this compressed size and bigger are hinted as streams
+static const int DirectIoAlignment = 4096;      // alignment of offset, address and size of unbuffered reads
 
 
 
@@ -171,6 +220,16 @@ static const quint32 DigitalSignatureSignature      = 0x05054b50;
 static const quint32 EndOfCentralDirectorySignature = 0x06054b50;
 
 static const int EndOfCentralDirectorySize = 18;
+static const int CentralFileHeaderSize = 46; // fixed part of central file header including signature
+
+// Grim pack signature, "GPAK" when read as little endian bytes
+static const quint32 PackSignature = 0x4b415047;
+static const quint16 PackVersion = 1;
+
+static const int PackHeaderSize = 40;
+static const int PackBlockRecordSize = 16;
+static const int PackEntryRecordSize = 32;
+static const int PackMaxBlockSize = 16*1024*1024;
 
 
 
@@ -592,6 +651,67 @@ inline QDataStream & operator>>( QDataStream & ds, EndOfCentralDirectoryStruct &
 
 
 
+// data struct of Grim pack header at the very beginning of archive,
+// index is placed at indexOffset and consists of tables following one by one:
+//   block table     blockCount x { u64 offset, u32 compressedSize, u32 size }
+//   entry table     entryCount x { u32 nameOffset, u32 nameSize, u64 size, u32 blockRef,
+//                                  u32 crc32, u16 modTime, u16 modDate, u32 reserved }
+//   block refs      blockRefCount x u32 index in block table
+//   names           namesSize bytes of UTF-8 file paths
+// Every entry is split into blocks of blockSize bytes (last one may be shorter),
+// referenced by consecutive block refs starting at blockRef.
+// Blocks are raw deflate streams, block with compressedSize equal to size is stored.
+struct PackHeaderStruct
+{
+	quint16 version;
+	quint16 flags;
+	quint32 blockSize;
+	quint32 blockCount;
+	quint32 entryCount;
+	quint32 blockRefCount;
+	quint32 namesSize;
+	quint32 reserved;
+	quint64 indexOffset;
+};
+
+
+inline QDataStream & operator>>( QDataStream & ds, PackHeaderStruct & s )
+{
+	quint32 signature = 0;
+	ds >> signature;
+	if ( signature != PackSignature )
+	{
+		ds.setStatus( QDataStream::ReadCorruptData );
+		return ds;
+	}
+
+	ds >> s.version;
+	ds >> s.flags;
+	ds >> s.blockSize;
+	ds >> s.blockCount;
+	ds >> s.entryCount;
+	ds >> s.blockRefCount;
+	ds >> s.namesSize;
+	ds >> s.reserved;
+	ds >> s.indexOffset;
+
+	return ds;
+}
+
+
+
+
+ArchiveThreadCache::~ArchiveThreadCache()
+{
+	while ( freeFileBlocks )
+	{
+		void * block = freeFileBlocks;
+		freeFileBlocks = *reinterpret_cast<void**>( block );
+		::operator delete( block );
+	}
+}
+
+
 static QThreadStorage<ArchiveThreadCache*> _archiveThreadCache;
 
 
@@ -604,6 +724,19 @@ ArchiveThreadCache * archiveThreadCache()
 }
 
 
+/**
+ * Returns cache of the current thread or 0 if it was not created yet or already destroyed
+ * because thread is finishing.
+ */
+ArchiveThreadCache * existingArchiveThreadCache()
+{
+	if ( !_archiveThreadCache.hasLocalData() )
+		return 0;
+
+	return _archiveThreadCache.localData();
+}
+
+
 
 
 /** \internal
@@ -628,6 +761,280 @@ bool ArchiveInstance::isNull() const
 
 
 
+/** \internal
+ * Reads up to \a maxlen bytes at absolute \a offset of file with descriptor \a handle into \a data
+ * without moving file position, so could be called concurrently for the same descriptor.
+ * Returns number of bytes read or -1 on error or if positional I/O is not available on this platform.
+ */
+static qint64 _readAt( int handle, qint64 offset, char * data, qint64 maxlen )
+{
+#ifdef Q_OS_UNIX
+	qint64 bytesRead = 0;
+	while ( bytesRead < maxlen )
+	{
+		const ssize_t bytes = ::pread( handle, data + bytesRead, maxlen - bytesRead, offset + bytesRead );
+		if ( bytes == -1 )
+		{
+			if ( errno == EINTR )
+				continue;
+			return -1;
+		}
+
+		if ( bytes == 0 )
+			break;
+
+		bytesRead += bytes;
+	}
+	return bytesRead;
+#else
+	Q_UNUSED( handle );
+	Q_UNUSED( offset );
+	Q_UNUSED( data );
+	Q_UNUSED( maxlen );
+	return -1;
+#endif
+}
+
+
+/** \internal
+ * Reads local file header at absolute \a headerOffset of file with descriptor \a handle
+ * and returns absolute offset of entry data that follows it or -1 on error.
+ */
+static qint64 _localDataOffsetAt( int handle, qint64 headerOffset )
+{
+	// signature, 22 bytes of fixed fields, then file name and extra field sizes
+	static const int LocalFileHeaderSize = 30;
+
+	QByteArray header( LocalFileHeaderSize, '\0' );
+	if ( _readAt( handle, headerOffset, header.data(), LocalFileHeaderSize ) != LocalFileHeaderSize )
+		return -1;
+
+	QDataStream ds( header );
+	ds.setByteOrder( QDataStream::LittleEndian );
+
+	quint32 signature;
+	quint16 fileNameSize;
+	quint16 extraFieldSize;
+
+	ds >> signature;
+	ds.skipRawData( 22 );
+	ds >> fileNameSize;
+	ds >> extraFieldSize;
+
+	if ( signature != LocalFileHeaderSignature )
+		return -1;
+
+	return headerOffset + LocalFileHeaderSize + fileNameSize + extraFieldSize;
+}
+
+
+
+
+/** \internal
+ *
+ * \class ArchiveSealedContents
+ *
+ * Snapshot of contents of the archive opened in Sealed mode.
+ * Published by worker once after initial update and never changed after that,
+ * so file engines query entries and read stored data without taking any locks.
+ * Shared between archive and all its file engines, outlives archive closing while they refer to it.
+ */
+
+ArchiveSealedContents::ArchiveSealedContents() :
+	rootEntry_( 0 ),
+	fileHandle_( -1 ),
+	archiveOffset_( 0 )
+{
+}
+
+
+ArchiveSealedContents::~ArchiveSealedContents()
+{
+	QList<ArchiveEntry*> entriesToDelete;
+	if ( rootEntry_ )
+		entriesToDelete << rootEntry_;
+	while ( !entriesToDelete.isEmpty() )
+	{
+		ArchiveEntry * entryToDelete = entriesToDelete.takeFirst();
+		entriesToDelete << entryToDelete->entries;
+		delete entryToDelete;
+	}
+
+#ifdef Q_OS_UNIX
+	if ( fileHandle_ != -1 )
+		::close( fileHandle_ );
+#endif
+}
+
+
+/**
+ * Returns readable entry for the internal \a filePath or 0 if there is no such.
+ */
+ArchiveEntry * ArchiveSealedContents::entryForFilePath( const QString & filePath ) const
+{
+	ArchiveEntry * entry = entryForFilePath_.value( filePath );
+	if ( !entry && !entryForFoldedPath_.isEmpty() )
+		entry = entryForFoldedPath_.value( filePath.toCaseFolded() );
+	if ( !entry || !entry->info.canRead )
+		return 0;
+
+	return entry;
+}
+
+
+/**
+ * Returns \c true if data of \a entry can be read with read() from the calling thread,
+ * i.e. entry is stored without compression and positional reads are available on this platform.
+ */
+bool ArchiveSealedContents::canReadDirectly( const ArchiveEntry * entry ) const
+{
+	return fileHandle_ != -1 && !entry->info.isDir && !entry->info.isSequential && entry->info.packBlockRef == -1;
+}
+
+
+/**
+ * Reads local file header of \a entry and returns absolute offset of its data inside archive file
+ * or -1 on error.
+ * Entry itself is not changed, so this is safe to call concurrently.
+ */
+qint64 ArchiveSealedContents::dataOffset( const ArchiveEntry * entry ) const
+{
+	return _localDataOffsetAt( fileHandle_, archiveOffset_ + entry->info.localFileHeaderOffset );
+}
+
+
+/**
+ * Reads up to \a maxlen bytes at absolute \a offset of archive file with positional I/O.
+ * Returns number of bytes read or -1 on error.
+ */
+qint64 ArchiveSealedContents::read( qint64 offset, char * data, qint64 maxlen ) const
+{
+	return _readAt( fileHandle_, offset, data, maxlen );
+}
+
+
+
+
+/** \internal
+ *
+ * \class ArchiveInflateJob
+ *
+ * Whole compressed entry read by worker and inflated on thread pool.
+ */
+
+ArchiveInflateJob::ArchiveInflateJob() :
+	size( 0 ),
+	crc32( 0 ),
+	isClaimed( false ),
+	isDone( false ),
+	isOk( false )
+{
+}
+
+
+/**
+ * Marks job as taken for running and returns \c true if nobody has taken it before.
+ */
+bool ArchiveInflateJob::claim()
+{
+	QMutexLocker locker( &mutex );
+	if ( isClaimed )
+		return false;
+	isClaimed = true;
+	return true;
+}
+
+
+/**
+ * Inflates compressedData into data and wakes up waiting file.
+ * Called from pool thread or from waiting file, whichever claimed the job.
+ */
+void ArchiveInflateJob::run()
+{
+	data = QByteArray( (int)size, Qt::Uninitialized );
+
+	z_stream zStream;
+	zStream.zalloc = 0;
+	zStream.zfree = 0;
+	zStream.opaque = 0;
+	zStream.next_in = (Bytef*)compressedData.constData();
+	zStream.avail_in = (uInt)compressedData.size();
+	zStream.next_out = (Bytef*)data.data();
+	zStream.avail_out = (uInt)size;
+
+	bool ok = false;
+
+	if ( inflateInit2( &zStream, -MAX_WBITS ) == Z_OK )
+	{
+		const int error = inflate( &zStream, Z_FINISH );
+		ok = error == Z_STREAM_END && (qint64)zStream.total_out == size;
+		inflateEnd( &zStream );
+	}
+
+	if ( ok && ::crc32( 0, (const Bytef*)data.constData(), (uInt)size ) != crc32 )
+	{
+		qWarning( "Grim::ArchiveInflateJob::run() : CRC32 not matched." );
+		ok = false;
+	}
+
+	compressedData = QByteArray();
+	if ( !ok )
+		data = QByteArray();
+
+	QMutexLocker locker( &mutex );
+	isOk = ok;
+	isDone = true;
+	waiter.wakeAll();
+}
+
+
+/**
+ * Blocks until job is done and returns \c true if data was inflated successfully.
+ * Job not started by pool yet is run right here, so readers that are pool tasks themselves
+ * never wait for jobs queued behind them.
+ */
+bool ArchiveInflateJob::wait()
+{
+	if ( claim() )
+		run();
+
+	QMutexLocker locker( &mutex );
+	while ( !isDone )
+		waiter.wait( &mutex );
+	return isOk;
+}
+
+
+
+
+/** \internal
+ *
+ * \class ArchiveInflateTask
+ *
+ * Pool task that keeps its job alive until it is done, even if file was closed meanwhile.
+ */
+
+class ArchiveInflateTask : public QRunnable
+{
+public:
+	ArchiveInflateTask( const QExplicitlySharedDataPointer<ArchiveInflateJob> & job ) :
+		job_( job )
+	{}
+
+protected:
+	void run()
+	{
+		if ( job_->claim() )
+			job_->run();
+	}
+
+private:
+	QExplicitlySharedDataPointer<ArchiveInflateJob> job_;
+};
+
+
+
+
 /** \internal
  *
  * \class ArchiveWorker
@@ -673,11 +1080,50 @@ ArchivePrivate::ArchivePrivate( Archive * archive ) :
 	openMode_( Grim::Archive::NotOpen ),
 	isInitialized_( false ),
 	worker_( 0 ),
-	contentsMutex_( QReadWriteLock::Recursive )
+	customDevice_( 0 ),
+	archiveDevice_( &archiveFile_ ),
+	isDeviceOpenedBySelf_( false ),
+	archiveOffset_( 0 ),
+	archiveSize_( -1 ),
+	directHandle_( -1 ),
+	wasDirectHandleOpened_( false ),
+	contentsMutex_( QReadWriteLock::Recursive ),
+	type_( Archive::Type_Unknown ),
+	packBlockSize_( 0 ),
+	centralDirectoryOffset_( 0 ),
+	centralDirectorySize_( 0 ),
+	appendOffset_( -1 ),
+	committedSize_( 0 ),
+	isCommitJournalWritten_( false )
 {
 	treatAsDir_ = true;
 
 	updateInterval_ = UpdateInterval;
+
+	commitRequests_ = 0;
+	commitsDone_ = 0;
+	isLastCommitOk_ = false;
+
+	maxInflateContexts_ = DefaultMaxInflateContexts;
+
+	lingerTime_ = DefaultLingerTime;
+
+	smallFileThreshold_ = 0;
+
+	backgroundInflateThreshold_ = 0;
+
+	useCacheHints_ = true;
+	accessAdvice_ = CacheAdvice_Normal;
+
+	traceWriter_ = 0;
+
+	prefetchBudget_ = 0;
+	isPrefetchBlocked_ = false;
+
+	bytesRead_ = 0;
+	bytesInflated_ = 0;
+
+	isQueryIndexDirty_ = true;
 }
 
 
@@ -686,6 +1132,8 @@ ArchivePrivate::~ArchivePrivate()
 	archive_->blockSignals( true );
 
 	close();
+
+	stopTrace();
 }
 
 
@@ -738,7 +1186,46 @@ void ArchivePrivate::setMountPoint( const QString & mountPoint )
 }
 
 
+void ArchivePrivate::setDevice( QIODevice * device )
+{
+	if ( openMode_ != Grim::Archive::NotOpen )
+	{
+		qWarning( "Grim::ArchivePrivate::setDevice(): Archive is already opened." );
+		return;
+	}
+
+	customDevice_ = device;
+}
+
+
+void ArchivePrivate::setData( const QByteArray & data )
+{
+	if ( openMode_ != Grim::Archive::NotOpen )
+	{
+		qWarning( "Grim::ArchivePrivate::setData(): Archive is already opened." );
+		return;
+	}
+
+	archiveData_ = data;
+	archiveBuffer_.setBuffer( &archiveData_ );
+}
+
+
 bool ArchivePrivate::open( Grim::Archive::OpenMode openMode )
+{
+	if ( !beginOpen( openMode ) )
+		return false;
+
+	return endOpen();
+}
+
+
+/**
+ * First half of open(), that registers archive and starts its worker.
+ * Does not wait for initial update even in Block mode, so many archives can be parsed in parallel.
+ * Must be followed by endOpen() if succeeded.
+ */
+bool ArchivePrivate::beginOpen( Grim::Archive::OpenMode openMode )
 {
 	if ( openMode_ != Grim::Archive::NotOpen )
 	{
@@ -752,13 +1239,38 @@ bool ArchivePrivate::open( Grim::Archive::OpenMode openMode )
 		return false;
 	}
 
-	// currently only ReadOnly mode supported
 	if ( openMode & Grim::Archive::WriteOnly )
 	{
-		qWarning( "Grim::ArchivePrivate::open() : Writing not supported." );
-		return false;
+		// written files are appended right to archive file
+		if ( customDevice_ || !archiveData_.isNull() )
+		{
+			qWarning( "Grim::ArchivePrivate::open() : Only archive files can be opened for writing." );
+			return false;
+		}
+
+		if ( openMode & Grim::Archive::Sealed )
+		{
+			qWarning( "Grim::ArchivePrivate::open() : Sealed archive cannot be opened for writing." );
+			return false;
+		}
+
+		// archive file must not change outside while files are appended to it
+		openMode &= ~Grim::Archive::DontLock;
 	}
 
+	// sealed archive never changes, so there is no point to release archive file for outside changes,
+	// as well as devices and memory buffers cannot be observed for outside changes at all
+	if ( (openMode & Grim::Archive::Sealed) || customDevice_ || !archiveData_.isNull() )
+		openMode &= ~Grim::Archive::DontLock;
+
+	// sealed contents are published complete, nothing could be constructed later
+	if ( openMode & Grim::Archive::Sealed )
+		openMode &= ~Grim::Archive::LazyEntries;
+
+	// folded paths are computed for all entries at once, so they must be constructed
+	if ( openMode & Grim::Archive::CaseInsensitive )
+		openMode &= ~Grim::Archive::LazyEntries;
+
 	if ( !ArchiveManagerPrivate::sharedManagerPrivate()->registerArchive( archiveInstance_ ) )
 		return false;
 
@@ -768,44 +1280,103 @@ bool ArchivePrivate::open( Grim::Archive::OpenMode openMode )
 		return false;
 	}
 
-	{
-		QWriteLocker initializationLocker( &initializationMutex_ );
-		isInitialized_ = true;
-	}
-
 	return true;
 }
 
 
-bool ArchivePrivate::_openArchive( Grim::Archive::OpenMode openMode )
+/**
+ * Second half of open(), that makes archive visible to file engines.
+ * In Block mode waits for initial update first and fails if archive is broken in locked mode.
+ */
+bool ArchivePrivate::endOpen()
 {
-	isArchiveDirty_ = true;
-	archiveLastModified_ = QDateTime();
-	rootEntry_ = 0;
-
-	// temporary disable self to construct QFile instance on archive file
-	_setTemporaryDisabled( true );
-	archiveFile_.setFileName( fileName_ );
-	if ( !(openMode & Grim::Archive::DontLock) )
+	if ( openMode_ & Grim::Archive::Block )
 	{
-		QIODevice::OpenMode flags = 0;
-		if ( openMode & Grim::Archive::ReadOnly )
-			flags |= QIODevice::ReadOnly;
-		if ( openMode & Grim::Archive::WriteOnly )
-			flags |= QIODevice::WriteOnly;
-		bool opened = archiveFile_.open( flags );
-		if ( !opened )
+		// block and wait while archive will not be initially updated
 		{
-			_setTemporaryDisabled( false );
-			qWarning( "Grim::ArchivePrivate::open() : Failed to open archive in locked mode." );
+			QMutexLocker blockLocker( &blockMutex_ );
+			while ( !wasInitialUpdate_ )
+				blockWaiter_.wait( &blockMutex_ );
+		}
+
+		if ( !(openMode_ & Archive::DontLock) && isBroken_ )
+		{
+			// we are in locking mode, but archive is broken
+			// this means that we will never update it again
+			close();
 			return false;
 		}
 
-		if ( archiveFile_.isSequential() )
+		_setState( Archive::State_Ready, isBroken_ );
+	}
+
+	{
+		QWriteLocker initializationLocker( &initializationMutex_ );
+		isInitialized_ = true;
+	}
+
+	return true;
+}
+
+
+/**
+ * Returns \c true if archive file lies inside mount point of the given \a archive,
+ * i.e. this archive is nested and could be resolved only after \a archive is mounted.
+ */
+bool ArchivePrivate::isNestedInto( const ArchivePrivate * archive ) const
+{
+	const QString cleanFilePath = softToHardCleanPath( toSoftCleanPath( fileNameAbsolutePath_ ) );
+	return cleanFilePath.startsWith( archive->cleanMountPointPath() + QLatin1Char( '/' ) );
+}
+
+
+/**
+ * Returns time in microseconds spent by worker on initial update of archive contents
+ * or 0 if initial update was not finished yet.
+ */
+qint64 ArchivePrivate::initialUpdateTime() const
+{
+	QMutexLocker blockLocker( const_cast<QMutex*>( &blockMutex_ ) );
+	return initialUpdateTime_;
+}
+
+
+/**
+ * Returns archiveTimestamp() of the moment initial update was finished
+ * or 0 if initial update was not finished yet.
+ */
+qint64 ArchivePrivate::readyTime() const
+{
+	QMutexLocker blockLocker( const_cast<QMutex*>( &blockMutex_ ) );
+	return readyTime_;
+}
+
+
+bool ArchivePrivate::_openArchive( Grim::Archive::OpenMode openMode )
+{
+	isArchiveDirty_ = true;
+	archiveLastModified_ = QDateTime();
+	rootEntry_ = 0;
+
+	openMode_ = openMode;
+
+	// temporary disable self to construct QFile instance on archive file
+	_setTemporaryDisabled( true );
+	_resolveArchiveFile();
+	if ( (openMode & Grim::Archive::WriteOnly) && (archiveOffset_ != 0 || archiveSize_ != -1) )
+	{
+		openMode_ = Grim::Archive::NotOpen;
+		_setTemporaryDisabled( false );
+		qWarning( "Grim::ArchivePrivate::open() : Nested archive cannot be opened for writing." );
+		return false;
+	}
+	if ( !(openMode & Grim::Archive::DontLock) )
+	{
+		if ( !_openArchiveDevice() )
 		{
-			archiveFile_.close();
+			openMode_ = Grim::Archive::NotOpen;
 			_setTemporaryDisabled( false );
-			qWarning( "Grim::ArchivePrivate::open() : Cannot read sequential archive." );
+			qWarning( "Grim::ArchivePrivate::open() : Failed to open archive in locked mode." );
 			return false;
 		}
 	}
@@ -823,14 +1394,18 @@ bool ArchivePrivate::_openArchive( Grim::Archive::OpenMode openMode )
 		worker_ = new ArchiveWorker( this );
 
 	isWorkerAborted_ = false;
-	isInvoked_ = false;
+	reportedState_ = Archive::State_Idle << 1;
+	isStateReportPending_ = 0;
 	isWaitingForJob_ = false;
 
 	isTimeToUpdate_ = true;
 
 	isBroken_ = false;
 	wasInitialUpdate_ = false;
+	initialUpdateTime_ = 0;
+	readyTime_ = 0;
 	updateIntervalTime_ = QTime();
+	lingerStartTime_ = QTime();
 
 	openMode_ = openMode;
 
@@ -838,31 +1413,17 @@ bool ArchivePrivate::_openArchive( Grim::Archive::OpenMode openMode )
 	if ( openMode_ & Grim::Archive::DontLock )
 		updateTimer_.start( UpdateInterval, this );
 
-	if ( openMode_ & Grim::Archive::Block )
-	{
-		// block and wait while archive will not be initially updated
-		QMutexLocker blockLocker( &blockMutex_ );
-		worker_->start();
-		blockWaiter_.wait( &blockMutex_ );
-
-		if ( !(openMode_ & Archive::DontLock) && isBroken_ )
-		{
-			// we are in locking mode, but archive is broken
-			// this means that we will never update it again
-			close();
-			return false;
-		}
+	worker_->start();
 
-		_setState( Archive::State_Ready, isBroken_ );
-	}
-	else
+	if ( !(openMode_ & Grim::Archive::Block) )
 	{
 		// no need to wait, return and emit stateChanged() signal later
 		// when initial update will be done
-		worker_->start();
 		_setState( Archive::State_Initializing, false );
 	}
 
+	// in blocking mode initial update is awaited in endOpen()
+
 	return true;
 }
 
@@ -898,6 +1459,23 @@ void ArchivePrivate::close()
 	delete worker_;
 	worker_ = 0;
 
+	// commit files written so far, the one that is still being written is dropped
+	if ( openMode_ & Grim::Archive::WriteOnly )
+	{
+		QWriteLocker contentsLocker( &contentsMutex_ );
+		_abortWriting();
+		if ( !_commit() )
+			qWarning( "Grim::ArchivePrivate::close() : Failed to commit written files." );
+		pendingRecords_.clear();
+		appendOffset_ = -1;
+	}
+
+	// commits requested too late for worker were done above, don't repeat them after reopening
+	{
+		QWriteLocker jobLocker( &jobMutex_ );
+		commitsDone_ = commitRequests_;
+	}
+
 	// unlink opened files and clear contents so no one can link again
 	{
 		QWriteLocker contentsLocker( &contentsMutex_ );
@@ -905,9 +1483,9 @@ void ArchivePrivate::close()
 		// locking second mutex is useless because contentMutex_ in write mode overlaps it
 		// QWriteLocker linkedFileInstancesLocker( &linkedFileInstancesMutex_ );
 
-		while ( !linkedFileInstances_.isEmpty() )
+		for ( QSetIterator<ArchiveFileInstance> it( linkedFileInstances_ ); it.hasNext(); )
 		{
-			ArchiveFileInstance fileInstance = linkedFileInstances_.takeFirst();
+			const ArchiveFileInstance & fileInstance = it.next();
 
 			// check that file ignored unlinking due to nulled archive in archive instance
 			if ( !fileInstance.d->file )
@@ -920,14 +1498,17 @@ void ArchivePrivate::close()
 
 			fileInstance.d->file->entry_ = 0;
 
-			// skip this removeOne()
+			// skip this remove()
 			// anyway we can't detect which file skipped unlinking to assert it
-			// fileInstance.d->file->entry_->fileInstances.removeOne( fileInstance );
+			// fileInstance.d->file->entry_->fileInstances.remove( fileInstance );
 		}
+		linkedFileInstances_.clear();
 
-		// destroy contents
+		// destroy contents, sealed ones are destroyed by the last file engine that refers to them
 		QList<ArchiveEntry*> entriesToDelete;
-		entriesToDelete << rootEntry_;
+		if ( !sealedContents_ )
+			entriesToDelete << rootEntry_;
+		sealedContents_ = QExplicitlySharedDataPointer<ArchiveSealedContents>();
 		while ( !entriesToDelete.isEmpty() )
 		{
 			ArchiveEntry * entryToDelete = entriesToDelete.takeFirst();
@@ -941,13 +1522,14 @@ void ArchivePrivate::close()
 		}
 
 		entryForFilePath_.clear();
+		entryForFoldedPath_.clear();
 		rootEntry_ = 0;
 	}
 
 	// destroy self from pairs and clear pending requests
 	{
 		QWriteLocker fileInstancesLocker( &fileInstancesMutex_ );
-		for ( QListIterator<ArchiveFileInstance> it( fileInstances_ ); it.hasNext(); )
+		for ( QSetIterator<ArchiveFileInstance> it( fileInstances_ ); it.hasNext(); )
 		{
 			const ArchiveFileInstance & fileInstance = it.next();
 
@@ -976,25 +1558,159 @@ void ArchivePrivate::close()
 	{
 		QWriteLocker jobLocker( &jobMutex_ );
 		Q_ASSERT( requests_.isEmpty() );
+		statistics_.openFiles = 0;
 	}
 
+	// release inflate contexts, all files are unlinked and cleaned up at this point
+	_destroyInflateContexts();
+
+	// prefetched data belongs to destroyed contents
+	cancelPrefetch();
+
 	// clear contents
+	type_ = Archive::Type_Unknown;
 	globalComment_ = QString();
+	packBlockSize_ = 0;
+	packBlocks_.clear();
+	packBlockRefs_.clear();
+	lazyDirectory_ = QByteArray();
+	lazyNameForPathHash_.clear();
+	lazyChildForDirHash_.clear();
+	smallFileArena_ = QByteArray();
+
+	{
+		QMutexLocker queryLocker( &queryMutex_ );
+		isQueryIndexDirty_ = true;
+		queryEntries_.clear();
+		queryLazyNames_.clear();
+	}
 
 	// close archive file if it was opened
 	{
 		_setTemporaryDisabled( true );
-		if ( archiveFile_.openMode() != QIODevice::NotOpen )
-			archiveFile_.close();
+		_closeArchiveDevice();
 		_setTemporaryDisabled( false );
 	}
 
+	// descriptor for unbuffered reads is used by readEntry() with contents locked for reading
+	{
+		QWriteLocker contentsLocker( &contentsMutex_ );
+		_closeDirectHandle();
+	}
+
 	openMode_ = Grim::Archive::NotOpen;
 
 	_setState( Archive::State_Idle, false );
 }
 
 
+/**
+ * Points archiveDevice_ to the device that physically holds archive data.
+ * This is either custom device or memory buffer if they were set, or archive file.
+ * Normally archive file is fileName_ itself, but if fileName_ refers to the stored entry inside
+ * other mounted archive then the outer archive file is used directly together with entry data offset.
+ * This way nested archive is read without extracting and without passing data thru the outer archive.
+ * Must be called with self temporary disabled.
+ */
+void ArchivePrivate::_resolveArchiveFile()
+{
+	archiveOffset_ = 0;
+	archiveSize_ = -1;
+
+	if ( customDevice_ )
+	{
+		archiveDevice_ = customDevice_;
+		return;
+	}
+
+	if ( !archiveData_.isNull() )
+	{
+		archiveDevice_ = &archiveBuffer_;
+		return;
+	}
+
+	archiveDevice_ = &archiveFile_;
+
+	QString hostFileName;
+	qint64 offset;
+	qint64 size;
+
+	if ( ArchiveManagerPrivate::sharedManagerPrivate()->resolveStoredEntry( fileName_, hostFileName, offset, size ) )
+	{
+		archiveFile_.setFileName( hostFileName );
+		archiveOffset_ = offset;
+		archiveSize_ = size;
+	}
+	else
+	{
+		// compressed entries and normal files are opened as is
+		archiveFile_.setFileName( fileName_ );
+	}
+}
+
+
+/**
+ * Opens archiveDevice_ for reading if it is not opened yet.
+ * Custom device opened by the caller is left opened on closing.
+ * Must be called with self temporary disabled.
+ */
+bool ArchivePrivate::_openArchiveDevice()
+{
+	accessAdvice_ = CacheAdvice_Normal;
+
+	if ( archiveDevice_->isOpen() )
+	{
+		isDeviceOpenedBySelf_ = false;
+	}
+	else
+	{
+		// archive opened for writing is still read, also plain WriteOnly would truncate the file
+		QIODevice::OpenMode flags = 0;
+		if ( openMode_ & Grim::Archive::ReadOnly )
+			flags |= QIODevice::ReadOnly;
+		if ( openMode_ & Grim::Archive::WriteOnly )
+			flags |= QIODevice::ReadWrite;
+
+		// nested archive is read right from file of outer archive, which is usually mounted at the same path,
+		// so all archives are bypassed for this thread, not only self
+		const bool isHosted = archiveDevice_ == &archiveFile_ && archiveFile_.fileName() != fileName_;
+		const bool wasManagerDisabled = archiveThreadCache()->isManagerDisabled;
+		if ( isHosted )
+			archiveThreadCache()->isManagerDisabled = true;
+
+		const bool isOpened = archiveDevice_->open( flags );
+
+		archiveThreadCache()->isManagerDisabled = wasManagerDisabled;
+
+		if ( !isOpened )
+			return false;
+
+		isDeviceOpenedBySelf_ = true;
+	}
+
+	if ( archiveDevice_->isSequential() )
+	{
+		_closeArchiveDevice();
+		qWarning( "Grim::ArchivePrivate::_openArchiveDevice() : Cannot read sequential archive." );
+		return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Closes archiveDevice_ if it was opened by archive.
+ */
+void ArchivePrivate::_closeArchiveDevice()
+{
+	if ( isDeviceOpenedBySelf_ )
+		archiveDevice_->close();
+
+	isDeviceOpenedBySelf_ = false;
+}
+
+
 Grim::Archive::OpenMode ArchivePrivate::openMode() const
 {
 	return openMode_;
@@ -1013,110 +1729,334 @@ void ArchivePrivate::setTreatAsDir( bool set )
 }
 
 
-QString ArchivePrivate::globalComment() const
+int ArchivePrivate::maxInflateContexts() const
 {
-	return globalComment_;
+	QReadLocker jobLocker( const_cast<QReadWriteLock*>( &jobMutex_ ) );
+	return maxInflateContexts_;
 }
 
 
-void ArchivePrivate::registerFile( ArchiveFile * file )
+void ArchivePrivate::setMaxInflateContexts( int count )
 {
-	{
-		QWriteLocker fileInstancesLocker( &fileInstancesMutex_ );
-		fileInstances_ << file->fileInstance_;
-	}
+	QWriteLocker jobLocker( &jobMutex_ );
+	maxInflateContexts_ = qMax( 1, count );
 }
 
 
-void ArchivePrivate::unregisterFile( ArchiveFile * file )
+int ArchivePrivate::lingerTime() const
 {
-	// ensure file is unlinked
-	Q_ASSERT( !file->entry_ );
+	QReadLocker jobLocker( const_cast<QReadWriteLock*>( &jobMutex_ ) );
+	return lingerTime_;
+}
 
-	{
-		QWriteLocker fileInstancesLocker( &fileInstancesMutex_ );
-		fileInstances_.removeOne( file->fileInstance_ );
-	}
+
+void ArchivePrivate::setLingerTime( int msecs )
+{
+	QWriteLocker jobLocker( &jobMutex_ );
+	lingerTime_ = qMax( 0, msecs );
+
+	// let worker recalculate its waiting time
+	jobWaiter_.wakeOne();
 }
 
 
-/**
- *  Links \a file with existing entry if suitable one exists.
- */
-void ArchivePrivate::linkFile( ArchiveFile * file )
+int ArchivePrivate::smallFileThreshold() const
 {
-	// check if file is already linked
-	if ( file->entry_ )
-		return;
+	QReadLocker jobLocker( const_cast<QReadWriteLock*>( &jobMutex_ ) );
+	return smallFileThreshold_;
+}
 
-	{
-		// it's safe to access openMode_ here
-		if ( !(openMode_ & Grim::Archive::Block) )
-		{
-			// wait until archive will be updated first time
-			QMutexLocker blockLocker( &blockMutex_ );
-			if ( !wasInitialUpdate_ )
-			{
-				contentsMutex_.unlock();
-				blockWaiter_.wait( &blockMutex_ );
-				contentsMutex_.lockForRead();
-			}
-		}
-	}
 
-	ArchiveEntry * entry = entryForFilePath_.value( file->internalFileName_ );
-	if ( !entry )
-		return;
+void ArchivePrivate::setSmallFileThreshold( int size )
+{
+	QWriteLocker jobLocker( &jobMutex_ );
+	smallFileThreshold_ = qMax( 0, size );
+}
 
-	if ( !entry->info.canRead )
+
+int ArchivePrivate::backgroundInflateThreshold() const
+{
+	QReadLocker jobLocker( const_cast<QReadWriteLock*>( &jobMutex_ ) );
+	return backgroundInflateThreshold_;
+}
+
+
+void ArchivePrivate::setBackgroundInflateThreshold( int size )
+{
+	QWriteLocker jobLocker( &jobMutex_ );
+	backgroundInflateThreshold_ = qMax( 0, size );
+}
+
+
+bool ArchivePrivate::useCacheHints() const
+{
+	QReadLocker jobLocker( const_cast<QReadWriteLock*>( &jobMutex_ ) );
+	return useCacheHints_;
+}
+
+
+void ArchivePrivate::setUseCacheHints( bool set )
+{
+	QWriteLocker jobLocker( &jobMutex_ );
+	useCacheHints_ = set;
+}
+
+
+bool ArchivePrivate::startTrace( const QString & fileName )
+{
+	ArchiveTraceWriter * traceWriter = new ArchiveTraceWriter;
+	if ( !traceWriter->open( fileName, fileName_ ) )
 	{
-		// file is not normal ZIP archive
-		return;
+		qWarning( "Grim::ArchivePrivate::startTrace() : Cannot open trace file for writing." );
+		delete traceWriter;
+		return false;
 	}
 
-	QWriteLocker linkedFileInstancesLocker( &linkedFileInstancesMutex_ );
+	QMutexLocker traceLocker( &traceMutex_ );
+	delete traceWriter_;
+	traceWriter_ = traceWriter;
 
-	file->entry_ = entry;
-	entry->fileInstances << file->fileInstance_;
+	return true;
+}
 
-	Q_ASSERT( !linkedFileInstances_.contains( file->fileInstance_ ) );
-	linkedFileInstances_ << file->fileInstance_;
+
+void ArchivePrivate::stopTrace()
+{
+	QMutexLocker traceLocker( &traceMutex_ );
+	delete traceWriter_;
+	traceWriter_ = 0;
+}
+
+
+bool ArchivePrivate::isTracing() const
+{
+	QMutexLocker traceLocker( const_cast<QMutex*>( &traceMutex_ ) );
+	return traceWriter_ != 0;
 }
 
 
 /**
- * Unlinks \a file from existing entry.
- * This method actually called only from file's destructor.
- * File instance never acts first to unlink self.
+ * Replaces prefetch queue with the given \a filePaths and limits prefetch cache with \a budget bytes.
+ * Data prefetched earlier and not used yet is kept if fits into the new budget.
  */
-void ArchivePrivate::unlinkFile( ArchiveFile * file )
+void ArchivePrivate::prefetch( const QStringList & filePaths, qint64 budget )
 {
-	if ( !file->entry_ )
-		return;
+	{
+		QMutexLocker prefetchLocker( &prefetchMutex_ );
 
-	QWriteLocker linkedFileInstancesLocker( &linkedFileInstancesMutex_ );
+		prefetchBudget_ = qMax<qint64>( 0, budget );
+		isPrefetchBlocked_ = false;
 
-	// file must close self explicitly before unlinking
-	Q_ASSERT( !openedFileInstances_.contains( file->fileInstance_ ) );
+		// drop cached data that does not fit into the new budget
+		for ( QMutableHashIterator<QString,QByteArray> it( prefetchCache_ ); it.hasNext(); )
+		{
+			it.next();
+			if ( prefetchStatistics_.cachedBytes <= prefetchBudget_ )
+				break;
+			prefetchStatistics_.cachedBytes -= it.value().size();
+			prefetchStateForFilePath_.remove( it.key() );
+			it.remove();
+		}
 
-	Q_ASSERT( linkedFileInstances_.contains( file->fileInstance_ ) );
-	linkedFileInstances_.removeOne( file->fileInstance_ );
+		// forget files of previous list that were not prefetched
+		for ( QMutableHashIterator<QString,int> it( prefetchStateForFilePath_ ); it.hasNext(); )
+			if ( it.next().value() != Prefetch_Cached )
+				it.remove();
 
-	Q_ASSERT( file->entry_->fileInstances.contains( file->fileInstance_ ) );
+		prefetchQueue_.clear();
+		for ( QStringListIterator it( filePaths ); it.hasNext(); )
+		{
+			const QString & filePath = it.next();
+			if ( prefetchStateForFilePath_.contains( filePath ) )
+				continue;
+			prefetchQueue_ << filePath;
+			prefetchStateForFilePath_[ filePath ] = Prefetch_Queued;
+		}
+	}
 
-	file->entry_->fileInstances.removeOne( file->fileInstance_ );
-	file->entry_ = 0;
+	// wake up worker if it is idle
+	QWriteLocker jobLocker( &jobMutex_ );
+	jobWaiter_.wakeOne();
 }
 
 
 /**
- * Looks up and returns entry for the given \a filePath.
+ * Clears prefetch queue and releases prefetched data that was not used yet.
+ * Statistics are kept.
  */
-ArchiveEntry * ArchivePrivate::entryForFilePath( const QString & filePath ) const
+void ArchivePrivate::cancelPrefetch()
 {
-	archiveThreadCache()->isManagerDisabled = true;
-	const QString absoluteFilePath = QFileInfo( filePath ).absoluteFilePath();
-	archiveThreadCache()->isManagerDisabled = false;
+	QMutexLocker prefetchLocker( &prefetchMutex_ );
+
+	prefetchQueue_.clear();
+	prefetchStateForFilePath_.clear();
+	prefetchCache_.clear();
+	prefetchStatistics_.cachedBytes = 0;
+	isPrefetchBlocked_ = false;
+}
+
+
+Archive::PrefetchStatistics ArchivePrivate::prefetchStatistics() const
+{
+	QMutexLocker prefetchLocker( const_cast<QMutex*>( &prefetchMutex_ ) );
+
+	Archive::PrefetchStatistics statistics = prefetchStatistics_;
+	statistics.queuedFiles = prefetchQueue_.count();
+	return statistics;
+}
+
+
+QString ArchivePrivate::globalComment() const
+{
+	return globalComment_;
+}
+
+
+Archive::Type ArchivePrivate::type() const
+{
+	QReadLocker contentsLocker( &contentsMutex_ );
+	return type_;
+}
+
+
+/**
+ * Returns sealed contents or null pointer if archive is not sealed or initial update was not finished yet.
+ */
+QExplicitlySharedDataPointer<ArchiveSealedContents> ArchivePrivate::sealedContents() const
+{
+	QReadLocker contentsLocker( const_cast<QReadWriteLock*>( &contentsMutex_ ) );
+	return sealedContents_;
+}
+
+
+/**
+ * Registers \a file inside archive, so pending requests of the file can be released on closing.
+ * Called when file is opened first time, files that are only queried for info are never registered.
+ */
+void ArchivePrivate::registerFile( ArchiveFile * file )
+{
+	if ( !file->fileInstance_.isNull() )
+		return;
+
+	file->fileInstance_ = ArchiveFileInstance( new ArchiveFileInstanceData( file ) );
+
+	{
+		QWriteLocker fileInstancesLocker( &fileInstancesMutex_ );
+		fileInstances_ << file->fileInstance_;
+	}
+}
+
+
+void ArchivePrivate::unregisterFile( ArchiveFile * file )
+{
+	// ensure file is unlinked
+	Q_ASSERT( !file->entry_ );
+
+	if ( file->fileInstance_.isNull() )
+		return;
+
+	{
+		QWriteLocker fileInstancesLocker( &fileInstancesMutex_ );
+		fileInstances_.remove( file->fileInstance_ );
+	}
+}
+
+
+/**
+ * Returns entry for the \a file without linking file with it or 0 if there is no readable entry.
+ * Returned pointer is valid only while contents mutex is locked.
+ * Used for info queries, so files that are never opened do not touch linked files list.
+ */
+ArchiveEntry * ArchivePrivate::findFileEntry( ArchiveFile * file )
+{
+	if ( file->entry_ )
+		return file->entry_;
+
+	{
+		// it's safe to access openMode_ here
+		if ( !(openMode_ & Grim::Archive::Block) )
+		{
+			// wait until archive will be updated first time
+			QMutexLocker blockLocker( &blockMutex_ );
+			if ( !wasInitialUpdate_ )
+			{
+				contentsMutex_.unlock();
+				blockWaiter_.wait( &blockMutex_ );
+				contentsMutex_.lockForRead();
+			}
+		}
+	}
+
+	ArchiveEntry * entry = _lookupEntry( file->internalFileName_ );
+	if ( !entry )
+		return 0;
+
+	if ( !entry->info.canRead )
+	{
+		// file is not normal ZIP archive
+		return 0;
+	}
+
+	return entry;
+}
+
+
+/**
+ *  Links \a file with existing entry if suitable one exists.
+ */
+void ArchivePrivate::linkFile( ArchiveFile * file )
+{
+	// check if file is already linked
+	if ( file->entry_ )
+		return;
+
+	ArchiveEntry * entry = findFileEntry( file );
+	if ( !entry )
+		return;
+
+	QWriteLocker linkedFileInstancesLocker( &linkedFileInstancesMutex_ );
+
+	file->entry_ = entry;
+	entry->fileInstances << file->fileInstance_;
+
+	Q_ASSERT( !linkedFileInstances_.contains( file->fileInstance_ ) );
+	linkedFileInstances_ << file->fileInstance_;
+}
+
+
+/**
+ * Unlinks \a file from existing entry.
+ * This method actually called only from file's destructor.
+ * File instance never acts first to unlink self.
+ */
+void ArchivePrivate::unlinkFile( ArchiveFile * file )
+{
+	if ( !file->entry_ )
+		return;
+
+	QWriteLocker linkedFileInstancesLocker( &linkedFileInstancesMutex_ );
+
+	// file must close self explicitly before unlinking
+	Q_ASSERT( !openedFileInstances_.contains( file->fileInstance_ ) );
+
+	Q_ASSERT( linkedFileInstances_.contains( file->fileInstance_ ) );
+	linkedFileInstances_.remove( file->fileInstance_ );
+
+	Q_ASSERT( file->entry_->fileInstances.contains( file->fileInstance_ ) );
+
+	file->entry_->fileInstances.remove( file->fileInstance_ );
+	file->entry_ = 0;
+}
+
+
+/**
+ * Looks up and returns entry for the given \a filePath.
+ */
+ArchiveEntry * ArchivePrivate::entryForFilePath( const QString & filePath ) const
+{
+	archiveThreadCache()->isManagerDisabled = true;
+	const QString absoluteFilePath = QFileInfo( filePath ).absoluteFilePath();
+	archiveThreadCache()->isManagerDisabled = false;
 
 	// construct clean absolute file path, with which we can compare path to our mount point
 	const QString cleanSoftFilePath = toSoftCleanPath( absoluteFilePath );
@@ -1137,7 +2077,92 @@ ArchiveEntry * ArchivePrivate::entryForFilePath( const QString & filePath ) cons
 		internalFileName = QLatin1String( "/" );
 	}
 
-	return entryForFilePath_.value( internalFileName );
+	return const_cast<ArchivePrivate*>( this )->_lookupEntry( internalFileName );
+}
+
+
+/**
+ * Constructs all children of directory \a entry before listing them, if archive was opened with LazyEntries.
+ * Contents should be locked for reading, populated directory is not changed until the next update.
+ */
+void ArchivePrivate::populateEntry( ArchiveEntry * entry )
+{
+	if ( !(openMode_ & Grim::Archive::LazyEntries) || !entry || !entry->info.isDir )
+		return;
+
+	QMutexLocker lazyLocker( &lazyMutex_ );
+
+	if ( entry->isPopulated )
+		return;
+
+	const QByteArray dirPath = entry == rootEntry_ ? QByteArray() : entry->info.filePath.toUtf8();
+
+	const uint dirHash = ::qHash( dirPath );
+	for ( QMultiHash<uint,ArchiveLazyName>::ConstIterator it = lazyChildForDirHash_.constFind( dirHash );
+		it != lazyChildForDirHash_.constEnd() && it.key() == dirHash; ++it )
+	{
+		const ArchiveLazyName & lazyName = it.value();
+		const char * name = lazyDirectory_.constData() + lazyName.record + CentralFileHeaderSize;
+
+		// child name follows parent path and a slash, skip hash collisions
+		if ( !dirPath.isEmpty() &&
+			(lazyName.nameSize <= dirPath.size() || name[ dirPath.size() ] != '/' || memcmp( name, dirPath.constData(), dirPath.size() ) != 0) )
+			continue;
+
+		if ( !entryForFilePath_.contains( QString::fromUtf8( name, lazyName.nameSize ) ) )
+			_materializeLazyName( lazyName );
+	}
+
+	entry->isPopulated = true;
+}
+
+
+/**
+ * Returns entry for the given archive internal \a filePath.
+ * With LazyEntries entry is constructed on first access together with missing parent directories.
+ */
+ArchiveEntry * ArchivePrivate::_lookupEntry( const QString & filePath )
+{
+	if ( openMode_ & Grim::Archive::CaseInsensitive )
+	{
+		// path is usually spelled right, so folding is paid only for misses
+		ArchiveEntry * entry = entryForFilePath_.value( filePath );
+		return entry ? entry : entryForFoldedPath_.value( filePath.toCaseFolded() );
+	}
+
+	if ( !(openMode_ & Grim::Archive::LazyEntries) )
+		return entryForFilePath_.value( filePath );
+
+	QMutexLocker lazyLocker( &lazyMutex_ );
+
+	ArchiveEntry * entry = entryForFilePath_.value( filePath );
+	if ( entry )
+		return entry;
+
+	ArchiveLazyName lazyName;
+	if ( !_findLazyName( filePath.toUtf8(), lazyName ) )
+		return 0;
+
+	return _materializeLazyName( lazyName );
+}
+
+
+/** \internal
+ * Accounts single \a duration in microseconds into \a histogram.
+ */
+static inline void _addLatency( Archive::LatencyHistogram & histogram, qint64 duration )
+{
+	duration = qMax( Q_INT64_C(0), duration );
+
+	// index of the highest set bit plus one, so bucket i covers [2^(i-1), 2^i)
+	int bucket = 0;
+	for ( qint64 value = duration; value != 0 && bucket < Archive::LatencyHistogram::BucketCount - 1; value >>= 1 )
+		bucket++;
+
+	histogram.count++;
+	histogram.totalTime += duration;
+	histogram.maxTime = qMax( histogram.maxTime, duration );
+	histogram.buckets[ bucket ]++;
 }
 
 
@@ -1149,9 +2174,20 @@ void ArchivePrivate::processFileRequest( ArchiveFileRequest * request )
 {
 	QWriteLocker fileRequestLocker( &request->file()->requestMutex_ );
 
+	// file settings can be raised for the particular call by the thread settings
+	const ArchiveThreadCache * threadCache = archiveThreadCache();
+	const int priority = qMax( request->file()->priority_, threadCache->requestPriority );
+	int deadline = request->file()->deadline_;
+	if ( threadCache->requestDeadline >= 0 && (deadline < 0 || threadCache->requestDeadline < deadline) )
+		deadline = threadCache->requestDeadline;
+
+	const qint64 now = archiveTimestamp();
+	request->setSchedule( priority, deadline < 0 ? -1 : now + qint64( deadline ) * 1000, now );
+
 	{
 		QWriteLocker jobLocker( &jobMutex_ );
 		requests_ << request;
+		statistics_.maxQueueDepth = qMax( statistics_.maxQueueDepth, requests_.count() );
 		jobWaiter_.wakeOne();
 	}
 
@@ -1160,126 +2196,463 @@ void ArchivePrivate::processFileRequest( ArchiveFileRequest * request )
 	request->file()->request_ = request;
 	request->file()->requestWaiter_.wait( &request->file()->requestMutex_ );
 
+	{
+		QWriteLocker jobLocker( &jobMutex_ );
+		_addLatency( statistics_.requestLatency, archiveTimestamp() - now );
+	}
+
 	contentsMutex_.lockForRead();
 }
 
 
-/**
- * Changes state to the given \a state and broken flag to \a isBroken
- * and emits signal stateChanged().
- */
-void ArchivePrivate::_setState( Archive::State state, bool isBroken )
+Archive::RequestStatistics ArchivePrivate::requestStatistics( Archive::Priority priority ) const
 {
-	if ( state_ == state && isBroken_ == isBroken )
-		return;
+	QReadLocker jobLocker( const_cast<QReadWriteLock*>( &jobMutex_ ) );
+	return requestStatistics_[ priority ];
+}
 
-	state_ = state;
-	isBroken_ = isBroken;
 
-	emit archive_->stateChanged( state_ );
+void ArchivePrivate::resetRequestStatistics()
+{
+	QWriteLocker jobLocker( &jobMutex_ );
+	for ( int i = 0; i <= Archive::Priority_Realtime; ++i )
+		requestStatistics_[ i ] = Archive::RequestStatistics();
+}
+
+
+Archive::Statistics ArchivePrivate::statistics() const
+{
+	QReadLocker jobLocker( const_cast<QReadWriteLock*>( &jobMutex_ ) );
+
+	Archive::Statistics statistics = statistics_;
+	statistics.queueDepth = requests_.count();
+	statistics.cacheHits = cacheHits_;
+	return statistics;
+}
+
+
+void ArchivePrivate::resetStatistics()
+{
+	QWriteLocker jobLocker( &jobMutex_ );
+
+	Archive::Statistics statistics;
+	statistics.openFiles = statistics_.openFiles;
+	statistics.mountTime = statistics_.mountTime;
+	statistics_ = statistics;
+
+	cacheHits_ = 0;
 }
 
 
 /**
- * Marks self as temporary disabled to pass file requests to other file engine handlers.
+ * Accounts opening of file which contents are served from small file arena or prefetch cache,
+ * once per opening.
+ * Called from reading threads, so counter is atomic instead of being guarded by jobMutex_.
  */
-void ArchivePrivate::_setTemporaryDisabled( bool set )
+void ArchivePrivate::countCacheHit()
 {
-	if ( set )
-		archiveThreadCache()->disabledArchives << archiveInstance_;
-	else
-		archiveThreadCache()->disabledArchives.removeOne( archiveInstance_ );
+	cacheHits_.fetchAndAddRelaxed( 1 );
 }
 
 
-bool ArchivePrivate::event( QEvent * e )
+/**
+ * Accounts \a bytes successfully inflated on thread pool, when file takes them.
+ * Called from reading threads.
+ */
+void ArchivePrivate::countBackgroundInflate( qint64 bytes )
 {
-	// event from worker thread about state and broken flag changes
-	if ( e->type() == (QEvent::Type)EventType_StateChanged )
-	{
-		StateChangedEvent * stateChangedEvent = static_cast<StateChangedEvent*>( e );
+	QWriteLocker jobLocker( &jobMutex_ );
+	statistics_.bytesInflated += bytes;
+}
 
-		// somebody can kill us if it dislikes our signal, cruel world
-		QPointer<Archive> self( archive_ );
-		_setState( (Archive::State)stateChangedEvent->state, stateChangedEvent->isBroken );
-		if ( !self )
-			return true;
 
-		// wake up worker thread that waits until event will be handled
-		QWriteLocker invokationLocker( &invokationMutex_ );
-		isInvoked_ = false;
-		invokationWaiter_.wakeOne();
+/**
+ * Publishes counters accumulated by worker since previous call and adds \a busyTime in microseconds
+ * to time worker spent working.
+ * Must be called from worker.
+ */
+void ArchivePrivate::_publishStatistics( qint64 busyTime )
+{
+	QWriteLocker jobLocker( &jobMutex_ );
 
-		return true;
-	}
+	statistics_.bytesRead += bytesRead_;
+	statistics_.bytesInflated += bytesInflated_;
+	statistics_.workerBusyTime += busyTime;
+	statistics_.openFiles = openedFileInstances_.count();
 
-	return QObject::event( e );
+	bytesRead_ = 0;
+	bytesInflated_ = 0;
 }
 
 
-void ArchivePrivate::timerEvent( QTimerEvent * e )
+/**
+ * Fills \a hostFileName, \a offset and \a size with location of the data for the opened stored \a file
+ * inside the real file system.
+ * Returns \c false if \a file is compressed.
+ */
+bool ArchivePrivate::resolveStoredEntry( ArchiveFile * file, QString & hostFileName, qint64 & offset, qint64 & size ) const
 {
-	if ( e->timerId() == updateTimer_.timerId() )
-	{
-		QWriteLocker jobLocker( &jobMutex_ );
-		isTimeToUpdate_ = true;
-		jobWaiter_.wakeOne();
-		return;
-	}
+	const ArchiveEntry * entry = file->entry_;
 
-	return QObject::timerEvent( e );
+	if ( !entry || entry->info.isSequential || entry->info.packBlockRef != -1 || entry->info.dataOffset == -1 )
+		return false;
+
+	// archive is not a file itself
+	if ( archiveDevice_ != &archiveFile_ )
+		return false;
+
+	hostFileName = archiveFile_.fileName();
+	offset = archiveOffset_ + entry->info.dataOffset;
+	size = entry->info.size;
+
+	return true;
 }
 
 
-void ArchivePrivate::_abortWorker()
+/**
+ * Reads up to \a maxlen bytes of stored entry with the given \a filePath at \a offset into \a data
+ * with positional I/O from the calling thread.
+ * Contents are kept locked for reading during the call, so entry and archive file descriptor stay valid.
+ * Returns number of bytes read or -1 on error.
+ */
+qint64 ArchivePrivate::readEntry( const QString & filePath, qint64 offset, char * data, qint64 maxlen,
+	Archive::ReadFlags flags )
 {
-	if ( !worker_ )
-		return;
+	if ( offset < 0 || maxlen < 0 )
+		return -1;
+
+	QReadLocker contentsLocker( &contentsMutex_ );
 
+	if ( openMode_ == Grim::Archive::NotOpen )
+		return -1;
+
+	if ( !(openMode_ & Grim::Archive::Block) )
 	{
-		QWriteLocker invokationLocker( &invokationMutex_ );
-		isWorkerAborted_ = true;
-		if ( isInvoked_ )
+		// wait until archive will be updated first time
+		QMutexLocker blockLocker( &blockMutex_ );
+		if ( !wasInitialUpdate_ )
 		{
-			// ignore all State_Changed events worker sent us and just wake up worker thread
-			QCoreApplication::removePostedEvents( this, EventType_StateChanged );
-			invokationWaiter_.wakeOne();
+			contentsMutex_.unlock();
+			blockWaiter_.wait( &blockMutex_ );
+			contentsMutex_.lockForRead();
 		}
 	}
 
-	// release job waiter
-	{
-		QWriteLocker jobLocker( &jobMutex_ );
-		jobWaiter_.wakeOne();
-	}
+	// descriptor of non locked archive is closed and reopened by worker at any time
+	if ( archiveDevice_ != &archiveFile_ || (openMode_ & Grim::Archive::DontLock) || archiveFile_.handle() == -1 )
+		return -1;
 
-	worker_->wait();
-}
+	QString internalFilePath = filePath;
+	while ( internalFilePath.startsWith( QLatin1Char( '/' ) ) )
+		internalFilePath.remove( 0, 1 );
 
+	const ArchiveEntry * entry = internalFilePath.isEmpty() ? 0 : _lookupEntry( internalFilePath );
+	if ( !entry || entry->info.isDir || !entry->info.canRead || entry->info.isSequential || entry->info.packBlockRef != -1 )
+		return -1;
 
-void ArchivePrivate::_workerBody()
-{
-	while ( !isWorkerAborted_ )
+	const int handle = archiveFile_.handle();
+
+	// data offset of entry is resolved by worker on first opening without locking,
+	// so it is parsed from local header here each time
+	const qint64 dataOffset = _localDataOffsetAt( handle, archiveOffset_ + entry->info.localFileHeaderOffset );
+	if ( dataOffset == -1 )
+		return -1;
+
+	const qint64 length = qMin( maxlen, qMax( Q_INT64_C(0), entry->info.size - offset ) );
+	if ( length == 0 )
+		return 0;
+
+	qint64 bytesRead = 0;
+
+#if defined(Q_OS_LINUX) && defined(O_DIRECT)
+	const qint64 directLength = length & ~qint64( DirectIoAlignment - 1 );
+	if ( (flags & Archive::Read_Direct) && directLength > 0 && (dataOffset + offset) % DirectIoAlignment == 0 &&
+		quintptr( data ) % DirectIoAlignment == 0 )
+	{
+		const int directHandle = _directHandle();
+		if ( directHandle != -1 )
+		{
+			bytesRead = _readAt( directHandle, dataOffset + offset, data, directLength );
+
+			if ( bytesRead == -1 )
+				bytesRead = 0; // file system could refuse unbuffered reads, fall back to usual ones
+		}
+	}
+#else
+	Q_UNUSED( flags );
+#endif
+
+	if ( bytesRead < length )
+	{
+		const qint64 bytes = _readAt( handle, dataOffset + offset + bytesRead, data + bytesRead, length - bytesRead );
+		if ( bytes == -1 )
+			return -1;
+		bytesRead += bytes;
+	}
+
+	return bytesRead;
+}
+
+
+/**
+ * Returns descriptor of archive file opened for unbuffered reads, opening it on the first call,
+ * or -1 if platform or file system does not support them.
+ * Own descriptor is required, because O_DIRECT flag would affect all reads of archive file otherwise.
+ * Called from reading threads with contents locked for reading.
+ */
+int ArchivePrivate::_directHandle()
+{
+	QMutexLocker directHandleLocker( &directHandleMutex_ );
+
+#if defined(Q_OS_LINUX) && defined(O_DIRECT)
+	if ( !wasDirectHandleOpened_ )
+	{
+		wasDirectHandleOpened_ = true;
+		directHandle_ = ::open( QFile::encodeName( archiveFile_.fileName() ).constData(), O_RDONLY | O_DIRECT );
+	}
+#endif
+
+	return directHandle_;
+}
+
+
+/**
+ * Closes descriptor opened by _directHandle(), so the next opening of archive opens it again.
+ * Must be called with contents locked for writing.
+ */
+void ArchivePrivate::_closeDirectHandle()
+{
+	QMutexLocker directHandleLocker( &directHandleMutex_ );
+
+#ifdef Q_OS_UNIX
+	if ( directHandle_ != -1 )
+		::close( directHandle_ );
+#endif
+
+	directHandle_ = -1;
+	wasDirectHandleOpened_ = false;
+}
+
+
+/**
+ * Gives kernel a hint how \a length bytes of archive starting from \a pos will be accessed.
+ * Zero \a length means up to the end of archive file.
+ * Does nothing if cache hints are disabled or not supported by the platform.
+ */
+void ArchivePrivate::_adviseArchive( qint64 pos, qint64 length, int advice )
+{
+#if defined(Q_OS_UNIX) && !defined(Q_OS_MAC)
+	if ( archiveDevice_ != &archiveFile_ || !archiveFile_.isOpen() || !useCacheHints() )
+		return;
+
+	int fileAdvice = POSIX_FADV_NORMAL;
+	switch ( advice )
+	{
+	case CacheAdvice_Normal:     fileAdvice = POSIX_FADV_NORMAL;     break;
+	case CacheAdvice_Random:     fileAdvice = POSIX_FADV_RANDOM;     break;
+	case CacheAdvice_Sequential: fileAdvice = POSIX_FADV_SEQUENTIAL; break;
+	case CacheAdvice_WillNeed:   fileAdvice = POSIX_FADV_WILLNEED;   break;
+	case CacheAdvice_DontNeed:   fileAdvice = POSIX_FADV_DONTNEED;   break;
+	}
+
+	if ( length == 0 && archiveSize_ != -1 )
+		length = archiveSize_ - pos;
+
+	posix_fadvise( archiveFile_.handle(), archiveOffset_ + pos, length, fileAdvice );
+#else
+	Q_UNUSED( pos );
+	Q_UNUSED( length );
+	Q_UNUSED( advice );
+#endif
+}
+
+
+/**
+ * Gives kernel a hint how leading \a length bytes of compressed data of \a entry will be accessed.
+ * Blocks of Grim pack entry are deduplicated and could lie anywhere in archive,
+ * so they are advised one by one, adjacent blocks being merged into single range.
+ */
+void ArchivePrivate::_adviseEntry( ArchiveEntry * entry, qint64 length, int advice )
+{
+	// zero length would mean the rest of archive
+	if ( length <= 0 )
+		return;
+
+	if ( entry->info.packBlockRef == -1 )
+	{
+		_adviseArchive( entry->info.dataOffset, length, advice );
+		return;
+	}
+
+	const int blockCount = (entry->info.size + packBlockSize_ - 1) / packBlockSize_;
+
+	qint64 rangePos = 0;
+	qint64 rangeLength = 0;
+	for ( int i = 0; i < blockCount && length > 0; ++i )
+	{
+		const ArchivePackBlock & block = packBlocks_.at( packBlockRefs_.at( entry->info.packBlockRef + i ) );
+		const qint64 blockLength = qMin<qint64>( block.compressedSize, length );
+		length -= blockLength;
+
+		if ( rangeLength != 0 && block.offset == rangePos + rangeLength )
+		{
+			rangeLength += blockLength;
+			continue;
+		}
+
+		if ( rangeLength != 0 )
+			_adviseArchive( rangePos, rangeLength, advice );
+
+		rangePos = block.offset;
+		rangeLength = blockLength;
+	}
+
+	if ( rangeLength != 0 )
+		_adviseArchive( rangePos, rangeLength, advice );
+}
+
+
+/**
+ * Switches readahead policy of archive file before reading from \a entry:
+ * small entries are read randomly and should not pull neighbour entries into page cache,
+ * large streams are read sequentially and benefit from aggressive readahead.
+ * Kernel applies this kind of advice to the whole file handle, so it is changed only
+ * when reading switches between small entries and large streams.
+ */
+void ArchivePrivate::_adviseAccessPattern( ArchiveEntry * entry )
+{
+	const int advice = entry->info.compressedSize >= LargeEntrySize ? CacheAdvice_Sequential : CacheAdvice_Random;
+
+	if ( accessAdvice_ == advice )
+		return;
+
+	accessAdvice_ = advice;
+	_adviseArchive( 0, 0, advice );
+}
+
+
+/**
+ * Changes state to the given \a state and broken flag to \a isBroken
+ * and emits signal stateChanged().
+ */
+void ArchivePrivate::_setState( Archive::State state, bool isBroken )
+{
+	if ( state_ == state && isBroken_ == isBroken )
+		return;
+
+	state_ = state;
+	isBroken_ = isBroken;
+
+	emit archive_->stateChanged( state_ );
+}
+
+
+/**
+ * Marks self as temporary disabled to pass file requests to other file engine handlers.
+ */
+void ArchivePrivate::_setTemporaryDisabled( bool set )
+{
+	if ( set )
+		archiveThreadCache()->disabledArchives << archiveInstance_;
+	else
+		archiveThreadCache()->disabledArchives.removeOne( archiveInstance_ );
+}
+
+
+/**
+ * Called from worker to report changes of state and broken flag.
+ * Worker does not wait for archive's thread, the latest reported state
+ * is applied there with a single queued invocation of _applyReportedState(),
+ * so several reports made meanwhile are collapsed into one.
+ */
+void ArchivePrivate::_reportState( Archive::State state, bool isBroken )
+{
+	reportedState_.fetchAndStoreOrdered( (state << 1) | (isBroken ? 1 : 0) );
+
+	if ( isStateReportPending_.testAndSetOrdered( 0, 1 ) )
+		QMetaObject::invokeMethod( this, "_applyReportedState", Qt::QueuedConnection );
+}
+
+
+/**
+ * Applies state reported by worker in archive's thread.
+ */
+void ArchivePrivate::_applyReportedState()
+{
+	// clear pending flag before reading state, so report made right after reading queues a new invocation
+	isStateReportPending_.fetchAndStoreOrdered( 0 );
+
+	const int reportedState = reportedState_;
+	_setState( (Archive::State)(reportedState >> 1), reportedState & 1 );
+}
+
+
+void ArchivePrivate::timerEvent( QTimerEvent * e )
+{
+	if ( e->timerId() == updateTimer_.timerId() )
 	{
-		QList<ArchiveFileRequest*> requestsCopy;
+		QWriteLocker jobLocker( &jobMutex_ );
+		isTimeToUpdate_ = true;
+		jobWaiter_.wakeOne();
+		return;
+	}
+
+	return QObject::timerEvent( e );
+}
+
+
+void ArchivePrivate::_abortWorker()
+{
+	if ( !worker_ )
+		return;
+
+	isWorkerAborted_ = true;
+
+	// release job waiter and callers waiting for commit
+	{
+		QWriteLocker jobLocker( &jobMutex_ );
+		jobWaiter_.wakeOne();
+		commitWaiter_.wakeAll();
+	}
+
+	worker_->wait();
+
+	// ignore all state reports worker has queued for us
+	QCoreApplication::removePostedEvents( this, QEvent::MetaCall );
+	isStateReportPending_ = 0;
+}
+
+
+void ArchivePrivate::_workerBody()
+{
+	while ( !isWorkerAborted_ )
+	{
+		bool hasRequests;
 		bool isTimeToUpdate;
+		int commitRequests;
 
 		{
 			QWriteLocker jobLocker( &jobMutex_ );
 
-			// collect requests and update flag into local variables
-			requestsCopy = requests_;
-			requests_.clear();
+			// requests stay in queue, they are taken one by one while processing,
+			// so late coming urgent request can overtake earlier ones
+			hasRequests = !requests_.isEmpty();
 
 			isTimeToUpdate = isTimeToUpdate_;
 			isTimeToUpdate_ = false;
 
+			commitRequests = commitRequests_;
+
 			// check that we really have something to work on now
-			if ( requestsCopy.isEmpty() && !isTimeToUpdate )
+			if ( !hasRequests && !isTimeToUpdate && commitRequests == commitsDone_ && !_hasPrefetchJob() )
 			{
 				// no jobs, will wait for more
+				// lingering archive file is closed when no job comes in time
 				isWaitingForJob_ = true;
-				jobWaiter_.wait( &jobMutex_ );
+				if ( lingerStartTime_.isNull() )
+					jobWaiter_.wait( &jobMutex_ );
+				else
+					jobWaiter_.wait( &jobMutex_, qMax( 0, lingerTime_ - lingerStartTime_.elapsed() ) );
 				isWaitingForJob_ = false;
 
 				if ( isWorkerAborted_ )
@@ -1290,13 +2663,14 @@ void ArchivePrivate::_workerBody()
 					break;
 				}
 
-				// collect requests and update flag again
+				// check requests and update flag again
 				// now they are valid and we can proceed
-				requestsCopy = requests_;
-				requests_.clear();
+				hasRequests = !requests_.isEmpty();
 
 				isTimeToUpdate = isTimeToUpdate_;
 				isTimeToUpdate_ = false;
+
+				commitRequests = commitRequests_;
 			}
 		}
 
@@ -1305,9 +2679,24 @@ void ArchivePrivate::_workerBody()
 		bool storedWasInitialUpdate = wasInitialUpdate_;
 		bool updatedSuccessfully = false;
 
+		// single commit serves all callers that requested it so far,
+		// committed files become visible with the update below
+		const bool hasCommit = commitRequests != commitsDone_;
+		bool committedSuccessfully = false;
+		if ( hasCommit )
+		{
+			QWriteLocker contentsLocker( &contentsMutex_ );
+
+			const bool hasWrittenFiles = !pendingRecords_.isEmpty();
+			committedSuccessfully = _commit();
+
+			if ( committedSuccessfully && hasWrittenFiles )
+				isArchiveDirty_ = true;
+		}
+
 		if ( openMode_ & Grim::Archive::DontLock )
 		{
-			if ( !requestsCopy.isEmpty() )
+			if ( hasRequests || _hasPrefetchJob() )
 				shouldOpen = true;
 
 			if ( openedFileInstances_.isEmpty() && updateIntervalTime_.elapsed() > updateInterval_ )
@@ -1318,6 +2707,15 @@ void ArchivePrivate::_workerBody()
 
 				if ( archiveLastModified_ != fileInfo.lastModified() )
 				{
+					// lingering handle could point to replaced archive file, reopen it
+					if ( archiveDevice_->isOpen() )
+					{
+						_setTemporaryDisabled( true );
+						_closeArchiveDevice();
+						_setTemporaryDisabled( false );
+						lingerStartTime_ = QTime();
+					}
+
 					isArchiveDirty_ = true;
 					shouldOpen = true;
 					shouldUpdate = true;
@@ -1332,38 +2730,52 @@ void ArchivePrivate::_workerBody()
 		}
 
 		// open archive either for update or processing file requests or both
-		if ( shouldOpen && !archiveFile_.isOpen() )
+		if ( shouldOpen && !archiveDevice_->isOpen() )
 		{
 			// at this point archive file should be closed, so lets open it
+			// nested archive could move inside outer archive since last opening, resolve it again
 			_setTemporaryDisabled( true );
-			QIODevice::OpenMode flags = 0;
-			if ( openMode_ & Grim::Archive::ReadOnly )
-				flags |= QIODevice::ReadOnly;
-			if ( openMode_ & Grim::Archive::WriteOnly )
-				flags |= QIODevice::WriteOnly;
-			bool opened = archiveFile_.open( flags );
+			_resolveArchiveFile();
+			const bool opened = _openArchiveDevice();
 			_setTemporaryDisabled( false );
 
 			if ( !opened )
-			{
 				qWarning( "Grim::ArchivePrivate::_workerBody() : Failed to open archive in non locked mode." );
-			}
-			else if ( archiveFile_.isSequential() )
-			{
-				archiveFile_.close();
-				qWarning( "Grim::ArchivePrivate::_workerBody() : Cannot read sequential archive." );
-			}
 		}
 
 		// update archive contents if neccessary
 		if ( shouldUpdate )
 		{
-			if ( !archiveFile_.isOpen() )
+			const qint64 updateStartTime = archiveTimestamp();
+
+			if ( !archiveDevice_->isOpen() )
 				updatedSuccessfully = false;
 			else
 				updatedSuccessfully = _updateArchive();
 
+			// publish contents before waking up blocked openers, so all of them see sealed contents
+			if ( updatedSuccessfully && (openMode_ & Grim::Archive::Sealed) && !sealedContents_ )
+				_sealContents();
+
+			const qint64 updateTime = archiveTimestamp() - updateStartTime;
+
+			_publishStatistics( updateTime );
+
+			{
+				QWriteLocker jobLocker( &jobMutex_ );
+				_addLatency( statistics_.updateLatency, updateTime );
+				if ( !wasInitialUpdate_ )
+					statistics_.mountTime = updateTime;
+			}
+
 			QMutexLocker blockLocker( &blockMutex_ );
+
+			if ( !wasInitialUpdate_ )
+			{
+				readyTime_ = archiveTimestamp();
+				initialUpdateTime_ = readyTime_ - updateStartTime;
+			}
+
 			if ( !wasInitialUpdate_ && openMode_ & Archive::Block )
 			{
 				// we are in blocking mode, set isBroken_ flag right here
@@ -1374,43 +2786,70 @@ void ArchivePrivate::_workerBody()
 			blockWaiter_.wakeAll();
 		}
 
-		// check if we need to process requests for file operations
-		_processFileRequests( requestsCopy );
-
-		// close archive file if all file handlers were closed
-		if ( (openMode_ & Grim::Archive::DontLock) && openedFileInstances_.isEmpty() && archiveFile_.isOpen() )
+		if ( hasCommit )
 		{
-			_setTemporaryDisabled( true );
+			QWriteLocker jobLocker( &jobMutex_ );
+			commitsDone_ = commitRequests;
+			isLastCommitOk_ = committedSuccessfully && (!shouldUpdate || updatedSuccessfully);
+			commitWaiter_.wakeAll();
+		}
 
-			// reset last modified time while archive file is opened
-			QFileInfo fileInfo( archiveFile_ );
-			archiveLastModified_ = fileInfo.lastModified();
+		// check if we need to process requests for file operations
+		// requests queued during update-only pass will be processed on the next pass,
+		// when archive file is opened for them in non locked mode
+		if ( hasRequests )
+			_processFileRequests();
+
+		// prefetch listed files while nobody waits for worker
+		if ( wasInitialUpdate_ && archiveDevice_->isOpen() )
+			_processPrefetch();
+		else if ( wasInitialUpdate_ && _hasPrefetchJob() )
+			cancelPrefetch(); // archive file is unavailable, don't spin on prefetch queue
+
+		// close archive file if all file handlers were closed and linger time is over
+		if ( (openMode_ & Grim::Archive::DontLock) && archiveDevice_->isOpen() )
+		{
+			if ( !openedFileInstances_.isEmpty() )
+			{
+				lingerStartTime_ = QTime();
+			}
+			else
+			{
+				if ( lingerStartTime_.isNull() )
+				{
+					// reset last modified time while archive file is opened, once per lingering
+					// for nested archives archiveFile_ is the outer archive, so check fileName_ instead
+					_setTemporaryDisabled( true );
+					QFileInfo fileInfo( fileName_ );
+					archiveLastModified_ = fileInfo.lastModified();
+					_setTemporaryDisabled( false );
+
+					lingerStartTime_.start();
+				}
 
-			archiveFile_.close();
+				if ( lingerStartTime_.elapsed() >= lingerTime() )
+				{
+					_setTemporaryDisabled( true );
+					_closeArchiveDevice();
+					_setTemporaryDisabled( false );
 
-			_setTemporaryDisabled( false );
+					lingerStartTime_ = QTime();
+				}
+			}
 		}
 
-		// if state was changed during archive update - invoke method in archive's thread
-		// to set changes synchronously
+		// if state was changed during archive update - report it to archive's thread,
+		// file requests are not stalled until it gets there
 		{
-			QWriteLocker invokationLocker( &invokationMutex_ );
-
 			if ( isWorkerAborted_ )
 				break;
 
-			const bool wasBroken = isBroken_;
+			// compare with the last reported flag, archive's thread could not apply it yet
+			const bool wasBroken = reportedState_ & 1;
 			const bool nowBroken = shouldUpdate ? !updatedSuccessfully : wasBroken;
 
 			if ( (!storedWasInitialUpdate && wasInitialUpdate_) || wasBroken != nowBroken )
-			{
-				int state = Archive::State_Ready;
-				bool isBroken = nowBroken;
-
-				isInvoked_ = true;
-				QCoreApplication::postEvent( this, new StateChangedEvent( state, isBroken ) );
-				invokationWaiter_.wait( &invokationMutex_ );
-			}
+				_reportState( Archive::State_Ready, nowBroken );
 		}
 	}
 }
@@ -1427,16 +2866,21 @@ bool ArchivePrivate::_updateArchive()
 		return false;
 
 	globalComment_ = QString();
+	appendOffset_ = -1;
 
 	// here goes actual update
-	const bool isLoaded = _loadCentralDirectory();
+	const Archive::Type type = _detectType();
+	const bool isLoaded = type == Archive::Type_GrimPack ? _loadPackIndex() : _loadCentralDirectory();
 
 	if ( !isLoaded )
 	{
 		// broken archive, will stay dirty regardless at which mode it is opened, locked or not
+		type_ = Archive::Type_Unknown;
 		return false;
 	}
 
+	type_ = type;
+
 	// destroy all disappeared entries since this update
 	// this also unlinks file instances that are points to them
 
@@ -1466,7 +2910,7 @@ bool ArchivePrivate::_updateArchive()
 				entryForFilePath_.remove( entryToDelete->info.filePath );
 
 				// unlink opened files
-				for ( QListIterator<ArchiveFileInstance> it( entryToDelete->fileInstances ); it.hasNext(); )
+				for ( QSetIterator<ArchiveFileInstance> it( entryToDelete->fileInstances ); it.hasNext(); )
 				{
 					const ArchiveFileInstance & fileInstance = it.next();
 
@@ -1478,7 +2922,7 @@ bool ArchivePrivate::_updateArchive()
 					fileInstance.d->file->entry_ = 0;
 
 					Q_ASSERT( linkedFileInstances_.contains( fileInstance ) );
-					linkedFileInstances_.removeOne( fileInstance );
+					linkedFileInstances_.remove( fileInstance );
 
 					QWriteLocker fileRequestLocker( &fileInstance.d->file->requestMutex_ );
 					if ( fileInstance.d->file->request_ )
@@ -1510,10 +2954,65 @@ bool ArchivePrivate::_updateArchive()
 
 	isArchiveDirty_ = false;
 
+	{
+		QMutexLocker queryLocker( &queryMutex_ );
+		isQueryIndexDirty_ = true;
+	}
+
+	_buildFoldedIndex();
+
+	// reload small files while contents are still locked, so nobody sees offsets into stale arena
+	_loadSmallFiles();
+
 	return true;
 }
 
 
+/**
+ * Publishes current contents as immutable sealed contents.
+ * Called from worker once after successful initial update in Sealed mode.
+ */
+void ArchivePrivate::_sealContents()
+{
+	QExplicitlySharedDataPointer<ArchiveSealedContents> sealedContents( new ArchiveSealedContents );
+	sealedContents->entryForFilePath_ = entryForFilePath_;
+	sealedContents->entryForFoldedPath_ = entryForFoldedPath_;
+	sealedContents->rootEntry_ = rootEntry_;
+
+#ifdef Q_OS_UNIX
+	// own descriptor keeps stored data readable for files even after archive is closed
+	if ( archiveDevice_ == &archiveFile_ && archiveFile_.handle() != -1 )
+	{
+		sealedContents->fileHandle_ = ::dup( archiveFile_.handle() );
+		sealedContents->archiveOffset_ = archiveOffset_;
+	}
+#endif
+
+	QWriteLocker contentsLocker( &contentsMutex_ );
+	sealedContents_ = sealedContents;
+}
+
+
+/**
+ * Detects format of the archive by its leading signature.
+ * Everything that is not a Grim pack is treated as Zip, because Zip archives
+ * could be prefixed with arbitrary data like self-extracting stub.
+ */
+Archive::Type ArchivePrivate::_detectType()
+{
+	if ( !_seekArchive( 0 ) )
+		return Archive::Type_Zip;
+
+	QDataStream ds( archiveDevice_ );
+	ds.setByteOrder( QDataStream::LittleEndian );
+
+	quint32 signature = 0;
+	ds >> signature;
+
+	return ds.status() == QDataStream::Ok && signature == PackSignature ? Archive::Type_GrimPack : Archive::Type_Zip;
+}
+
+
 /**
  * Low-level Zip-archive parser, that extracts all entries.
  */
@@ -1522,34 +3021,70 @@ bool ArchivePrivate::_loadCentralDirectory()
 	// Central Directory must started at:
 	// file size - end header - comment length
 
-	const int archiveFileSize = archiveFile_.size();
+	const qint64 archiveFileSize = _archiveSize();
 
-	QDataStream ds( &archiveFile_ );
+	QDataStream ds( archiveDevice_ );
 	ds.setByteOrder( QDataStream::LittleEndian );
 
 	EndOfCentralDirectoryStruct endOfCentralDirectory;
 
-	// check if archive has no comment
-	for ( int commentLength = 0; ; ++commentLength )
+	// committed archive ends with end record, unless writing was interrupted before commit,
+	// then end record is found at committed size persisted in commit journal
+	const qint64 journalCommittedSize = archiveFileSize == 0 ? -1 : _readCommitJournal();
+
+	qint64 endOfCentralDirectoryOffset = -1;
+	if ( archiveFileSize != 0 )
+	{
+		endOfCentralDirectoryOffset = _findEndOfCentralDirectory( archiveFileSize, journalCommittedSize != -1 );
+		if ( endOfCentralDirectoryOffset == -1 && journalCommittedSize > 0 && journalCommittedSize <= archiveFileSize )
+			endOfCentralDirectoryOffset = _findEndOfCentralDirectory( journalCommittedSize, true );
+	}
+
+	qint64 committedSize = 0;
+
+	if ( endOfCentralDirectoryOffset == -1 )
+	{
+		// new archive opened for writing, start with empty central directory,
+		// the same for archive that had nothing committed before writing was interrupted
+		if ( (archiveFileSize != 0 && journalCommittedSize != 0) || !(openMode_ & Grim::Archive::WriteOnly) )
+			return false;
+
+		endOfCentralDirectory.numberOfEntriesTotal = 0;
+		endOfCentralDirectory.sizeOfTheCentralDirectory = 0;
+		endOfCentralDirectory.offsetOfCentralDirectory = 0;
+	}
+	else
 	{
-		if ( !archiveFile_.seek( archiveFileSize - 4 - EndOfCentralDirectorySize - commentLength ) ) // 4 bytes for signature
+		if ( !_seekArchive( endOfCentralDirectoryOffset ) )
 			return false;
 
 		ds >> endOfCentralDirectory;
 
-		if ( ds.status() == QDataStream::Ok )
-			break;
+		if ( ds.status() != QDataStream::Ok )
+			return false;
+
+		committedSize = _archivePos();
 	}
 
 	// save global archive comment
 	globalComment_ = endOfCentralDirectory.zipFileComment;
 
+	if ( openMode_ & Grim::Archive::LazyEntries )
+	{
+		if ( !_loadLazyIndex( endOfCentralDirectory.offsetOfCentralDirectory,
+				endOfCentralDirectory.sizeOfTheCentralDirectory, endOfCentralDirectory.numberOfEntriesTotal ) )
+			return false;
+
+		return _startAppending( endOfCentralDirectory.offsetOfCentralDirectory,
+			endOfCentralDirectory.sizeOfTheCentralDirectory, committedSize );
+	}
+
 	// now we know exact number or entries, so reserve buckets for file paths
 	static const int MaxBuckets = 65536;
 	entryForFilePath_.reserve( qMin<int>( endOfCentralDirectory.numberOfEntriesTotal, MaxBuckets ) );
 
 	// collect file headers one by one
-	if ( !archiveFile_.seek( endOfCentralDirectory.offsetOfCentralDirectory ) )
+	if ( !_seekArchive( endOfCentralDirectory.offsetOfCentralDirectory ) )
 		return false;
 
 	for ( int i = 0; i < endOfCentralDirectory.numberOfEntriesTotal; ++i )
@@ -1564,7 +3099,7 @@ bool ArchivePrivate::_loadCentralDirectory()
 			return false;
 
 		// check if file headers exceeded size of central directory
-		if ( archiveFile_.pos() - endOfCentralDirectory.offsetOfCentralDirectory > endOfCentralDirectory.sizeOfTheCentralDirectory )
+		if ( _archivePos() - endOfCentralDirectory.offsetOfCentralDirectory > endOfCentralDirectory.sizeOfTheCentralDirectory )
 			return false;
 
 		// abort loading if archive closes
@@ -1580,15 +3115,452 @@ bool ArchivePrivate::_loadCentralDirectory()
 		return false;
 #endif
 
-	if ( archiveFile_.pos() - endOfCentralDirectory.offsetOfCentralDirectory != endOfCentralDirectory.sizeOfTheCentralDirectory )
+	if ( _archivePos() - endOfCentralDirectory.offsetOfCentralDirectory != endOfCentralDirectory.sizeOfTheCentralDirectory )
 		return false;
 
-	return true;
+	return _startAppending( endOfCentralDirectory.offsetOfCentralDirectory,
+		endOfCentralDirectory.sizeOfTheCentralDirectory, committedSize );
 }
 
 
-/** \internal
- * Converts DOS date/time format to Qt.
+/**
+ * Searches backward for end of central directory record, which ends together with its comment
+ * not further than \a endOffset, or exactly there if \a isExactEnd is \c true.
+ * Only the tail that could hold the record with the longest comment is read.
+ * Record is accepted only if central directory lies right before it and starts with file header,
+ * so signature bytes met inside data of files written after the last commit are skipped.
+ * Returns offset of the record or -1 if there is no such.
+ */
+qint64 ArchivePrivate::_findEndOfCentralDirectory( qint64 endOffset, bool isExactEnd )
+{
+	static const int RecordSize = 4 + EndOfCentralDirectorySize; // 4 bytes for signature
+	static const int MaxCommentSize = 0xffff;
+
+	// don't step out of nested archive boundaries
+	const qint64 tailOffset = qMax( Q_INT64_C(0), endOffset - RecordSize - MaxCommentSize );
+	if ( endOffset - tailOffset < RecordSize || !_seekArchive( tailOffset ) )
+		return -1;
+
+	const QByteArray tail = archiveDevice_->read( endOffset - tailOffset );
+	if ( tail.size() != endOffset - tailOffset )
+		return -1;
+
+	for ( int pos = tail.size() - RecordSize; pos >= 0; --pos )
+	{
+		const uchar * record = reinterpret_cast<const uchar*>( tail.constData() + pos );
+		if ( qFromLittleEndian<quint32>( record ) != EndOfCentralDirectorySignature )
+			continue;
+
+		const qint64 recordOffset = tailOffset + pos;
+		const qint64 centralDirectorySize = qFromLittleEndian<quint32>( record + 12 );
+		const qint64 centralDirectoryOffset = qFromLittleEndian<quint32>( record + 16 );
+		const qint64 recordEnd = recordOffset + RecordSize + qFromLittleEndian<quint16>( record + 20 );
+
+		if ( recordEnd > endOffset || (isExactEnd && recordEnd != endOffset) )
+			continue;
+
+		if ( centralDirectoryOffset + centralDirectorySize != recordOffset )
+			continue;
+
+		// central directory of empty archive has no file headers at all
+		if ( centralDirectorySize > 0 )
+		{
+			uchar signature[ 4 ];
+			if ( !_seekArchive( centralDirectoryOffset ) ||
+				archiveDevice_->read( reinterpret_cast<char*>( signature ), sizeof(signature) ) != (qint64)sizeof(signature) ||
+				qFromLittleEndian<quint32>( signature ) != CentralFileHeaderSignature )
+				continue;
+		}
+
+		return recordOffset;
+	}
+
+	return -1;
+}
+
+
+/**
+ * Remembers committed central directory at \a centralDirectoryOffset of \a centralDirectorySize bytes,
+ * after which written files are appended, if archive is opened for writing.
+ * Called on update, which happens only on opening and after commit, when no file is written.
+ * Data after \a committedSize was left by writing interrupted before commit, so it is cut off
+ * only now, when committed contents were loaded successfully.
+ */
+bool ArchivePrivate::_startAppending( qint64 centralDirectoryOffset, qint64 centralDirectorySize, qint64 committedSize )
+{
+	if ( !(openMode_ & Grim::Archive::WriteOnly) )
+		return true;
+
+	if ( committedSize < _archiveSize() && (!archiveFile_.resize( committedSize ) || !_syncArchive()) )
+		return false;
+
+	// archive file ends with committed contents again
+	if ( isCommitJournalWritten_ || _readCommitJournal() != -1 )
+		_removeCommitJournal();
+
+	centralDirectoryOffset_ = centralDirectoryOffset;
+	centralDirectorySize_ = centralDirectorySize;
+	committedSize_ = committedSize;
+	appendOffset_ = committedSize;
+
+	return true;
+}
+
+
+/** \internal
+ * Returns \c true if lazy name with the given \a hash is already listed in \a nameForPathHash.
+ */
+static bool _containsLazyName( const QMultiHash<uint,ArchiveLazyName> & nameForPathHash, uint hash,
+	const char * directory, const char * name, int nameSize )
+{
+	for ( QMultiHash<uint,ArchiveLazyName>::ConstIterator it = nameForPathHash.constFind( hash );
+		it != nameForPathHash.constEnd() && it.key() == hash; ++it )
+	{
+		const ArchiveLazyName & other = it.value();
+		if ( other.nameSize == nameSize && memcmp( directory + other.record + CentralFileHeaderSize, name, nameSize ) == 0 )
+			return true;
+	}
+	return false;
+}
+
+
+/**
+ * Reads \a size bytes of central directory with \a count records at \a offset at once
+ * and hashes names of files and implied directories, instead of constructing entries.
+ * Entries constructed before this update are checked against new central directory,
+ * the rest of entries will be constructed when they will be accessed.
+ */
+bool ArchivePrivate::_loadLazyIndex( qint64 offset, qint64 size, int count )
+{
+	if ( !_seekArchive( offset ) )
+		return false;
+
+	const QByteArray directory = archiveDevice_->read( size );
+	if ( directory.size() != size )
+		return false;
+
+	QMultiHash<uint,ArchiveLazyName> nameForPathHash;
+	QMultiHash<uint,ArchiveLazyName> childForDirHash;
+	nameForPathHash.reserve( count );
+	childForDirHash.reserve( count );
+
+	const char * data = directory.constData();
+
+	int pos = 0;
+	for ( int i = 0; i < count; ++i )
+	{
+		if ( pos + CentralFileHeaderSize > directory.size() )
+			return false;
+
+		const uchar * record = reinterpret_cast<const uchar*>( data + pos );
+		if ( qFromLittleEndian<quint32>( record ) != CentralFileHeaderSignature )
+			return false;
+
+		const int nameSize = qFromLittleEndian<quint16>( record + 28 );
+		const int recordSize = CentralFileHeaderSize + nameSize +
+			qFromLittleEndian<quint16>( record + 30 ) + qFromLittleEndian<quint16>( record + 32 );
+
+		if ( pos + recordSize > directory.size() )
+			return false;
+
+		// the same restrictions as for eagerly added file headers
+		const char * name = data + pos + CentralFileHeaderSize;
+		if ( nameSize == 0 || name[ 0 ] == '/' )
+			return false;
+
+		// implied directories, each one is listed once
+		int parentSize = 0;
+		for ( int j = 0; j < nameSize; ++j )
+		{
+			if ( name[ j ] != '/' )
+				continue;
+
+			const uint hash = ::qHash( QByteArray::fromRawData( name, j ) );
+			if ( !_containsLazyName( nameForPathHash, hash, data, name, j ) )
+			{
+				const ArchiveLazyName dirName = { pos, j };
+				nameForPathHash.insert( hash, dirName );
+				childForDirHash.insert( ::qHash( QByteArray::fromRawData( name, parentSize ) ), dirName );
+			}
+
+			parentSize = j;
+		}
+
+		if ( name[ nameSize - 1 ] != '/' )
+		{
+			// later record with the same name overrides earlier one, as it is found first
+			const ArchiveLazyName fileName = { pos, nameSize };
+			nameForPathHash.insert( ::qHash( QByteArray::fromRawData( name, nameSize ) ), fileName );
+			childForDirHash.insert( ::qHash( QByteArray::fromRawData( name, parentSize ) ), fileName );
+		}
+
+		pos += recordSize;
+
+		// abort loading if archive closes
+		if ( isWorkerAborted_ )
+			return false;
+	}
+
+	if ( pos != directory.size() )
+		return false;
+
+	lazyDirectory_ = directory;
+	lazyNameForPathHash_ = nameForPathHash;
+	lazyChildForDirHash_ = childForDirHash;
+
+	// check already constructed entries, disappeared ones will be destroyed by update
+	rootEntry_->isPopulated = false;
+
+	const QList<ArchiveEntry*> entries = entryForFilePath_.values();
+	for ( QListIterator<ArchiveEntry*> it( entries ); it.hasNext(); )
+	{
+		ArchiveEntry * entry = it.next();
+		if ( entry == rootEntry_ )
+			continue;
+
+		// entries constructed since the last update are not marked yet
+		entry->existedBeforeUpdate = true;
+		entry->existedAfterUpdate = false;
+		entry->changedAfterUpdate = false;
+	}
+
+	for ( QListIterator<ArchiveEntry*> it( entries ); it.hasNext(); )
+	{
+		ArchiveEntry * entry = it.next();
+		if ( entry == rootEntry_ )
+			continue;
+
+		ArchiveLazyName lazyName;
+		if ( !_findLazyName( entry->info.filePath.toUtf8(), lazyName ) || _isLazyDir( lazyName ) != entry->info.isDir )
+			continue;
+
+		if ( entry->info.isDir )
+		{
+			// new children could appear
+			entry->existedAfterUpdate = true;
+			entry->isPopulated = false;
+		}
+		else
+		{
+			// refreshes info of existing entry
+			if ( !_materializeLazyName( lazyName ) )
+				return false;
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ * Looks up name of file or implied directory with the given UTF-8 encoded \a filePath.
+ */
+bool ArchivePrivate::_findLazyName( const QByteArray & filePath, ArchiveLazyName & lazyName ) const
+{
+	const uint hash = ::qHash( filePath );
+	for ( QMultiHash<uint,ArchiveLazyName>::ConstIterator it = lazyNameForPathHash_.constFind( hash );
+		it != lazyNameForPathHash_.constEnd() && it.key() == hash; ++it )
+	{
+		const ArchiveLazyName & other = it.value();
+		if ( other.nameSize == filePath.size() &&
+			memcmp( lazyDirectory_.constData() + other.record + CentralFileHeaderSize, filePath.constData(), filePath.size() ) == 0 )
+		{
+			lazyName = other;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/**
+ * Returns \c true if \a lazyName is a leading part of file name, i.e. implied directory.
+ */
+bool ArchivePrivate::_isLazyDir( const ArchiveLazyName & lazyName ) const
+{
+	const uchar * record = reinterpret_cast<const uchar*>( lazyDirectory_.constData() + lazyName.record );
+	return lazyName.nameSize < qFromLittleEndian<quint16>( record + 28 );
+}
+
+
+/**
+ * Constructs entry for \a lazyName and missing parent directories,
+ * or refreshes info of existing file entry.
+ * Returns constructed entry or 0 if central directory record is corrupted.
+ */
+ArchiveEntry * ArchivePrivate::_materializeLazyName( const ArchiveLazyName & lazyName )
+{
+	const char * name = lazyDirectory_.constData() + lazyName.record + CentralFileHeaderSize;
+
+	FileHeaderStruct fileHeader;
+
+	if ( _isLazyDir( lazyName ) )
+	{
+		// trailing slash adds directories only
+		fileHeader.fileName = QString::fromUtf8( name, lazyName.nameSize );
+		fileHeader.fileName += QLatin1Char( '/' );
+	}
+	else
+	{
+		QDataStream ds( QByteArray::fromRawData( lazyDirectory_.constData() + lazyName.record,
+			lazyDirectory_.size() - lazyName.record ) );
+		ds.setByteOrder( QDataStream::LittleEndian );
+		ds >> fileHeader;
+
+		if ( ds.status() != QDataStream::Ok )
+			return 0;
+	}
+
+	if ( !_addFileHeader( &fileHeader ) )
+		return 0;
+
+	return entryForFilePath_.value( QString::fromUtf8( name, lazyName.nameSize ) );
+}
+
+
+/**
+ * Low-level Grim pack parser, that extracts all entries.
+ * Index is read at once and parsed in memory, block table is kept for reading entries.
+ */
+bool ArchivePrivate::_loadPackIndex()
+{
+	const qint64 archiveFileSize = _archiveSize();
+
+	if ( !_seekArchive( 0 ) )
+		return false;
+
+	QDataStream ds( archiveDevice_ );
+	ds.setByteOrder( QDataStream::LittleEndian );
+
+	PackHeaderStruct header;
+	ds >> header;
+
+	if ( ds.status() != QDataStream::Ok || header.version != PackVersion )
+		return false;
+
+	if ( header.blockSize == 0 || header.blockSize > (quint32)PackMaxBlockSize )
+		return false;
+
+	const qint64 blockTableSize = qint64( header.blockCount ) * PackBlockRecordSize;
+	const qint64 entryTableSize = qint64( header.entryCount ) * PackEntryRecordSize;
+	const qint64 blockRefsSize = qint64( header.blockRefCount ) * 4;
+	const qint64 indexSize = blockTableSize + entryTableSize + blockRefsSize + header.namesSize;
+
+	// limited by QByteArray
+	if ( indexSize > 0x7fffffff )
+		return false;
+
+	if ( header.indexOffset < (quint64)PackHeaderSize || header.indexOffset + indexSize > (quint64)archiveFileSize )
+		return false;
+
+	if ( !_seekArchive( header.indexOffset ) )
+		return false;
+
+	const QByteArray index = archiveDevice_->read( indexSize );
+	if ( index.size() != indexSize )
+		return false;
+
+	const uchar * blockTable = reinterpret_cast<const uchar*>( index.constData() );
+	const uchar * entryTable = blockTable + blockTableSize;
+	const uchar * blockRefTable = entryTable + entryTableSize;
+	const char * names = reinterpret_cast<const char*>( blockRefTable + blockRefsSize );
+
+	QVector<ArchivePackBlock> blocks( header.blockCount );
+	for ( int i = 0; i < blocks.count(); ++i )
+	{
+		const uchar * record = blockTable + i*PackBlockRecordSize;
+
+		ArchivePackBlock & block = blocks[ i ];
+		block.offset = qFromLittleEndian<quint64>( record );
+		block.compressedSize = qFromLittleEndian<quint32>( record + 8 );
+		block.size = qFromLittleEndian<quint32>( record + 12 );
+
+		if ( block.size <= 0 || block.size > (int)header.blockSize ||
+			block.compressedSize <= 0 || block.compressedSize > block.size ||
+			block.offset < PackHeaderSize || block.offset + block.compressedSize > (qint64)header.indexOffset )
+			return false;
+	}
+
+	QVector<quint32> blockRefs( header.blockRefCount );
+	for ( int i = 0; i < blockRefs.count(); ++i )
+	{
+		blockRefs[ i ] = qFromLittleEndian<quint32>( blockRefTable + i*4 );
+		if ( blockRefs.at( i ) >= header.blockCount )
+			return false;
+	}
+
+	// now we know exact number or entries, so reserve buckets for file paths
+	static const int MaxBuckets = 65536;
+	entryForFilePath_.reserve( qMin<int>( header.entryCount, MaxBuckets ) );
+
+	for ( quint32 i = 0; i < header.entryCount; ++i )
+	{
+		const uchar * record = entryTable + i*PackEntryRecordSize;
+
+		const quint32 nameOffset = qFromLittleEndian<quint32>( record );
+		const quint32 nameSize = qFromLittleEndian<quint32>( record + 4 );
+		const quint64 size = qFromLittleEndian<quint64>( record + 8 );
+		const quint32 blockRef = qFromLittleEndian<quint32>( record + 16 );
+
+		if ( qint64( nameOffset ) + nameSize > header.namesSize )
+			return false;
+
+		// sizes are limited to 32 bits for now, the same as for Zip archives without Zip64 extension
+		if ( size > 0xffffffff )
+			return false;
+
+		const qint64 blockCount = (size + header.blockSize - 1) / header.blockSize;
+		if ( qint64( blockRef ) + blockCount > header.blockRefCount )
+			return false;
+
+		// every block except the last one should be full, so block of any position is found without scanning
+		qint64 compressedSize = 0;
+		for ( int j = 0; j < blockCount; ++j )
+		{
+			const ArchivePackBlock & block = blocks.at( blockRefs.at( blockRef + j ) );
+			const qint64 expectedSize = j < blockCount - 1 ? header.blockSize : size - qint64( j )*header.blockSize;
+			if ( block.size != expectedSize )
+				return false;
+			compressedSize += block.compressedSize;
+		}
+
+		FileHeaderStruct fileHeader;
+		fileHeader.compressionMethod = 0;
+		fileHeader.compressedSize = (quint32)size;
+		fileHeader.uncompressedSize = (quint32)size;
+		fileHeader.crc32 = qFromLittleEndian<quint32>( record + 20 );
+		fileHeader.modTime = qFromLittleEndian<quint16>( record + 24 );
+		fileHeader.modDate = qFromLittleEndian<quint16>( record + 26 );
+		fileHeader.localHeaderOffset = 0;
+		fileHeader.fileName = QString::fromUtf8( names + nameOffset, nameSize );
+
+		if ( !_addFileHeader( &fileHeader ) )
+			return false;
+
+		// directory path without file name
+		ArchiveEntry * entry = entryForFilePath_.value( fileHeader.fileName );
+		if ( !entry || entry->info.isDir )
+			continue;
+
+		entry->info.packBlockRef = blockRef;
+		entry->info.dataOffset = blockCount > 0 ? blocks.at( blockRefs.at( blockRef ) ).offset : 0;
+		entry->info.compressedSize = compressedSize;
+
+		// abort loading if archive closes
+		if ( isWorkerAborted_ )
+			return false;
+	}
+
+	packBlockSize_ = header.blockSize;
+	packBlocks_ = blocks;
+	packBlockRefs_ = blockRefs;
+
+	return true;
+}
+
+
+/** \internal
+ * Converts DOS date/time format to Qt.
  */
 inline QDateTime from_dos_date_time( int date, int time )
 {
@@ -1607,6 +3579,27 @@ inline QDateTime from_dos_date_time( int date, int time )
 }
 
 
+/** \internal
+ * Converts Qt date/time to DOS format.
+ */
+inline void to_dos_date_time( const QDateTime & dateTime, quint16 & date, quint16 & time )
+{
+	const QDate d = dateTime.date();
+	const QTime t = dateTime.time();
+
+	if ( !dateTime.isValid() || d.year() < 1980 )
+	{
+		// earliest possible DOS date: 1980-01-01 00:00:00
+		date = (1 << 5) | 1;
+		time = 0;
+		return;
+	}
+
+	date = ((d.year() - 1980) << 9) | (d.month() << 5) | d.day();
+	time = (t.hour() << 11) | (t.minute() << 5) | (t.second() / 2);
+}
+
+
 /**
  * Adds founded file header from central directory.
  * This also constructs all directories above this entry.
@@ -1739,6 +3732,13 @@ bool ArchivePrivate::_addFileHeader( const void * fileHeaderP )
 	entry->info.isSequential = fileHeader.compressionMethod != 0;
 	entry->info.isDir = false;
 
+	if ( entry->info.packBlockRef != -1 )
+	{
+		// archive was replaced with Zip one, cached data offset points into block table
+		entry->info.packBlockRef = -1;
+		entry->info.dataOffset = -1;
+	}
+
 	if ( !existedBefore )
 	{
 		entry->parentEntry = parentEntry;
@@ -1751,360 +3751,2076 @@ bool ArchivePrivate::_addFileHeader( const void * fileHeaderP )
 }
 
 
-/**
- * Processes \a requests in the worker thread.
+/** \internal
+ * Orders entries by their paths.
  */
-void ArchivePrivate::_processFileRequests( QList<ArchiveFileRequest*> & requests )
+static bool _entryLessThan( const ArchiveEntry * a, const ArchiveEntry * b )
 {
-	while ( true )
+	return a->info.filePath < b->info.filePath;
+}
+
+
+/** \internal
+ * Orders lazy names by their UTF-8 encoded paths, bytes order matches order of code points.
+ */
+class ArchiveLazyNameLessThan
+{
+public:
+	ArchiveLazyNameLessThan( const char * directory ) :
+		directory_( directory )
+	{}
+
+	bool operator()( const ArchiveLazyName & a, const ArchiveLazyName & b ) const
 	{
-		QReadLocker contentsLocker( &contentsMutex_ );
+		const int result = memcmp( directory_ + a.record + CentralFileHeaderSize,
+			directory_ + b.record + CentralFileHeaderSize, qMin( a.nameSize, b.nameSize ) );
+		if ( result != 0 )
+			return result < 0;
+		if ( a.nameSize != b.nameSize )
+			return a.nameSize < b.nameSize;
+		return a.record < b.record;
+	}
 
-		if ( isWorkerAborted_ )
-		{
-			// archive is closing, unlink all the given requests and wake them up
+private:
+	const char * directory_;
+};
 
-			QWriteLocker linkedFileInstancesLocker( &linkedFileInstancesMutex_ );
 
-			// release copied requests and unlink them
-			while ( !requests.isEmpty() )
-			{
-				ArchiveFileRequest * request = requests.takeFirst();
+/** \internal
+ * Returns \c true if \a fileName matches any of \a filters or \a filters are empty.
+ */
+static bool _matchesNameFilters( const QString & fileName, const QList<QRegExp> & filters )
+{
+	if ( filters.isEmpty() )
+		return true;
 
-				Q_ASSERT( request->file()->entry_ );
-				Q_ASSERT( request->file()->entry_->fileInstances.contains( request->file()->fileInstance_ ) );
+	for ( QListIterator<QRegExp> it( filters ); it.hasNext(); )
+		if ( it.next().exactMatch( fileName ) )
+			return true;
+
+	return false;
+}
 
-				_cleanupOpenedFile( request->file() );
 
-				request->file()->entry_->fileInstances.removeOne( request->file()->fileInstance_ );
-				request->file()->entry_ = 0;
+/**
+ * Returns descriptors of entries under \a prefix matching \a nameFilters.
+ * See Archive::query() for details.
+ */
+QList<Archive::EntryInfo> ArchivePrivate::query( const QString & prefix, const QStringList & nameFilters, Archive::QueryFlags flags )
+{
+	QList<Archive::EntryInfo> infos;
 
-				Q_ASSERT( linkedFileInstances_.contains( request->file()->fileInstance_ ) );
-				linkedFileInstances_.removeOne( request->file()->fileInstance_ );
+	QReadLocker contentsLocker( &contentsMutex_ );
 
-				QWriteLocker fileRequestLocker( &request->file()->requestMutex_ );
-				request->file()->request_ = 0;
-				request->file()->requestWaiter_.wakeOne();
-			}
-			return;
+	if ( openMode_ == Grim::Archive::NotOpen )
+		return infos;
+
+	if ( !(openMode_ & Grim::Archive::Block) )
+	{
+		// wait until archive will be updated first time
+		QMutexLocker blockLocker( &blockMutex_ );
+		if ( !wasInitialUpdate_ )
+		{
+			contentsMutex_.unlock();
+			blockWaiter_.wait( &blockMutex_ );
+			contentsMutex_.lockForRead();
 		}
+	}
 
-		if ( requests.isEmpty() )
-			break;
+	// prefix is a directory path, so "sounds" does not match "soundsfx/"
+	QString dirPrefix = prefix;
+	while ( dirPrefix.startsWith( QLatin1Char( '/' ) ) )
+		dirPrefix.remove( 0, 1 );
+	if ( !dirPrefix.isEmpty() && !dirPrefix.endsWith( QLatin1Char( '/' ) ) )
+		dirPrefix += QLatin1Char( '/' );
 
-		ArchiveFileRequest * request = requests.takeFirst();
+	const Qt::CaseSensitivity caseSensitivity = flags & Archive::Query_CaseInsensitive ? Qt::CaseInsensitive : Qt::CaseSensitive;
+	QList<QRegExp> filters;
+	for ( QStringListIterator it( nameFilters ); it.hasNext(); )
+		filters << QRegExp( it.next(), caseSensitivity, QRegExp::Wildcard );
 
-		bool done = false;
+	QMutexLocker queryLocker( &queryMutex_ );
+
+	_buildQueryIndex();
+
+	if ( (openMode_ & Grim::Archive::LazyEntries) && type_ == Archive::Type_Zip )
+	{
+		const QByteArray bytePrefix = dirPrefix.toUtf8();
+		const char * directory = lazyDirectory_.constData();
+
+		// locate the first name not less than prefix
+		int first = 0;
+		int last = queryLazyNames_.count();
+		while ( first < last )
+		{
+			const int middle = (first + last) / 2;
+			const ArchiveLazyName & lazyName = queryLazyNames_.at( middle );
+			const int result = memcmp( directory + lazyName.record + CentralFileHeaderSize, bytePrefix.constData(),
+				qMin( lazyName.nameSize, bytePrefix.size() ) );
+			if ( result < 0 || (result == 0 && lazyName.nameSize < bytePrefix.size()) )
+				first = middle + 1;
+			else
+				last = middle;
+		}
+
+		for ( int i = first; i < queryLazyNames_.count(); ++i )
+		{
+			const ArchiveLazyName & lazyName = queryLazyNames_.at( i );
+			const char * name = directory + lazyName.record + CentralFileHeaderSize;
+
+			if ( lazyName.nameSize < bytePrefix.size() || memcmp( name, bytePrefix.constData(), bytePrefix.size() ) != 0 )
+				break;
+
+			const char * relativeName = name + bytePrefix.size();
+			const int relativeNameSize = lazyName.nameSize - bytePrefix.size();
+			if ( !(flags & Archive::Query_Recursive) && memchr( relativeName, '/', relativeNameSize ) )
+				continue;
+
+			if ( _isLazyDir( lazyName ) && !(flags & Archive::Query_Dirs) )
+				continue;
+
+			int nameStart = relativeNameSize;
+			while ( nameStart > 0 && relativeName[ nameStart - 1 ] != '/' )
+				nameStart--;
+
+			if ( !_matchesNameFilters( QString::fromUtf8( relativeName + nameStart, relativeNameSize - nameStart ), filters ) )
+				continue;
+
+			Archive::EntryInfo info;
+			if ( _lazyEntryInfo( lazyName, info ) )
+				infos << info;
+		}
+
+		return infos;
+	}
+
+	const ArchiveEntry * const * entries = queryEntries_.constData();
+	const ArchiveEntry * const * entriesEnd = entries + queryEntries_.count();
+
+	// locate the first path not less than prefix
+	int first = 0;
+	int last = queryEntries_.count();
+	while ( first < last )
+	{
+		const int middle = (first + last) / 2;
+		if ( entries[ middle ]->info.filePath < dirPrefix )
+			first = middle + 1;
+		else
+			last = middle;
+	}
+
+	for ( const ArchiveEntry * const * it = entries + first; it != entriesEnd; ++it )
+	{
+		const ArchiveEntry * entry = *it;
+
+		if ( !entry->info.filePath.startsWith( dirPrefix ) )
+			break;
+
+		if ( !(flags & Archive::Query_Recursive) && entry->info.filePath.indexOf( QLatin1Char( '/' ), dirPrefix.length() ) != -1 )
+			continue;
+
+		if ( entry->info.isDir && !(flags & Archive::Query_Dirs) )
+			continue;
+
+		if ( !_matchesNameFilters( entry->info.fileName, filters ) )
+			continue;
+
+		Archive::EntryInfo info;
+		info.filePath = entry->info.filePath;
+		info.isDir = entry->info.isDir;
+		info.size = entry->info.size;
+		info.compressedSize = entry->info.compressedSize;
+		info.crc32 = entry->info.crc32;
+		info.modTime = entry->info.modTime;
+
+		if ( !entry->info.isDir )
+		{
+			if ( entry->info.packBlockRef != -1 )
+				info.method = Archive::Method_Blocks;
+			else if ( !entry->info.canRead )
+				info.method = Archive::Method_Unknown;
+			else
+				info.method = entry->info.isSequential ? Archive::Method_Deflate : Archive::Method_Store;
+
+			info.offset = entry->info.packBlockRef != -1 ? entry->info.dataOffset : entry->info.localFileHeaderOffset;
+		}
+
+		infos << info;
+	}
+
+	return infos;
+}
+
+
+/**
+ * Rebuilds index of case folded paths of all entries in CaseInsensitive mode.
+ * Called at the end of update with contents locked for writing.
+ */
+void ArchivePrivate::_buildFoldedIndex()
+{
+	entryForFoldedPath_.clear();
+
+	if ( !(openMode_ & Grim::Archive::CaseInsensitive) )
+		return;
+
+	entryForFoldedPath_.reserve( entryForFilePath_.count() );
+
+	for ( QHash<QString,ArchiveEntry*>::ConstIterator it = entryForFilePath_.constBegin(); it != entryForFilePath_.constEnd(); ++it )
+	{
+		const QString foldedPath = it.key().toCaseFolded();
+
+		// paths that differ only in case are resolved the same way regardless of hash order
+		QHash<QString,ArchiveEntry*>::Iterator foldedIt = entryForFoldedPath_.find( foldedPath );
+		if ( foldedIt == entryForFoldedPath_.end() )
+			entryForFoldedPath_.insert( foldedPath, it.value() );
+		else if ( it.key() < foldedIt.value()->info.filePath )
+			foldedIt.value() = it.value();
+	}
+}
+
+
+/**
+ * Rebuilds sorted index of paths for query() if contents were updated since the last query.
+ * Called with locked queryMutex_ and contents locked for reading.
+ */
+void ArchivePrivate::_buildQueryIndex()
+{
+	if ( !isQueryIndexDirty_ )
+		return;
+
+	isQueryIndexDirty_ = false;
+	queryEntries_.clear();
+	queryLazyNames_.clear();
+
+	if ( (openMode_ & Grim::Archive::LazyEntries) && type_ == Archive::Type_Zip )
+	{
+		queryLazyNames_.reserve( lazyNameForPathHash_.count() );
+		for ( QMultiHash<uint,ArchiveLazyName>::ConstIterator it = lazyNameForPathHash_.constBegin();
+			it != lazyNameForPathHash_.constEnd(); ++it )
+			queryLazyNames_ << it.value();
+
+		qSort( queryLazyNames_.begin(), queryLazyNames_.end(), ArchiveLazyNameLessThan( lazyDirectory_.constData() ) );
+
+		// duplicated file names are adjacent now ordered by record, the later record wins as for lookups
+		int count = 0;
+		for ( int i = 0; i < queryLazyNames_.count(); ++i )
+		{
+			if ( count > 0 )
+			{
+				const ArchiveLazyName & previous = queryLazyNames_.at( count - 1 );
+				const ArchiveLazyName & current = queryLazyNames_.at( i );
+				if ( previous.nameSize == current.nameSize &&
+					memcmp( lazyDirectory_.constData() + previous.record + CentralFileHeaderSize,
+						lazyDirectory_.constData() + current.record + CentralFileHeaderSize, current.nameSize ) == 0 )
+				{
+					queryLazyNames_[ count - 1 ] = current;
+					continue;
+				}
+			}
+			queryLazyNames_[ count++ ] = queryLazyNames_.at( i );
+		}
+		queryLazyNames_.resize( count );
+		return;
+	}
+
+	queryEntries_.reserve( entryForFilePath_.count() );
+	for ( QHash<QString,ArchiveEntry*>::ConstIterator it = entryForFilePath_.constBegin(); it != entryForFilePath_.constEnd(); ++it )
+		if ( it.value() != rootEntry_ )
+			queryEntries_ << it.value();
+
+	qSort( queryEntries_.begin(), queryEntries_.end(), _entryLessThan );
+}
+
+
+/**
+ * Fills \a info from central directory record of \a lazyName without constructing entry.
+ */
+bool ArchivePrivate::_lazyEntryInfo( const ArchiveLazyName & lazyName, Archive::EntryInfo & info ) const
+{
+	const char * name = lazyDirectory_.constData() + lazyName.record + CentralFileHeaderSize;
+
+	if ( _isLazyDir( lazyName ) )
+	{
+		info.filePath = QString::fromUtf8( name, lazyName.nameSize );
+		info.isDir = true;
+		return true;
+	}
+
+	QDataStream ds( QByteArray::fromRawData( lazyDirectory_.constData() + lazyName.record,
+		lazyDirectory_.size() - lazyName.record ) );
+	ds.setByteOrder( QDataStream::LittleEndian );
+
+	FileHeaderStruct fileHeader;
+	ds >> fileHeader;
+
+	if ( ds.status() != QDataStream::Ok )
+		return false;
+
+	info.filePath = fileHeader.fileName;
+	info.size = fileHeader.uncompressedSize;
+	info.compressedSize = fileHeader.compressedSize;
+	info.crc32 = fileHeader.crc32;
+	info.modTime = from_dos_date_time( fileHeader.modDate, fileHeader.modTime );
+	info.offset = fileHeader.localHeaderOffset;
+
+	switch ( fileHeader.compressionMethod )
+	{
+	case 0:  info.method = Archive::Method_Store;   break;
+	case 8:  info.method = Archive::Method_Deflate; break;
+	default: info.method = Archive::Method_Unknown; break;
+	}
+
+	return true;
+}
+
+
+/** \internal
+ * Returns scheduling class of the \a request at the moment \a now.
+ * Requests that already missed their deadline are served before any other class.
+ */
+static inline int _requestClass( const ArchiveFileRequest * request, qint64 now )
+{
+	if ( request->deadline() != -1 && request->deadline() <= now )
+		return Archive::Priority_Realtime + 1;
+	return request->priority();
+}
+
+
+/** \internal
+ * Returns \c true if \a request should be processed before \a other.
+ * Higher class goes first, inside class earlier deadline goes first,
+ * requests without deadline go after ones with deadline, the rest keeps arrival order.
+ */
+static inline bool _isRequestPreferred( const ArchiveFileRequest * request, const ArchiveFileRequest * other, qint64 now )
+{
+	const int requestClass = _requestClass( request, now );
+	const int otherClass = _requestClass( other, now );
+
+	if ( requestClass != otherClass )
+		return requestClass > otherClass;
+
+	if ( request->deadline() == other->deadline() || request->deadline() == -1 )
+		return false;
+
+	return other->deadline() == -1 || request->deadline() < other->deadline();
+}
+
+
+/**
+ * Takes the most urgent request from the queue and accounts its waiting time.
+ * Returns 0 if queue is empty.
+ */
+ArchiveFileRequest * ArchivePrivate::_takeNextRequest()
+{
+	QWriteLocker jobLocker( &jobMutex_ );
+
+	if ( requests_.isEmpty() )
+		return 0;
+
+	const qint64 now = archiveTimestamp();
+
+	// number of pending requests is limited by number of threads reading archive,
+	// so linear search is cheaper than maintaining sorted queue
+	int bestIndex = 0;
+	for ( int i = 1; i < requests_.count(); ++i )
+		if ( _isRequestPreferred( requests_.at( i ), requests_.at( bestIndex ), now ) )
+			bestIndex = i;
+
+	ArchiveFileRequest * request = requests_.takeAt( bestIndex );
+
+	const qint64 waitTime = now - request->queuedTime();
+	Archive::RequestStatistics & statistics = requestStatistics_[ request->priority() ];
+	statistics.requests++;
+	statistics.totalWaitTime += waitTime;
+	statistics.maxWaitTime = qMax( statistics.maxWaitTime, waitTime );
+
+	switch ( request->type() )
+	{
+	case ArchiveFileRequest::Open:  statistics_.openRequests++;  break;
+	case ArchiveFileRequest::Close: statistics_.closeRequests++; break;
+	case ArchiveFileRequest::Seek:  statistics_.seekRequests++;  break;
+	case ArchiveFileRequest::Read:  statistics_.readRequests++;  break;
+	case ArchiveFileRequest::Write: statistics_.writeRequests++; break;
+	case ArchiveFileRequest::Flush: statistics_.flushRequests++; break;
+	default: break;
+	}
+
+	return request;
+}
+
+
+/**
+ * Writes completed \a request into access trace if tracing is on.
+ * Must be called before waking up file, while file position is not advanced yet.
+ */
+void ArchivePrivate::_traceRequest( ArchiveFileRequest * request )
+{
+	QMutexLocker traceLocker( &traceMutex_ );
+
+	if ( !traceWriter_ )
+		return;
+
+	ArchiveFile * file = request->file();
+
+	// only reading is traced, written files may have no entries at all
+	if ( file->isOpenedForWriting_ )
+		return;
+
+	const ArchiveEntryInfo & info = file->entry_->info;
+	const qint64 duration = archiveTimestamp() - request->queuedTime();
+
+	switch ( request->type() )
+	{
+	case ArchiveFileRequest::Open:
+		traceWriter_->write( ArchiveTrace::Event_Open, request->queuedTime(), duration, request->threadId(),
+			info.filePath, 0, info.size );
+		break;
+	case ArchiveFileRequest::Read:
+		traceWriter_->write( ArchiveTrace::Event_Read, request->queuedTime(), duration, request->threadId(),
+			info.filePath, file->pos_, static_cast<ArchiveFileReadRequest*>( request )->result() );
+		break;
+	case ArchiveFileRequest::Close:
+		traceWriter_->write( ArchiveTrace::Event_Close, request->queuedTime(), duration, request->threadId(),
+			info.filePath, 0, 0 );
+		break;
+	default:
+		break;
+	}
+}
+
+
+/**
+ * Returns \c true if there are files to prefetch and the next of them fits into budget.
+ */
+bool ArchivePrivate::_hasPrefetchJob() const
+{
+	QMutexLocker prefetchLocker( const_cast<QMutex*>( &prefetchMutex_ ) );
+	return !prefetchQueue_.isEmpty() && !isPrefetchBlocked_;
+}
+
+
+/**
+ * Prefetches listed files one by one until queue becomes empty or file request comes.
+ * File requests always go first, prefetching continues on the next pass of worker.
+ */
+void ArchivePrivate::_processPrefetch()
+{
+	while ( !isWorkerAborted_ )
+	{
+		{
+			QReadLocker jobLocker( &jobMutex_ );
+			if ( !requests_.isEmpty() )
+				return;
+		}
+
+		QString filePath;
+		{
+			QMutexLocker prefetchLocker( &prefetchMutex_ );
+			if ( prefetchQueue_.isEmpty() || isPrefetchBlocked_ )
+				return;
+			filePath = prefetchQueue_.takeFirst();
+		}
+
+		const qint64 startTime = archiveTimestamp();
+
+		{
+			QReadLocker contentsLocker( &contentsMutex_ );
+			_prefetchEntry( filePath );
+		}
+
+		_publishStatistics( archiveTimestamp() - startTime );
+	}
+}
+
+
+/**
+ * Prefetches single file with the given \a filePath.
+ * Stored files are only hinted to kernel to be loaded into page cache,
+ * compressed ones are inflated into prefetch cache.
+ */
+void ArchivePrivate::_prefetchEntry( const QString & filePath )
+{
+	ArchiveEntry * entry = _lookupEntry( filePath );
+
+	const bool isValid = entry && !entry->info.isDir && entry->info.canRead && _seekDataOffset( entry );
+
+	qint64 budget;
+	{
+		QMutexLocker prefetchLocker( &prefetchMutex_ );
+
+		// file could be opened or prefetch could be canceled meanwhile
+		if ( prefetchStateForFilePath_.value( filePath, -1 ) != Prefetch_Queued )
+			return;
+
+		if ( !isValid || (entry->info.isSequential && (entry->info.size == 0 || entry->info.size > prefetchBudget_)) )
+		{
+			prefetchStateForFilePath_[ filePath ] = Prefetch_Skipped;
+			prefetchStatistics_.skippedFiles++;
+			return;
+		}
+
+		if ( !entry->info.isSequential )
+		{
+			prefetchStateForFilePath_[ filePath ] = Prefetch_Hinted;
+			prefetchStatistics_.prefetchedFiles++;
+		}
+		else if ( prefetchStatistics_.cachedBytes + entry->info.size > prefetchBudget_ )
+		{
+			// wait until cached files will be used
+			prefetchQueue_.prepend( filePath );
+			isPrefetchBlocked_ = true;
+			return;
+		}
+
+		budget = prefetchBudget_;
+	}
+
+	if ( !entry->info.isSequential )
+	{
+		_adviseEntry( entry, entry->info.compressedSize, CacheAdvice_WillNeed );
+		return;
+	}
+
+	QByteArray data;
+	const bool isInflated = _inflateEntry( entry, data );
+
+	QMutexLocker prefetchLocker( &prefetchMutex_ );
+
+	// budget could be changed while inflating, in this case file is listed again
+	if ( prefetchStateForFilePath_.value( filePath, -1 ) != Prefetch_Queued || budget != prefetchBudget_ )
+		return;
+
+	if ( !isInflated )
+	{
+		prefetchStateForFilePath_[ filePath ] = Prefetch_Skipped;
+		prefetchStatistics_.skippedFiles++;
+		return;
+	}
+
+	prefetchCache_[ filePath ] = data;
+	prefetchStateForFilePath_[ filePath ] = Prefetch_Cached;
+	prefetchStatistics_.cachedBytes += data.size();
+	prefetchStatistics_.prefetchedFiles++;
+}
+
+
+/**
+ * Inflates whole contents of compressed \a entry into \a data at once.
+ * Returns \c false on read error or if data is corrupted.
+ */
+bool ArchivePrivate::_inflateEntry( ArchiveEntry * entry, QByteArray & data )
+{
+	// limited by QByteArray
+	if ( entry->info.size > 0x7fffffff )
+		return false;
+
+	data.resize( entry->info.size );
+
+	return _inflateEntry( entry, data.data() );
+}
+
+
+/**
+ * Reads compressed contents of \a entry at once and inflates them into \a data,
+ * which must have room for the whole uncompressed size of entry.
+ */
+bool ArchivePrivate::_inflateEntry( ArchiveEntry * entry, char * data )
+{
+	// limited by QByteArray
+	if ( entry->info.compressedSize > 0x7fffffff || entry->info.size > 0x7fffffff )
+		return false;
+
+	QByteArray compressedData;
+	compressedData.resize( entry->info.compressedSize );
+
+	if ( !_seekArchive( entry->info.dataOffset ) )
+		return false;
+
+	if ( archiveDevice_->read( compressedData.data(), compressedData.size() ) != compressedData.size() )
+		return false;
+
+	bytesRead_ += compressedData.size();
+
+	z_stream zStream;
+	zStream.zalloc = 0;
+	zStream.zfree = 0;
+	zStream.opaque = 0;
+	zStream.next_in = (Bytef*)compressedData.constData();
+	zStream.avail_in = (uInt)compressedData.size();
+	zStream.next_out = (Bytef*)data;
+	zStream.avail_out = (uInt)entry->info.size;
+
+	if ( inflateInit2( &zStream, -MAX_WBITS ) != Z_OK )
+		return false;
+
+	const int error = inflate( &zStream, Z_FINISH );
+	const qint64 totalOut = zStream.total_out;
+	inflateEnd( &zStream );
+
+	if ( error != Z_STREAM_END || totalOut != entry->info.size )
+		return false;
+
+	bytesInflated_ += totalOut;
+
+	if ( crc32( 0, (const Bytef*)data, (uInt)entry->info.size ) != entry->info.crc32 )
+	{
+		qWarning( "Grim::ArchivePrivate::_inflateEntry() : CRC32 not matched." );
+		return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Hands prefetched contents to the opened \a file and accounts prefetch hit or miss.
+ */
+void ArchivePrivate::_takePrefetchedData( ArchiveFile * file )
+{
+	QMutexLocker prefetchLocker( &prefetchMutex_ );
+
+	if ( prefetchStateForFilePath_.isEmpty() )
+		return;
+
+	const QString & filePath = file->entry_->info.filePath;
+
+	QHash<QString,int>::iterator it = prefetchStateForFilePath_.find( filePath );
+	if ( it == prefetchStateForFilePath_.end() )
+		return;
+
+	switch ( it.value() )
+	{
+	case Prefetch_Cached:
+		file->cachedData_ = prefetchCache_.take( filePath );
+		prefetchStatistics_.cachedBytes -= file->cachedData_.size();
+		prefetchStatistics_.hits++;
+		isPrefetchBlocked_ = false;
+		// all reads of this opening are served from memory
+		countCacheHit();
+		break;
+	case Prefetch_Hinted:
+		prefetchStatistics_.hits++;
+		break;
+	case Prefetch_Queued:
+		// too late to prefetch it
+		prefetchQueue_.removeOne( filePath );
+		prefetchStatistics_.misses++;
+		break;
+	default:
+		prefetchStatistics_.misses++;
+		break;
+	}
+
+	prefetchStateForFilePath_.erase( it );
+}
+
+
+/** \internal
+ * Orders entries by their local file header offsets.
+ */
+static bool _entryOffsetLessThan( const ArchiveEntry * a, const ArchiveEntry * b )
+{
+	return a->info.localFileHeaderOffset < b->info.localFileHeaderOffset;
+}
+
+
+/**
+ * Loads contents of all files not larger than small file threshold into single arena,
+ * visiting them in order of their offsets, so archive file is read in one sequential sweep.
+ * Files with contents in arena are opened and read right in their threads without worker.
+ * Called from worker at the end of each successful update with contents locked for writing.
+ */
+void ArchivePrivate::_loadSmallFiles()
+{
+	int threshold;
+	{
+		QReadLocker jobLocker( &jobMutex_ );
+		threshold = smallFileThreshold_;
+	}
+
+	// files opened from previous arena keep it alive by themselves
+	smallFileArena_ = QByteArray();
+	for ( QHash<QString,ArchiveEntry*>::ConstIterator it = entryForFilePath_.constBegin(); it != entryForFilePath_.constEnd(); ++it )
+		it.value()->info.arenaOffset = -1;
+
+	// Grim pack blocks are shared between entries and entries of LazyEntries mode are not constructed yet
+	if ( threshold == 0 || type_ != Archive::Type_Zip || (openMode_ & Grim::Archive::LazyEntries) )
+		return;
+
+	// stored files of sealed and memory archives are read directly anyway
+	const bool skipStored = (openMode_ & Grim::Archive::Sealed) || !archiveData_.isNull();
+
+	QList<ArchiveEntry*> entries;
+	qint64 arenaSize = 0;
+	for ( QHash<QString,ArchiveEntry*>::ConstIterator it = entryForFilePath_.constBegin(); it != entryForFilePath_.constEnd(); ++it )
+	{
+		ArchiveEntry * entry = it.value();
+
+		if ( entry->info.isDir || !entry->info.canRead || entry->info.size > threshold )
+			continue;
+
+		if ( skipStored && !entry->info.isSequential )
+			continue;
+
+		if ( arenaSize + entry->info.size > MaxSmallFileArenaSize )
+			continue;
+
+		arenaSize += entry->info.size;
+		entries << entry;
+	}
+
+	if ( entries.isEmpty() )
+		return;
+
+	qSort( entries.begin(), entries.end(), _entryOffsetLessThan );
+
+	QByteArray arena;
+	arena.resize( arenaSize );
+
+	int arenaOffset = 0;
+	for ( QListIterator<ArchiveEntry*> it( entries ); it.hasNext(); )
+	{
+		ArchiveEntry * entry = it.next();
+
+		// archive is closing, drop everything loaded so far
+		if ( isWorkerAborted_ )
+			return;
+
+		if ( !_seekDataOffset( entry ) )
+			continue;
+
+		char * data = arena.data() + arenaOffset;
+
+		if ( entry->info.isSequential )
+		{
+			if ( !_inflateEntry( entry, data ) )
+				continue;
+		}
+		else
+		{
+			if ( archiveDevice_->read( data, entry->info.size ) != entry->info.size )
+				continue;
+
+			bytesRead_ += entry->info.size;
+
+			if ( crc32( 0, (const Bytef*)data, (uInt)entry->info.size ) != entry->info.crc32 )
+			{
+				qWarning( "Grim::ArchivePrivate::_loadSmallFiles() : CRC32 not matched." );
+				continue;
+			}
+		}
+
+		// failed entries are left for worker, which will report their errors on reading
+		entry->info.arenaOffset = arenaOffset;
+		arenaOffset += entry->info.size;
+	}
+
+	arena.resize( arenaOffset );
+	smallFileArena_ = arena;
+}
+
+
+/**
+ * Opens \a file right in the calling thread if its contents were loaded into small file arena.
+ * Returns \c false if file should be opened by worker as usual.
+ * Files are not taken from arena while tracing, so trace still records every opening.
+ */
+bool ArchivePrivate::openFileFromArena( ArchiveFile * file )
+{
+	if ( !file->entry_ || file->entry_->info.arenaOffset == -1 )
+		return false;
+
+	{
+		QMutexLocker traceLocker( &traceMutex_ );
+		if ( traceWriter_ )
+			return false;
+	}
+
+	// empty data must not be null, otherwise file would fall back to worker
+	file->cachedDataSource_ = smallFileArena_;
+	file->cachedData_ = file->entry_->info.size == 0 ? QByteArray( "" ) :
+		QByteArray::fromRawData( smallFileArena_.constData() + file->entry_->info.arenaOffset, file->entry_->info.size );
+	file->isOpenedFromArena_ = true;
+
+	countCacheHit();
+
+	return true;
+}
+
+
+/**
+ * Processes queued file requests in the worker thread until queue becomes empty.
+ */
+void ArchivePrivate::_processFileRequests()
+{
+	while ( true )
+	{
+		QReadLocker contentsLocker( &contentsMutex_ );
+
+		// archive is closing, requests left in queue will be released by close()
+		if ( isWorkerAborted_ )
+			return;
+
+		ArchiveFileRequest * request = _takeNextRequest();
+		if ( !request )
+			break;
+
+		const qint64 startTime = archiveTimestamp();
+
+		bool done = false;
 
 		switch ( request->type() )
 		{
-		case ArchiveFileRequest::Open:
-			done = _processFileOpenRequest( static_cast<ArchiveFileOpenRequest*>( request ) );
-			break;
-		case ArchiveFileRequest::Close:
-			done = _processFileCloseRequest( static_cast<ArchiveFileCloseRequest*>( request ) );
-			break;
-		case ArchiveFileRequest::Seek:
-			done = _processFileSeekRequest( static_cast<ArchiveFileSeekRequest*>( request ) );
-			break;
-		case ArchiveFileRequest::Read:
-			done = _processFileReadRequest( static_cast<ArchiveFileReadRequest*>( request ) );
-			break;
-		case ArchiveFileRequest::Write:
-			done = _processFileWriteRequest( static_cast<ArchiveFileWriteRequest*>( request ) );
-			break;
-		case ArchiveFileRequest::Flush:
-			done = _processFileFlushRequest( static_cast<ArchiveFileFlushRequest*>( request ) );
+		case ArchiveFileRequest::Open:
+			done = _processFileOpenRequest( static_cast<ArchiveFileOpenRequest*>( request ) );
+			break;
+		case ArchiveFileRequest::Close:
+			done = _processFileCloseRequest( static_cast<ArchiveFileCloseRequest*>( request ) );
+			break;
+		case ArchiveFileRequest::Seek:
+			done = _processFileSeekRequest( static_cast<ArchiveFileSeekRequest*>( request ) );
+			break;
+		case ArchiveFileRequest::Read:
+			done = _processFileReadRequest( static_cast<ArchiveFileReadRequest*>( request ) );
+			break;
+		case ArchiveFileRequest::Write:
+			done = _processFileWriteRequest( static_cast<ArchiveFileWriteRequest*>( request ) );
+			break;
+		case ArchiveFileRequest::Flush:
+			done = _processFileFlushRequest( static_cast<ArchiveFileFlushRequest*>( request ) );
+			break;
+		}
+
+		if ( done )
+		{
+			request->setDone();
+			_traceRequest( request );
+		}
+
+		const qint64 finishTime = archiveTimestamp();
+
+		_publishStatistics( finishTime - startTime );
+
+		if ( request->deadline() != -1 && finishTime > request->deadline() )
+		{
+			QWriteLocker jobLocker( &jobMutex_ );
+			requestStatistics_[ request->priority() ].missedDeadlines++;
+		}
+
+		QWriteLocker fileRequestLocker( &request->file()->requestMutex_ );
+		request->file()->request_ = 0;
+		request->file()->requestWaiter_.wakeOne();
+	}
+}
+
+
+/**
+ * Rewinds inflate state of \a file to the beginning of compressed data.
+ * Inflate context is not attached here, this is done lazily on first read.
+ */
+inline bool ArchivePrivate::_openInflate( ArchiveFile * file )
+{
+	ArchiveEntry * entry = file->entry_;
+
+	// clean crc32
+	file->zCrc32_ = 0;
+
+	file->zCompressedPos_ = 0;
+	file->zRestCompressed_ = entry->info.compressedSize;
+	file->zRestUncompressed_ = entry->info.size;
+
+	return true;
+}
+
+
+/**
+ * Returns inflate context of \a file back to the pool.
+ */
+inline void ArchivePrivate::_closeInflate( ArchiveFile * file )
+{
+	_detachInflateContext( file );
+}
+
+
+/**
+ * Takes free inflate context from the pool.
+ * If pool is exhausted context is taken away from the least recently used file,
+ * which becomes suspended and will be resumed on its next read.
+ */
+ArchiveInflateContext * ArchivePrivate::_takeInflateContext()
+{
+	if ( !freeInflateContexts_.isEmpty() )
+		return freeInflateContexts_.takeLast();
+
+	const int maxInflateContexts = this->maxInflateContexts();
+
+	if ( attachedInflateContexts_.count() < maxInflateContexts )
+		return new ArchiveInflateContext;
+
+	// suspend least recently used file
+	_detachInflateContext( attachedInflateContexts_.first()->file );
+
+	return freeInflateContexts_.isEmpty() ? new ArchiveInflateContext : freeInflateContexts_.takeLast();
+}
+
+
+/**
+ * Releases inflate context attached to the \a file if any.
+ * The file remembers its uncompressed position, so it can be resumed later with _resumeInflate().
+ */
+void ArchivePrivate::_detachInflateContext( ArchiveFile * file )
+{
+	ArchiveInflateContext * context = file->zContext_;
+	if ( !context )
+		return;
+
+	inflateEnd( &context->zStream );
+
+	context->file = 0;
+	file->zContext_ = 0;
+	attachedInflateContexts_.removeOne( context );
+
+	// keep context with its read buffer for reuse, unless pool was shrinked
+	if ( attachedInflateContexts_.count() + freeInflateContexts_.count() < maxInflateContexts() )
+		freeInflateContexts_ << context;
+	else
+		delete context;
+}
+
+
+/**
+ * Destroys all inflate contexts from the pool.
+ */
+void ArchivePrivate::_destroyInflateContexts()
+{
+	for ( QListIterator<ArchiveInflateContext*> it( attachedInflateContexts_ ); it.hasNext(); )
+	{
+		ArchiveInflateContext * context = it.next();
+		inflateEnd( &context->zStream );
+		if ( context->file )
+			context->file->zContext_ = 0;
+		delete context;
+	}
+	attachedInflateContexts_.clear();
+
+	qDeleteAll( freeInflateContexts_ );
+	freeInflateContexts_.clear();
+
+	inflateSkipBuffer_ = QByteArray();
+}
+
+
+/**
+ * Ensures that \a file has attached inflate context.
+ * If file was suspended inflating restarts from the beginning of compressed data
+ * and skips everything up to the position where file was suspended.
+ */
+bool ArchivePrivate::_resumeInflate( ArchiveFile * file )
+{
+	if ( file->zContext_ )
+	{
+		// already attached, just mark as most recently used
+		if ( attachedInflateContexts_.last() != file->zContext_ )
+		{
+			attachedInflateContexts_.removeOne( file->zContext_ );
+			attachedInflateContexts_ << file->zContext_;
+		}
+		return true;
+	}
+
+	ArchiveInflateContext * context = _takeInflateContext();
+	z_streamp zStream = &context->zStream;
+
+	// fill stream fields
+	zStream->zalloc = 0;
+	zStream->zfree = 0;
+	zStream->opaque = 0;
+	zStream->next_in = 0;
+	zStream->avail_in = 0;
+	zStream->total_out = 0;
+
+	if ( inflateInit2( zStream, -MAX_WBITS ) != Z_OK )
+	{
+		freeInflateContexts_ << context;
+		return false;
+	}
+
+	if ( context->readBuffer.isNull() )
+		context->readBuffer.resize( InflateBufferSize );
+
+	context->file = file;
+	file->zContext_ = context;
+	attachedInflateContexts_ << context;
+
+	// position where file was suspended or 0 for the first read
+	const qint64 suspendedPos = file->entry_->info.size - file->zRestUncompressed_;
+
+	_openInflate( file );
+
+	if ( suspendedPos > 0 )
+	{
+		if ( inflateSkipBuffer_.isNull() )
+			inflateSkipBuffer_.resize( InflateBufferSize );
+
+		for ( qint64 restToSkip = suspendedPos; restToSkip > 0; )
+		{
+			const qint64 bytes = _inflate( file, inflateSkipBuffer_.data(), qMin<qint64>( restToSkip, inflateSkipBuffer_.size() ) );
+			if ( bytes <= 0 )
+			{
+				// don't leave half skipped stream attached, next resume starts over from the beginning
+				// and skips to the same position again, so it stays in sync with file position
+				_detachInflateContext( file );
+				_openInflate( file );
+				file->zRestUncompressed_ = file->entry_->info.size - suspendedPos;
+				return false;
+			}
+			restToSkip -= bytes;
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ * Looks up for the real start offset of \a entry inside archive and jumps to it.
+ * Unfortunately this is not possible on central directory load, because each
+ * file header contains variable file name and extra info we don't want to parse
+ * instantly to speedup update process.
+ * Also caches this start offset value inside \a entry.
+ */
+inline bool ArchivePrivate::_seekDataOffset( ArchiveEntry * entry )
+{
+	if ( entry->info.dataOffset == -1 )
+	{
+		if ( !_seekArchive( entry->info.localFileHeaderOffset ) )
+			return false;
+
+		QDataStream ds( archiveDevice_ );
+		ds.setByteOrder( QDataStream::LittleEndian );
+
+		// dummy just skips data stream, without reading file name and extra info
+		DummyLocalFileHeaderStruct dummy;
+		ds >> dummy;
+
+		if ( ds.status() != QDataStream::Ok )
+			return false;
+
+		entry->info.dataOffset = _archivePos();
+	}
+	else
+	{
+		if ( !_seekArchive( entry->info.dataOffset ) )
+			return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Cleans up resources for earlier opened \a file.
+ */
+void ArchivePrivate::_cleanupOpenedFile( ArchiveFile * file )
+{
+	Q_ASSERT( file->entry_ );
+
+	if ( !openedFileInstances_.contains( file->fileInstance_ ) )
+		return;
+
+	// file is opened, cleanup resources
+	if ( file->entry_->info.isSequential )
+	{
+		_closeInflate( file );
+	}
+	else
+	{
+		// nothing to cleanup for random-access files
+	}
+
+	openedFileInstances_.remove( file->fileInstance_ );
+}
+
+
+bool ArchivePrivate::_processFileOpenRequest( ArchiveFileOpenRequest * openRequest )
+{
+	ArchiveFile * file = openRequest->file();
+	ArchiveEntry * entry = file->entry_;
+
+	if ( openRequest->mode() & QIODevice::WriteOnly )
+		return _openForWriting( file );
+
+	if ( !_seekDataOffset( entry ) )
+		return false;
+
+	if ( !entry->info.isSequential )
+	{
+		// file is not compressed, do nothing
+	}
+	else
+	{
+		if ( !_openInflate( file ) )
+			return false;
+	}
+
+	// start reading entry data in background, for large streams only its head
+	_adviseEntry( entry, qMin( entry->info.compressedSize, LargeEntrySize ), CacheAdvice_WillNeed );
+
+	file->wasRewound_ = false;
+	file->wasReadThrough_ = false;
+
+	file->packBlock_ = QByteArray();
+	file->packBlockIndex_ = -1;
+	file->packCrc32Pos_ = 0;
+	if ( entry->info.packBlockRef != -1 )
+		file->zCrc32_ = 0;
+
+	_takePrefetchedData( file );
+
+	// archive is in memory, let file read stored data right from it without copying
+	if ( file->cachedData_.isNull() && archiveDevice_ == &archiveBuffer_ && !entry->info.isSequential &&
+		entry->info.packBlockRef == -1 && archiveOffset_ + entry->info.dataOffset + entry->info.size <= archiveData_.size() )
+	{
+		file->cachedDataSource_ = archiveData_;
+		file->cachedData_ = QByteArray::fromRawData( archiveData_.constData() + archiveOffset_ + entry->info.dataOffset,
+			entry->info.size );
+	}
+
+	// large compressed file is inflated whole on thread pool, so worker stays free for other files
+	if ( file->cachedData_.isNull() && entry->info.isSequential && entry->info.packBlockRef == -1 )
+		_startBackgroundInflate( file );
+
+	openedFileInstances_ << file->fileInstance_;
+
+	return true;
+}
+
+
+/**
+ * Reads compressed data of opened \a file and hands it to thread pool for inflating
+ * if file is not smaller than backgroundInflateThreshold().
+ * Returns \c false if file should be inflated by worker as usual.
+ */
+bool ArchivePrivate::_startBackgroundInflate( ArchiveFile * file )
+{
+	ArchiveEntry * entry = file->entry_;
+
+	const int threshold = backgroundInflateThreshold();
+
+	// limited by QByteArray
+	if ( threshold == 0 || entry->info.size < threshold ||
+		entry->info.size > 0x7fffffff || entry->info.compressedSize > 0x7fffffff )
+		return false;
+
+	QExplicitlySharedDataPointer<ArchiveInflateJob> job( new ArchiveInflateJob );
+	job->size = entry->info.size;
+	job->crc32 = entry->info.crc32;
+	job->compressedData.resize( entry->info.compressedSize );
+
+	if ( !_seekArchive( entry->info.dataOffset ) )
+		return false;
+
+	if ( archiveDevice_->read( job->compressedData.data(), job->compressedData.size() ) != job->compressedData.size() )
+		return false;
+
+	// accounted here, because pool threads know nothing about archive,
+	// inflated bytes are accounted by file once inflating succeeded
+	bytesRead_ += entry->info.compressedSize;
+
+	QThreadPool::globalInstance()->start( new ArchiveInflateTask( job ) );
+
+	file->inflateJob_ = job;
+
+	return true;
+}
+
+
+bool ArchivePrivate::_processFileCloseRequest( ArchiveFileCloseRequest * closeRequest )
+{
+	ArchiveFile * file = closeRequest->file();
+	ArchiveEntry * entry = file->entry_;
+
+	if ( file->isOpenedForWriting_ )
+		return _closeForWriting( file );
+
+	if ( !entry->info.isSequential )
+	{
+		// file is not compressed or is packed into blocks, drop last cached block
+		file->packBlock_ = QByteArray();
+		file->packBlockIndex_ = -1;
+	}
+	else
+	{
+		_closeInflate( file );
+	}
+
+	// large stream was read once from start to end, drop it from page cache instead of evicting useful pages
+	if ( file->wasReadThrough_ && !file->wasRewound_ && entry->info.compressedSize >= LargeEntrySize )
+		_adviseEntry( entry, entry->info.compressedSize, CacheAdvice_DontNeed );
+
+	openedFileInstances_.remove( file->fileInstance_ );
+
+	return true;
+}
+
+
+bool ArchivePrivate::_processFileSeekRequest( ArchiveFileSeekRequest * seekRequest )
+{
+	ArchiveFile * file = seekRequest->file();
+	ArchiveEntry * entry = file->entry_;
+
+	if ( seekRequest->pos() < file->pos_ )
+		file->wasRewound_ = true;
+
+	if ( !entry->info.isSequential )
+	{
+		// ensure seek pos is in range of uncompressed data
+		if ( seekRequest->pos() < 0 || seekRequest->pos() > entry->info.size )
+			return false;
+	}
+	else
+	{
+		// for sequential devices only seeking to 0 offset is allowed
+		if ( seekRequest->pos() != 0 )
+			return false;
+
+		_closeInflate( file );
+		const bool isReopened = _openInflate( file );
+		Q_UNUSED( isReopened );
+		Q_ASSERT( isReopened );
+	}
+
+	return true;
+}
+
+
+bool ArchivePrivate::_processFileReadRequest( ArchiveFileReadRequest * readRequest )
+{
+	ArchiveFile * file = readRequest->file();
+	ArchiveEntry * entry = file->entry_;
+
+	_adviseAccessPattern( entry );
+
+	if ( entry->info.packBlockRef != -1 )
+	{
+		// file is packed into independent blocks
+		const qint64 bytes = _readPacked( file, readRequest->data(), readRequest->maxlen() );
+
+		if ( bytes == -1 )
+			return false;
+
+		if ( file->pos_ + bytes >= entry->info.size )
+			file->wasReadThrough_ = true;
+
+		readRequest->setResult( bytes );
+
+		return true;
+	}
+
+	if ( !entry->info.isSequential )
+	{
+		// file is not compressed
+		if ( !_seekArchive( entry->info.dataOffset + file->pos_ ) )
+			return false;
+
+		const qint64 bytesToRead = qMin<qint64>( readRequest->maxlen(), entry->info.size - file->pos_ );
+		const qint64 bytes = archiveDevice_->read( readRequest->data(), bytesToRead );
+
+		if ( bytes != -1 )
+			bytesRead_ += bytes;
+
+		if ( bytes != -1 && file->pos_ + bytes >= entry->info.size )
+			file->wasReadThrough_ = true;
+
+		readRequest->setResult( bytes );
+
+		return true;
+	}
+
+	if ( !_resumeInflate( file ) )
+		return false;
+
+	const qint64 bytes = _inflate( file, readRequest->data(), readRequest->maxlen() );
+
+	if ( bytes == -1 )
+		return false;
+
+	if ( file->zRestUncompressed_ == 0 )
+		file->wasReadThrough_ = true;
+
+	readRequest->setResult( bytes );
+
+	return true;
+}
+
+
+/** \internal
+ * Single block of Grim pack entry to be inflated.
+ */
+struct ArchivePackBlockJob
+{
+	QByteArray compressedData;
+	char * data;
+	int size;
+	bool isOk;
+};
+
+
+/** \internal
+ * Inflates whole block described by \a job, called concurrently for multiple blocks.
+ */
+static void _inflatePackBlock( ArchivePackBlockJob & job )
+{
+	z_stream zStream;
+	zStream.zalloc = 0;
+	zStream.zfree = 0;
+	zStream.opaque = 0;
+	zStream.next_in = (Bytef*)job.compressedData.constData();
+	zStream.avail_in = (uInt)job.compressedData.size();
+	zStream.next_out = (Bytef*)job.data;
+	zStream.avail_out = (uInt)job.size;
+
+	job.isOk = false;
+
+	if ( inflateInit2( &zStream, -MAX_WBITS ) != Z_OK )
+		return;
+
+	const int error = inflate( &zStream, Z_FINISH );
+	job.isOk = error == Z_STREAM_END && zStream.total_out == (uLong)job.size;
+
+	inflateEnd( &zStream );
+}
+
+
+/**
+ * Reads up to \a maxlen bytes of Grim pack \a file at its current position into \a data.
+ * Only blocks covering requested range are read, so seeking costs nothing.
+ * Blocks completely covered by the range are inflated right into \a data, several of them in parallel.
+ * Partially covered block is inflated into \a file cache, so following small reads do not inflate it again.
+ * Returns number of read bytes or -1 on error.
+ */
+qint64 ArchivePrivate::_readPacked( ArchiveFile * file, char * data, qint64 maxlen )
+{
+	ArchiveEntry * entry = file->entry_;
+
+	const qint64 pos = file->pos_;
+	const qint64 length = qMin<qint64>( maxlen, entry->info.size - pos );
+
+	if ( length <= 0 )
+		return 0;
+
+	const int firstBlock = pos / packBlockSize_;
+	const int lastBlock = (pos + length - 1) / packBlockSize_;
+
+	QVector<ArchivePackBlockJob> jobs;
+	QList<int> partialJobs;   // jobs inflated into their own buffer
+	QList<int> partialBlocks; // block numbers of these jobs inside entry
+	QList<QByteArray> partialData;
+
+	for ( int i = firstBlock; i <= lastBlock; ++i )
+	{
+		const int blockIndex = packBlockRefs_.at( entry->info.packBlockRef + i );
+		const ArchivePackBlock & block = packBlocks_.at( blockIndex );
+
+		// range of block to be copied into data
+		const qint64 blockPos = qint64( i ) * packBlockSize_;
+		const int from = qMax( pos, blockPos ) - blockPos;
+		const int to = qMin( pos + length, blockPos + block.size ) - blockPos;
+		char * blockData = data + (blockPos + from - pos);
+
+		if ( block.compressedSize == block.size )
+		{
+			// stored block, read only requested part
+			if ( !_seekArchive( block.offset + from ) )
+				return -1;
+			if ( archiveDevice_->read( blockData, to - from ) != to - from )
+				return -1;
+			bytesRead_ += to - from;
+			continue;
+		}
+
+		if ( blockIndex == file->packBlockIndex_ )
+		{
+			memcpy( blockData, file->packBlock_.constData() + from, to - from );
+			continue;
+		}
+
+		ArchivePackBlockJob job;
+		job.size = block.size;
+		job.isOk = false;
+
+		if ( !_seekArchive( block.offset ) )
+			return -1;
+		job.compressedData = archiveDevice_->read( block.compressedSize );
+		if ( job.compressedData.size() != block.compressedSize )
+			return -1;
+
+		bytesRead_ += block.compressedSize;
+		bytesInflated_ += block.size;
+
+		if ( from == 0 && to == block.size )
+		{
+			job.data = blockData;
+		}
+		else
+		{
+			job.data = 0;
+			partialJobs << jobs.count();
+			partialBlocks << i;
+			partialData << QByteArray( block.size, Qt::Uninitialized );
+		}
+
+		jobs << job;
+	}
+
+	// buffers of partial blocks are not shared at this point, so they could be written by pointer
+	for ( int i = 0; i < partialJobs.count(); ++i )
+		jobs[ partialJobs.at( i ) ].data = partialData[ i ].data();
+
+	if ( jobs.count() == 1 )
+		_inflatePackBlock( jobs.first() );
+	else if ( jobs.count() > 1 )
+		QtConcurrent::blockingMap( jobs, _inflatePackBlock );
+
+	for ( int i = 0; i < jobs.count(); ++i )
+		if ( !jobs.at( i ).isOk )
+			return -1;
+
+	// copy partial blocks and keep the last one for the following reads
+	for ( int i = 0; i < partialJobs.count(); ++i )
+	{
+		const char * blockData = partialData.at( i ).constData();
+		const int blockNumber = partialBlocks.at( i );
+		const qint64 blockPos = qint64( blockNumber ) * packBlockSize_;
+		const int from = qMax( pos, blockPos ) - blockPos;
+		const int to = qMin<qint64>( pos + length, blockPos + partialData.at( i ).size() ) - blockPos;
+
+		memcpy( data + (blockPos + from - pos), blockData + from, to - from );
+
+		file->packBlock_ = partialData.at( i );
+		file->packBlockIndex_ = packBlockRefs_.at( entry->info.packBlockRef + blockNumber );
+	}
+
+	// blocks are verified only by their sizes, so joined data is checked when it is read in order
+	// from start to end, the same as inflated stream of zip entry
+	if ( pos == 0 )
+	{
+		file->zCrc32_ = 0;
+		file->packCrc32Pos_ = 0;
+	}
+
+	if ( pos == file->packCrc32Pos_ )
+	{
+		file->zCrc32_ = crc32( file->zCrc32_, (const Bytef*)data, (uInt)length );
+		file->packCrc32Pos_ += length;
+
+		if ( file->packCrc32Pos_ == entry->info.size && file->zCrc32_ != entry->info.crc32 )
+			qWarning( "Grim::ArchivePrivate::_readPacked() : CRC32 not matched." );
+	}
+
+	return length;
+}
+
+
+/**
+ * Low-level inflating of up to \a maxlen bytes of \a file into \a data.
+ * File must have attached inflate context.
+ * Returns number of uncompressed bytes or -1 on error.
+ */
+qint64 ArchivePrivate::_inflate( ArchiveFile * file, char * data, qint64 maxlen )
+{
+	ArchiveEntry * entry = file->entry_;
+	ArchiveInflateContext * context = file->zContext_;
+	z_streamp zStream = &context->zStream;
+
+	zStream->next_out = (Bytef*)data;
+	zStream->avail_out = qMin<qint64>( maxlen, file->zRestUncompressed_ );
+
+	qint64 totalUncompressedBytes = 0;
+
+	while ( zStream->avail_out > 0 )
+	{
+		if ( zStream->avail_in == 0 && file->zRestCompressed_ > 0 )
+		{
+			const qint64 compressedBytes = qMin<qint64>( file->zRestCompressed_, context->readBuffer.size() );
+
+			_seekArchive( entry->info.dataOffset + file->zCompressedPos_ );
+
+			if ( archiveDevice_->read( context->readBuffer.data(), compressedBytes ) != compressedBytes )
+			{
+				// should not happen, because we know exact size of compressed data
+				return -1;
+			}
+
+			bytesRead_ += compressedBytes;
+
+			file->zCompressedPos_ += compressedBytes;
+			file->zRestCompressed_ -= compressedBytes;
+			zStream->next_in = (Bytef*)context->readBuffer.constData();
+			zStream->avail_in = (uInt)compressedBytes;
+		}
+
+		const qint64 totalOutBefore = zStream->total_out;
+		const char * outBufferBefore = (char*)zStream->next_out;
+
+		int error = inflate( zStream, Z_SYNC_FLUSH );
+
+		if ( error != Z_OK && error != Z_STREAM_END && error != Z_BUF_ERROR )
+		{
+#ifdef GRIM_ARCHIVE_DEBUG
+			qDebug() << "ArchivePrivate::_inflate() : Error reading compressed data";
+#endif
+			return -1;
+		}
+
+		const qint64 totalOutAfter = zStream->total_out;
+		const qint64 uncompressedBytes = totalOutAfter - totalOutBefore;
+
+		file->zCrc32_ = crc32( file->zCrc32_, (const Bytef*)outBufferBefore, uncompressedBytes );
+		totalUncompressedBytes += uncompressedBytes;
+		bytesInflated_ += uncompressedBytes;
+		file->zRestUncompressed_ -= uncompressedBytes;
+
+		if ( error == Z_STREAM_END )
+		{
+			// compressed stream finished
+			if ( file->zRestCompressed_ == 0 )
+			{
+				if ( file->zRestUncompressed_ != 0 )
+					qWarning( "Grim::ArchivePrivate::_inflate() : Uncompressed size not matched." );
+				if ( file->zCrc32_ != entry->info.crc32 )
+					qWarning( "Grim::ArchivePrivate::_inflate() : CRC32 not matched." );
+			}
 			break;
 		}
+	}
 
-		if ( done )
-			request->setDone();
+	return totalUncompressedBytes;
+}
 
-		QWriteLocker fileRequestLocker( &request->file()->requestMutex_ );
-		request->file()->request_ = 0;
-		request->file()->requestWaiter_.wakeOne();
+
+bool ArchivePrivate::_processFileWriteRequest( ArchiveFileWriteRequest * writeRequest )
+{
+	ArchiveFile * file = writeRequest->file();
+
+	if ( writeContext_.file != file || writeContext_.isFailed )
+		return false;
+
+	// other files could be read from archive since the last write
+	if ( !_seekArchive( writeContext_.offset ) )
+	{
+		writeContext_.isFailed = true;
+		return false;
+	}
+
+	// zlib takes sizes as uInt
+	static const qint64 MaxChunkSize = 0x40000000;
+
+	for ( qint64 written = 0; written < writeRequest->len(); )
+	{
+		const char * data = writeRequest->data() + written;
+		const uInt chunkSize = (uInt)qMin( writeRequest->len() - written, MaxChunkSize );
+
+		writeContext_.crc32 = crc32( writeContext_.crc32, (const Bytef*)data, chunkSize );
+
+		if ( !_deflateWritten( data, chunkSize, Z_NO_FLUSH ) )
+		{
+			writeContext_.isFailed = true;
+			return false;
+		}
+
+		written += chunkSize;
+	}
+
+	writeContext_.size += writeRequest->len();
+	writeRequest->setResult( writeRequest->len() );
+
+	return true;
+}
+
+
+bool ArchivePrivate::_processFileFlushRequest( ArchiveFileFlushRequest * flushRequest )
+{
+	if ( writeContext_.file != flushRequest->file() || writeContext_.isFailed )
+		return false;
+
+	// data stays invisible until commit anyway, so just push it out of buffers
+	return archiveFile_.flush();
+}
+
+
+/**
+ * Returns \c true if file with the given \a filePath can be written without breaking directory tree,
+ * i.e. it is not a directory and none of its parent directories is a file, committed or pending.
+ */
+bool ArchivePrivate::_canWriteFile( const QString & filePath )
+{
+	if ( filePath.isEmpty() || filePath.startsWith( QLatin1Char( '/' ) ) || filePath.endsWith( QLatin1Char( '/' ) ) )
+		return false;
+
+	const ArchiveEntry * entry = _lookupEntry( filePath );
+	if ( entry && entry->info.isDir )
+		return false;
+
+	for ( int slash = filePath.indexOf( QLatin1Char( '/' ) ); slash != -1; slash = filePath.indexOf( QLatin1Char( '/' ), slash + 1 ) )
+	{
+		const QString dirPath = filePath.left( slash );
+
+		const ArchiveEntry * dirEntry = _lookupEntry( dirPath );
+		if ( (dirEntry && !dirEntry->info.isDir) || pendingRecords_.contains( dirPath ) )
+			return false;
+	}
+
+	// pending files are sorted by paths, so the first one under directory goes right after it
+	const QString dirPrefix = filePath + QLatin1Char( '/' );
+	QMap<QString,QByteArray>::ConstIterator it = pendingRecords_.lowerBound( dirPrefix );
+	if ( it != pendingRecords_.constEnd() && it.key().startsWith( dirPrefix ) )
+		return false;
+
+	return true;
+}
+
+
+/**
+ * Returns path under which \a file is written into archive.
+ * In CaseInsensitive mode file replaces committed one spelled in different case, so its spelling is kept.
+ */
+QString ArchivePrivate::_writtenFilePath( ArchiveFile * file )
+{
+	if ( openMode_ & Grim::Archive::CaseInsensitive )
+	{
+		const ArchiveEntry * entry = _lookupEntry( file->internalFileName_ );
+		if ( entry && !entry->info.isDir )
+			return entry->info.filePath;
 	}
+
+	return file->internalFileName_;
 }
 
 
 /**
- * Low-level inflate initialization of z-stream.
+ * Starts writing of \a file after committed contents and files written before.
+ * Local file header goes first with zero sizes and crc32, they are patched when file is closed.
+ * Only one file can be written at a time, because its data is streamed right into archive.
  */
-inline bool ArchivePrivate::_openInflate( ArchiveFile * file )
+bool ArchivePrivate::_openForWriting( ArchiveFile * file )
 {
-	ArchiveEntry * entry = file->entry_;
-	z_streamp zStream = &file->zStream_;
+	if ( writeContext_.file )
+	{
+		qWarning( "Grim::ArchivePrivate::_openForWriting() : Another file is being written." );
+		return false;
+	}
 
-	// clean crc32
-	file->zCrc32_ = 0;
+	// broken archive or Grim pack
+	if ( appendOffset_ == -1 || type_ != Archive::Type_Zip )
+		return false;
 
-	// fill stream fields
-	zStream->zalloc = 0;
-	zStream->zfree = 0;
-	zStream->opaque = 0;
-	zStream->next_in = 0;
-	zStream->avail_in = 0;
-	zStream->total_out = 0;
+	if ( !_canWriteFile( file->internalFileName_ ) )
+	{
+		qWarning( "Grim::ArchivePrivate::_openForWriting() : File path conflicts with archive contents." );
+		return false;
+	}
 
-	const int error = inflateInit2( zStream, -MAX_WBITS );
+	// committed size must reach the disk before anything is appended after it
+	if ( !isCommitJournalWritten_ && !_writeCommitJournal() )
+	{
+		qWarning( "Grim::ArchivePrivate::_openForWriting() : Failed to write commit journal." );
+		return false;
+	}
 
-	if ( error != Z_OK )
+	if ( !_seekArchive( appendOffset_ ) )
 		return false;
 
-	file->zCompressedPos_ = 0;
-	file->zRestCompressed_ = entry->info.compressedSize;
-	file->zRestUncompressed_ = entry->info.size;
+	LocalFileHeaderStruct localFileHeader;
+	localFileHeader.versionToExtract = 20;
+	localFileHeader.bitFlag = 0x0800; // file name is in UTF-8
+	localFileHeader.compressionMethod = 8;
+	to_dos_date_time( QDateTime::currentDateTime(), localFileHeader.modDate, localFileHeader.modTime );
+	localFileHeader.crc32 = 0;
+	localFileHeader.compressedSize = 0;
+	localFileHeader.uncompressedSize = 0;
+	localFileHeader.fileName = _writtenFilePath( file );
+
+	QDataStream ds( archiveDevice_ );
+	ds.setByteOrder( QDataStream::LittleEndian );
+	ds << localFileHeader;
+
+	if ( ds.status() != QDataStream::Ok )
+		return false;
+
+	z_stream & zStream = writeContext_.zStream;
+	zStream.zalloc = 0;
+	zStream.zfree = 0;
+	zStream.opaque = 0;
+
+	if ( deflateInit2( &zStream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+		return false;
+
+	writeContext_.file = file;
+	writeContext_.headerOffset = appendOffset_;
+	writeContext_.offset = _archivePos();
+	writeContext_.crc32 = 0;
+	writeContext_.size = 0;
+	writeContext_.compressedSize = 0;
+	writeContext_.modDate = localFileHeader.modDate;
+	writeContext_.modTime = localFileHeader.modTime;
+	writeContext_.isFailed = false;
 
 	return true;
 }
 
 
 /**
- * Low-level inflate deinitialization of z-stream.
+ * Finishes writing of \a file and adds its central directory record to pending ones.
+ * File replaces committed file with the same path only when written files are committed.
+ * Failed file is dropped, its data will be overwritten by the next written file.
  */
-inline void ArchivePrivate::_closeInflate( ArchiveFile * file )
+bool ArchivePrivate::_closeForWriting( ArchiveFile * file )
 {
-	z_streamp zStream = &file->zStream_;
+	if ( writeContext_.file != file )
+		return false;
 
-	// assuming file was opened before, otherwise we will not reach here
-	inflateEnd( zStream );
-	file->zReadBuffer_ = QByteArray();
-}
+	bool isWritten = !writeContext_.isFailed &&
+		_seekArchive( writeContext_.offset ) && _deflateWritten( 0, 0, Z_FINISH );
 
+	deflateEnd( &writeContext_.zStream );
+	writeContext_.file = 0;
 
-/**
- * Looks up for the real start offset of \a entry inside archive and jumps to it.
- * Unfortunately this is not possible on central directory load, because each
- * file header contains variable file name and extra info we don't want to parse
- * instantly to speedup update process.
- * Also caches this start offset value inside \a entry.
- */
-inline bool ArchivePrivate::_seekDataOffset( ArchiveEntry * entry )
-{
-	if ( entry->info.dataOffset == -1 )
+	// no Zip64 extensions for now
+	if ( isWritten && (writeContext_.offset > 0xffffffffLL || writeContext_.size > 0xffffffffLL) )
 	{
-		if ( !archiveFile_.seek( entry->info.localFileHeaderOffset ) )
-			return false;
-
-		QDataStream ds( &archiveFile_ );
-		ds.setByteOrder( QDataStream::LittleEndian );
+		qWarning( "Grim::ArchivePrivate::_closeForWriting() : File exceeds 4 GB limit of archive." );
+		isWritten = false;
+	}
 
-		// dummy just skips data stream, without reading file name and extra info
-		DummyLocalFileHeaderStruct dummy;
-		ds >> dummy;
+	if ( isWritten )
+	{
+		// patch crc32 and sizes after version, flags, method and time fields of local file header
+		isWritten = _seekArchive( writeContext_.headerOffset + 14 );
 
-		if ( ds.status() != QDataStream::Ok )
-			return false;
+		QDataStream ds( archiveDevice_ );
+		ds.setByteOrder( QDataStream::LittleEndian );
+		ds << writeContext_.crc32 << (quint32)writeContext_.compressedSize << (quint32)writeContext_.size;
 
-		entry->info.dataOffset = archiveFile_.pos();
+		isWritten = isWritten && ds.status() == QDataStream::Ok;
 	}
-	else
+
+	if ( !isWritten )
 	{
-		if ( !archiveFile_.seek( entry->info.dataOffset ) )
-			return false;
+		qWarning( "Grim::ArchivePrivate::_closeForWriting() : Failed to write file." );
+		return false;
 	}
 
+	FileHeaderStruct fileHeader;
+	fileHeader.versionMadeBy = 20;
+	fileHeader.versionNeedToExtract = 20;
+	fileHeader.bitFlag = 0x0800;
+	fileHeader.compressionMethod = 8;
+	fileHeader.modTime = writeContext_.modTime;
+	fileHeader.modDate = writeContext_.modDate;
+	fileHeader.crc32 = writeContext_.crc32;
+	fileHeader.compressedSize = (quint32)writeContext_.compressedSize;
+	fileHeader.uncompressedSize = (quint32)writeContext_.size;
+	fileHeader.diskNumberStart = 0;
+	fileHeader.internalFileAttributes = 0;
+	fileHeader.externalFileAttributes = 0;
+	fileHeader.localHeaderOffset = (quint32)writeContext_.headerOffset;
+	fileHeader.fileName = _writtenFilePath( file );
+
+	QByteArray record;
+	QDataStream recordStream( &record, QIODevice::WriteOnly );
+	recordStream.setByteOrder( QDataStream::LittleEndian );
+	recordStream << fileHeader;
+
+	// the last written file with the same path wins
+	pendingRecords_[ fileHeader.fileName ] = record;
+	appendOffset_ = writeContext_.offset;
+
 	return true;
 }
 
 
 /**
- * Cleans up resources for earlier opened \a file.
+ * Drops file being written, if any. Its data will be overwritten by the next written file
+ * or cut off on commit.
  */
-void ArchivePrivate::_cleanupOpenedFile( ArchiveFile * file )
+void ArchivePrivate::_abortWriting()
 {
-	Q_ASSERT( file->entry_ );
-
-	if ( !openedFileInstances_.contains( file->fileInstance_ ) )
+	if ( !writeContext_.file )
 		return;
 
-	// file is opened, cleanup resources
-	if ( file->entry_->info.isSequential )
-	{
-		_closeInflate( file );
-	}
-	else
-	{
-		// nothing to cleanup for random-access files
-	}
-
-	openedFileInstances_.removeOne( file->fileInstance_ );
+	deflateEnd( &writeContext_.zStream );
+	writeContext_.file = 0;
 }
 
 
-bool ArchivePrivate::_processFileOpenRequest( ArchiveFileOpenRequest * openRequest )
+/**
+ * Compresses \a size bytes of \a data into archive at the current position with the given zlib \a flush mode.
+ */
+bool ArchivePrivate::_deflateWritten( const char * data, uInt size, int flush )
 {
-	ArchiveFile * file = openRequest->file();
-	ArchiveEntry * entry = file->entry_;
+	z_stream & zStream = writeContext_.zStream;
+	zStream.next_in = (Bytef*)data;
+	zStream.avail_in = size;
 
-	if ( !_seekDataOffset( entry ) )
-		return false;
+	char buffer[ 16384 ];
 
-	if ( !entry->info.isSequential )
-	{
-		// file is not compressed, do nothing
-	}
-	else
+	do
 	{
-		if ( !_openInflate( file ) )
+		zStream.next_out = (Bytef*)buffer;
+		zStream.avail_out = sizeof(buffer);
+
+		if ( deflate( &zStream, flush ) == Z_STREAM_ERROR )
 			return false;
-	}
 
-	openedFileInstances_ << file->fileInstance_;
+		const qint64 bytes = sizeof(buffer) - zStream.avail_out;
+		if ( bytes > 0 && archiveDevice_->write( buffer, bytes ) != bytes )
+			return false;
+
+		writeContext_.offset += bytes;
+		writeContext_.compressedSize += bytes;
+	}
+	while ( zStream.avail_out == 0 );
 
 	return true;
 }
 
 
-bool ArchivePrivate::_processFileCloseRequest( ArchiveFileCloseRequest * closeRequest )
+/**
+ * Writes new central directory after written files, with records of committed files
+ * except replaced ones followed by records of written files, and then new end record.
+ * Until end record is written archive is still found by the previous one,
+ * which also makes data of files written after it to be dropped on the next opening for writing.
+ * Must be called with contents locked for writing.
+ */
+bool ArchivePrivate::_commit()
 {
-	ArchiveFile * file = closeRequest->file();
-	ArchiveEntry * entry = file->entry_;
+	if ( pendingRecords_.isEmpty() )
+		return true;
 
-	if ( !entry->info.isSequential )
-	{
-		// file is not compressed, do nothing
-	}
-	else
+	if ( writeContext_.file )
 	{
-		_closeInflate( file );
+		qWarning( "Grim::ArchivePrivate::commit() : File is still being written." );
+		return false;
 	}
 
-	openedFileInstances_.removeOne( file->fileInstance_ );
-
-	return true;
-}
+	if ( !_seekArchive( centralDirectoryOffset_ ) )
+		return false;
 
+	const QByteArray directory = archiveDevice_->read( centralDirectorySize_ );
+	if ( directory.size() != centralDirectorySize_ )
+		return false;
 
-bool ArchivePrivate::_processFileSeekRequest( ArchiveFileSeekRequest * seekRequest )
-{
-	ArchiveFile * file = seekRequest->file();
-	ArchiveEntry * entry = file->entry_;
+	QByteArray newDirectory;
+	newDirectory.reserve( directory.size() );
+	int count = 0;
 
-	if ( !entry->info.isSequential )
+	// keep committed records as is, except replaced ones
+	const char * data = directory.constData();
+	for ( int pos = 0; pos < directory.size(); )
 	{
-		// ensure seek pos is in range of uncompressed data
-		if ( seekRequest->pos() < 0 || seekRequest->pos() > entry->info.size )
+		if ( pos + CentralFileHeaderSize > directory.size() )
+			return false;
+
+		const uchar * record = reinterpret_cast<const uchar*>( data + pos );
+		if ( qFromLittleEndian<quint32>( record ) != CentralFileHeaderSignature )
+			return false;
+
+		const int nameSize = qFromLittleEndian<quint16>( record + 28 );
+		const int recordSize = CentralFileHeaderSize + nameSize +
+			qFromLittleEndian<quint16>( record + 30 ) + qFromLittleEndian<quint16>( record + 32 );
+
+		if ( pos + recordSize > directory.size() )
 			return false;
+
+		if ( !pendingRecords_.contains( QString::fromUtf8( data + pos + CentralFileHeaderSize, nameSize ) ) )
+		{
+			newDirectory.append( data + pos, recordSize );
+			count++;
+		}
+
+		pos += recordSize;
 	}
-	else
+
+	for ( QMap<QString,QByteArray>::ConstIterator it = pendingRecords_.constBegin(); it != pendingRecords_.constEnd(); ++it )
 	{
-		// for sequential devices only seeking to 0 offset is allowed
-		if ( seekRequest->pos() != 0 )
-			return false;
+		newDirectory += it.value();
+		count++;
+	}
 
-		_closeInflate( file );
-		const bool isReopened = _openInflate( file );
-		Q_UNUSED( isReopened );
-		Q_ASSERT( isReopened );
+	if ( count > 0xffff || appendOffset_ + newDirectory.size() > 0xffffffffLL )
+	{
+		qWarning( "Grim::ArchivePrivate::commit() : Too many files or too large archive." );
+		return false;
 	}
 
+	// new central directory must reach the disk before end record that refers to it
+	if ( !_seekArchive( appendOffset_ ) || archiveDevice_->write( newDirectory ) != newDirectory.size() || !_syncArchive() )
+		return false;
+
+	EndOfCentralDirectoryStruct endOfCentralDirectory;
+	endOfCentralDirectory.numberOfThisDisk = 0;
+	endOfCentralDirectory.numberOfTheStartDisk = 0;
+	endOfCentralDirectory.numberOfEntriesOnThisDisk = count;
+	endOfCentralDirectory.numberOfEntriesTotal = count;
+	endOfCentralDirectory.sizeOfTheCentralDirectory = newDirectory.size();
+	endOfCentralDirectory.offsetOfCentralDirectory = appendOffset_;
+	endOfCentralDirectory.zipFileComment = globalComment_;
+
+	QDataStream ds( archiveDevice_ );
+	ds.setByteOrder( QDataStream::LittleEndian );
+	ds << endOfCentralDirectory;
+
+	if ( ds.status() != QDataStream::Ok )
+		return false;
+
+	// cut off data of dropped files left after the new end record
+	const qint64 committedSize = _archivePos();
+	if ( committedSize < _archiveSize() && !archiveFile_.resize( committedSize ) )
+		return false;
+
+	if ( !_syncArchive() )
+		return false;
+
+	centralDirectoryOffset_ = appendOffset_;
+	centralDirectorySize_ = newDirectory.size();
+	appendOffset_ = committedSize;
+	committedSize_ = committedSize;
+	pendingRecords_.clear();
+
+	_removeCommitJournal();
+
 	return true;
 }
 
 
-bool ArchivePrivate::_processFileReadRequest( ArchiveFileReadRequest * readRequest )
+/**
+ * Commits written files and updates contents, so they become visible for reading.
+ * Archive file and contents belong to worker, so commit is done by it while caller waits.
+ */
+bool ArchivePrivate::commit()
 {
-	ArchiveFile * file = readRequest->file();
-	ArchiveEntry * entry = file->entry_;
-	z_streamp zStream = &file->zStream_;
+	if ( !(openMode_ & Grim::Archive::WriteOnly) )
+		return false;
 
-	if ( !entry->info.isSequential )
-	{
-		// file is not compressed
-		if ( !archiveFile_.seek( entry->info.dataOffset + file->pos_ ) )
-			return false;
+	QWriteLocker jobLocker( &jobMutex_ );
 
-		const qint64 bytesToRead = qMin<qint64>( readRequest->maxlen(), entry->info.size - file->pos_ );
-		const qint64 bytes = archiveFile_.read( readRequest->data(), bytesToRead );
+	const int request = ++commitRequests_;
+	jobWaiter_.wakeOne();
 
-		readRequest->setResult( bytes );
+	while ( commitsDone_ - request < 0 && !isWorkerAborted_ )
+		commitWaiter_.wait( &jobMutex_ );
 
-		return true;
-	}
+	// archive is closing, close() commits written files by itself
+	if ( commitsDone_ - request < 0 )
+		return false;
 
-	zStream->next_out = (Bytef*)readRequest->data();
-	zStream->avail_out = qMin<qint64>( readRequest->maxlen(), file->zRestUncompressed_ );
+	return isLastCommitOk_;
+}
 
-	// init buffer for reading compressed data
-	{
-		static const int BufferSize = 16384;
-		if ( file->zReadBuffer_.isNull() )
-			file->zReadBuffer_.resize( BufferSize );
-	}
 
-	qint64 totalUncompressedBytes = 0;
+/** \internal
+ * Flushes written data of \a file down to the disk, so it survives system failure.
+ */
+static bool _syncFile( QFile & file )
+{
+	if ( !file.flush() )
+		return false;
 
-	while ( zStream->avail_out > 0 )
-	{
-		if ( zStream->avail_in == 0 && file->zRestCompressed_ > 0 )
-		{
-			const qint64 compressedBytes = qMin<qint64>( file->zRestCompressed_, file->zReadBuffer_.size() );
+#ifdef Q_OS_UNIX
+	if ( fsync( file.handle() ) != 0 )
+		return false;
+#endif
 
-			archiveFile_.seek( entry->info.dataOffset + file->zCompressedPos_ );
+	return true;
+}
 
-			if ( archiveFile_.read( file->zReadBuffer_.data(), compressedBytes ) != compressedBytes )
-			{
-				// should not happen, because we know exact size of compressed data
-				return false;
-			}
 
-			file->zCompressedPos_ += compressedBytes;
-			file->zRestCompressed_ -= compressedBytes;
-			zStream->next_in = (Bytef*)file->zReadBuffer_.constData();
-			zStream->avail_in = (uInt)compressedBytes;
-		}
+/**
+ * Flushes written data of archive file down to the disk, so it survives system failure.
+ */
+bool ArchivePrivate::_syncArchive()
+{
+	return _syncFile( archiveFile_ );
+}
 
-		const qint64 totalOutBefore = zStream->total_out;
-		const char * outBufferBefore = (char*)zStream->next_out;
 
-		int error = inflate( zStream, Z_SYNC_FLUSH );
+/**
+ * Returns name of the file that keeps committed size of archive while written files are appended to it.
+ */
+QString ArchivePrivate::_commitJournalFileName() const
+{
+	return archiveFile_.fileName() + QLatin1String( ".uncommitted" );
+}
 
-		if ( error != Z_OK && error != Z_STREAM_END && error != Z_BUF_ERROR )
-		{
-#ifdef GRIM_ARCHIVE_DEBUG
-			qDebug() << "ArchivePrivate::_processFileReadRequest() : Error reading compressed data";
-#endif
-			return false;
-		}
 
-		const qint64 totalOutAfter = zStream->total_out;
-		const qint64 uncompressedBytes = totalOutAfter - totalOutBefore;
+/**
+ * Returns committed size of archive file persisted by interrupted writing
+ * or -1 if there is no commit journal.
+ * Only archives that occupy whole archive file could be written, so nested ones never have journal.
+ */
+qint64 ArchivePrivate::_readCommitJournal()
+{
+	if ( archiveDevice_ != &archiveFile_ || archiveOffset_ != 0 || archiveSize_ != -1 )
+		return -1;
 
-		file->zCrc32_ = crc32( file->zCrc32_, (const Bytef*)outBufferBefore, uncompressedBytes );
-		totalUncompressedBytes += uncompressedBytes;
-		file->zRestUncompressed_ -= uncompressedBytes;
+	_setTemporaryDisabled( true );
+	QFile journal( _commitJournalFileName() );
+	const bool opened = journal.open( QIODevice::ReadOnly );
+	_setTemporaryDisabled( false );
 
-		if ( error == Z_STREAM_END )
-		{
-			// compressed stream finished
-			if ( file->zRestCompressed_ == 0 )
-			{
-				if ( file->zRestUncompressed_ != 0 )
-					qWarning( "Grim::ArchivePrivate::_processFileReadRequest() : Uncompressed size not matched." );
-				if ( file->zCrc32_ != entry->info.crc32 )
-					qWarning( "Grim::ArchivePrivate::_processFileReadRequest() : CRC32 not matched." );
-			}
-			break;
-		}
-	}
+	if ( !opened )
+		return -1;
+
+	QDataStream ds( &journal );
+	ds.setByteOrder( QDataStream::LittleEndian );
 
-	readRequest->setResult( totalUncompressedBytes );
+	qint64 committedSize = -1;
+	ds >> committedSize;
 
-	return true;
+	if ( ds.status() != QDataStream::Ok || committedSize < 0 )
+		return -1;
+
+	return committedSize;
 }
 
 
-bool ArchivePrivate::_processFileWriteRequest( ArchiveFileWriteRequest * writeRequest )
+/**
+ * Persists committed size of archive before the first written file is appended after it,
+ * so data of files that were not committed is found and cut off after crash.
+ */
+bool ArchivePrivate::_writeCommitJournal()
 {
+	_setTemporaryDisabled( true );
+	QFile journal( _commitJournalFileName() );
+	const bool opened = journal.open( QIODevice::WriteOnly | QIODevice::Truncate );
+	_setTemporaryDisabled( false );
+
+	if ( !opened )
+		return false;
+
+	QDataStream ds( &journal );
+	ds.setByteOrder( QDataStream::LittleEndian );
+	ds << committedSize_;
+
+	if ( ds.status() != QDataStream::Ok || !_syncFile( journal ) )
+		return false;
+
+	isCommitJournalWritten_ = true;
 	return true;
 }
 
 
-bool ArchivePrivate::_processFileFlushRequest( ArchiveFileFlushRequest * flushRequest )
+/**
+ * Removes commit journal once archive file ends with committed contents again.
+ */
+void ArchivePrivate::_removeCommitJournal()
 {
-	return true;
+	_setTemporaryDisabled( true );
+	QFile::remove( _commitJournalFileName() );
+	_setTemporaryDisabled( false );
+
+	isCommitJournalWritten_ = false;
 }
 
 
@@ -32,11 +32,16 @@
 #include <QMutex>
 #include <QReadWriteLock>
 #include <QWaitCondition>
+#include <QAtomicInt>
 #include <QThreadStorage>
 #include <QHash>
+#include <QMap>
+#include <QSet>
 #include <QSharedDataPointer>
 #include <QEvent>
 #include <QBasicTimer>
+#include <QBuffer>
+#include <QVector>
 
 #include <zlib.h>
 
@@ -52,6 +57,7 @@ extern QString toShortPath( const QString & path );
 extern QString toLongPath( const QString & path );
 extern QString softToHardCleanPath( const QString & path );
 extern QString toSoftCleanPath( const QString & path );
+extern qint64 archiveTimestamp();
 
 
 
@@ -59,6 +65,7 @@ extern QString toSoftCleanPath( const QString & path );
 class ArchiveFile;
 class ArchivePrivate;
 class ArchiveWorker;
+class ArchiveTraceWriter;
 
 
 
@@ -78,7 +85,9 @@ public:
 	};
 
 	inline ArchiveFileRequest( ArchiveFile * file, Type type ) :
-		file_( file ), type_( type ), isDone_( false )
+		file_( file ), type_( type ), isDone_( false ),
+		priority_( Archive::Priority_Normal ), deadline_( -1 ), queuedTime_( 0 ),
+		threadId_( QThread::currentThreadId() )
 	{}
 
 	inline ArchiveFile * file() const
@@ -93,10 +102,32 @@ public:
 	inline void setDone()
 	{ isDone_ = true; }
 
+	inline int priority() const
+	{ return priority_; }
+
+	inline qint64 deadline() const
+	{ return deadline_; }
+
+	inline qint64 queuedTime() const
+	{ return queuedTime_; }
+
+	inline void setSchedule( int priority, qint64 deadline, qint64 queuedTime )
+	{ priority_ = priority; deadline_ = deadline; queuedTime_ = queuedTime; }
+
+	inline Qt::HANDLE threadId() const
+	{ return threadId_; }
+
 private:
 	ArchiveFile * file_;
 	Type type_;
 	bool isDone_;
+
+	// scheduling, all times are in microseconds from archiveTimestamp()
+	int priority_;
+	qint64 deadline_; // absolute time or -1 if request has no deadline
+	qint64 queuedTime_;
+
+	Qt::HANDLE threadId_; // thread that issued request
 };
 
 
@@ -294,10 +325,16 @@ public:
 class ArchiveFileInstance
 {
 public:
+	inline ArchiveFileInstance()
+	{}
+
 	inline ArchiveFileInstance( ArchiveFileInstanceData * _d ) :
 		d( _d )
 	{}
 
+	inline bool isNull() const
+	{ return !d; }
+
 	inline bool operator==( const ArchiveFileInstance & fileInstance ) const
 	{ return d == fileInstance.d; }
 
@@ -305,21 +342,90 @@ public:
 };
 
 
+// file instances are kept in sets, so registering and linking cost the same for any number of files
+inline uint qHash( const ArchiveFileInstance & fileInstance )
+{ return ::qHash( fileInstance.d.data() ); }
+
+
+
+
+class ArchiveInflateContext
+{
+public:
+	inline ArchiveInflateContext() :
+		file( 0 )
+	{}
+
+	z_stream zStream;
+	QByteArray readBuffer;
+	ArchiveFile * file; // file this context is attached to or 0 if context is free
+};
+
+
+
+
+class ArchiveWriteContext
+{
+public:
+	inline ArchiveWriteContext() :
+		file( 0 ), headerOffset( -1 ), offset( -1 ), crc32( 0 ), size( 0 ), compressedSize( 0 ),
+		modDate( 0 ), modTime( 0 ), isFailed( false )
+	{}
+
+	z_stream zStream;
+	ArchiveFile * file;    // file being written or 0 if nothing is written
+	qint64 headerOffset;   // offset of local file header, patched with sizes and crc32 on closing
+	qint64 offset;         // offset where next compressed data goes
+	quint32 crc32;
+	qint64 size;
+	qint64 compressedSize;
+	quint16 modDate;
+	quint16 modTime;
+	bool isFailed;         // data was not written completely, file will be dropped on closing
+};
+
+
 
 
 class ArchiveThreadCache
 {
 public:
 	inline ArchiveThreadCache() :
-		isManagerDisabled( false )
+		isManagerDisabled( false ),
+		requestPriority( Archive::Priority_Normal ),
+		requestDeadline( -1 ),
+		freeFileBlocks( 0 ),
+		freeFileBlockCount( 0 )
 	{}
 
+	~ArchiveThreadCache();
+
 	bool isManagerDisabled;
 	QList<ArchiveInstance> disabledArchives;
+
+	// defaults for file requests issued from this thread
+	int requestPriority;
+	int requestDeadline;
+
+	// memory of destroyed ArchiveFile objects, reused for new ones
+	// each free block holds pointer to the next one in its first bytes
+	void * freeFileBlocks;
+	int freeFileBlockCount;
 };
 
 
 extern ArchiveThreadCache * archiveThreadCache();
+extern ArchiveThreadCache * existingArchiveThreadCache();
+
+
+
+
+class ArchiveFilePriorityOption : public QAbstractFileEngine::ExtensionOption
+{
+public:
+	int priority;
+	int deadline;
+};
 
 
 
@@ -340,6 +446,19 @@ public:
 	bool canRead;                 // only deflate supported
 	bool isSequential;            // is sequential, i.e. compressed
 	bool isDir;                   // entry is a directory
+	int packBlockRef;             // index of the first block reference of Grim pack entry or -1 for zip entries
+	int arenaOffset;              // offset of contents in small file arena or -1 if not loaded there
+};
+
+
+
+
+// block of Grim pack archive, compressed independently from the others
+struct ArchivePackBlock
+{
+	qint64 offset;      // offset of block data in archive
+	int compressedSize; // equals to size for stored blocks
+	int size;           // uncompressed size
 };
 
 
@@ -352,7 +471,8 @@ public:
 		parentEntry( 0 ),
 		existedBeforeUpdate( false ),
 		existedAfterUpdate( true ),
-		changedAfterUpdate( false )
+		changedAfterUpdate( false ),
+		isPopulated( false )
 	{}
 
 	ArchiveEntry * parentEntry;
@@ -361,43 +481,90 @@ public:
 
 	ArchiveEntryInfo info;
 
-	QList<ArchiveFileInstance> fileInstances;
+	QSet<ArchiveFileInstance> fileInstances;
 
 	bool existedBeforeUpdate;
 	bool existedAfterUpdate;
 	bool changedAfterUpdate;
+	bool isPopulated; // all children are constructed, used only with LazyEntries
 };
 
 
 
 
-class ArchivePrivate : public QObject
+/** \internal
+ * Compressed entry inflated as a whole on thread pool.
+ * Shared between opened file and pool task, so either of them could be gone first.
+ */
+class ArchiveInflateJob : public QSharedData
 {
-	Q_OBJECT
+public:
+	ArchiveInflateJob();
+
+	bool claim();
+	void run();
+	bool wait();
+
+	QByteArray compressedData; // released after inflating
+	QByteArray data;
+	qint64 size;
+	quint32 crc32;
+
+	QMutex mutex;
+	QWaitCondition waiter;
+	bool isClaimed; // guarded by mutex, set by the first of pool thread and waiting file
+	bool isDone;    // guarded by mutex
+	bool isOk;      // guarded by mutex
+};
 
+
+
+
+// name of file or implied directory inside raw central directory, used with LazyEntries
+struct ArchiveLazyName
+{
+	int record;   // offset of central file header record
+	int nameSize; // size of the file name, or of its leading part for implied directory
+};
+
+
+
+
+class ArchiveSealedContents : public QSharedData
+{
 public:
-	enum EventType
-	{
-		EventType_StateChanged = QEvent::User + 1
-	};
+	ArchiveSealedContents();
+	~ArchiveSealedContents();
 
-	class StateChangedEvent : public QEvent
-	{
-	public:
-		StateChangedEvent( int s, bool b ) :
-			QEvent( (QEvent::Type)EventType_StateChanged ),
-			state( s ), isBroken( b )
-		{}
-
-		int state;
-		bool isBroken;
-	};
+	ArchiveEntry * entryForFilePath( const QString & filePath ) const;
+
+	bool canReadDirectly( const ArchiveEntry * entry ) const;
+	qint64 dataOffset( const ArchiveEntry * entry ) const;
+	qint64 read( qint64 offset, char * data, qint64 maxlen ) const;
+
+	QHash<QString,ArchiveEntry*> entryForFilePath_;
+	QHash<QString,ArchiveEntry*> entryForFoldedPath_; // empty unless archive is case insensitive
+	ArchiveEntry * rootEntry_; // owned by sealed contents, destroyed together with them
+
+	int fileHandle_;        // own duplicate of archive file descriptor for positional reads or -1
+	qint64 archiveOffset_;  // offset of archive inside file, non zero for nested archives
+};
+
+
+
+
+class ArchivePrivate : public QObject
+{
+	Q_OBJECT
 
+public:
 	ArchivePrivate( Archive * archive );
 	~ArchivePrivate();
 
 	void setFileName( const QString & fileName );
 	void setMountPoint( const QString & mountPoint );
+	void setDevice( QIODevice * device );
+	void setData( const QByteArray & data );
 
 	QString actualMountPoint() const;
 	QString cleanMountPointPath() const;
@@ -405,8 +572,14 @@ public:
 	QReadWriteLock * initializationMutex() const;
 
 	bool open( Grim::Archive::OpenMode openMode );
+	bool beginOpen( Grim::Archive::OpenMode openMode );
+	bool endOpen();
 	void close();
 
+	bool isNestedInto( const ArchivePrivate * archive ) const;
+	qint64 initialUpdateTime() const;
+	qint64 readyTime() const;
+
 	bool isInitialized() const;
 
 	Grim::Archive::OpenMode openMode() const;
@@ -414,55 +587,158 @@ public:
 	bool treatAsDir() const;
 	void setTreatAsDir( bool set );
 
+	int maxInflateContexts() const;
+	void setMaxInflateContexts( int count );
+
+	int lingerTime() const;
+	void setLingerTime( int msecs );
+
+	int smallFileThreshold() const;
+	void setSmallFileThreshold( int size );
+
+	int backgroundInflateThreshold() const;
+	void setBackgroundInflateThreshold( int size );
+
+	bool useCacheHints() const;
+	void setUseCacheHints( bool set );
+
+	bool startTrace( const QString & fileName );
+	void stopTrace();
+	bool isTracing() const;
+
+	void prefetch( const QStringList & filePaths, qint64 budget );
+	void cancelPrefetch();
+	Archive::PrefetchStatistics prefetchStatistics() const;
+
 	QString globalComment() const;
+	Archive::Type type() const;
 
 	void registerFile( ArchiveFile * file );
 	void unregisterFile( ArchiveFile * file );
 
+	ArchiveEntry * findFileEntry( ArchiveFile * file );
 	void linkFile( ArchiveFile * file );
 	void unlinkFile( ArchiveFile * file );
 
 	ArchiveEntry * entryForFilePath( const QString & filePath ) const;
+	void populateEntry( ArchiveEntry * entry );
+	bool openFileFromArena( ArchiveFile * file );
+
+	QList<Archive::EntryInfo> query( const QString & prefix, const QStringList & nameFilters, Archive::QueryFlags flags );
+
+	bool commit();
 
 	QReadWriteLock * contentsMutex() const;
+	QExplicitlySharedDataPointer<ArchiveSealedContents> sealedContents() const;
 
 //	QFileInfo fileInfoForEntry( ArchiveEntry * entry );
 
 	void processFileRequest( ArchiveFileRequest * request );
 
+	Archive::RequestStatistics requestStatistics( Archive::Priority priority ) const;
+	void resetRequestStatistics();
+
+	Archive::Statistics statistics() const;
+	void resetStatistics();
+	void countCacheHit();
+	void countBackgroundInflate( qint64 bytes );
+
+	bool resolveStoredEntry( ArchiveFile * file, QString & hostFileName, qint64 & offset, qint64 & size ) const;
+	qint64 readEntry( const QString & filePath, qint64 offset, char * data, qint64 maxlen, Archive::ReadFlags flags );
+	int _directHandle();
+	void _closeDirectHandle();
+
 protected:
-	bool event( QEvent * e );
 	void timerEvent( QTimerEvent * e );
 
+private slots:
+	void _applyReportedState();
+
 private:
 	void _setState( Archive::State state, bool isBroken );
+	void _reportState( Archive::State state, bool isBroken );
 
 	void _makeCleanMountPointPath();
 
 	void _setTemporaryDisabled( bool set );
 
 	bool _openArchive( Grim::Archive::OpenMode openMode );
+	void _resolveArchiveFile();
+	bool _openArchiveDevice();
+	void _closeArchiveDevice();
+
+	bool _seekArchive( qint64 pos );
+	qint64 _archivePos() const;
+	qint64 _archiveSize() const;
+
+	void _adviseArchive( qint64 pos, qint64 length, int advice );
+	void _adviseEntry( ArchiveEntry * entry, qint64 length, int advice );
+	void _adviseAccessPattern( ArchiveEntry * entry );
 
 	void _abortWorker();
 	void _workerBody();
 
 	bool _updateArchive();
+	void _sealContents();
+	Archive::Type _detectType();
 	bool _loadCentralDirectory();
+	qint64 _findEndOfCentralDirectory( qint64 endOffset, bool isExactEnd );
+	bool _startAppending( qint64 centralDirectoryOffset, qint64 centralDirectorySize, qint64 committedSize );
+	bool _loadPackIndex();
+	bool _loadLazyIndex( qint64 offset, qint64 size, int count );
+	bool _findLazyName( const QByteArray & filePath, ArchiveLazyName & lazyName ) const;
+	bool _isLazyDir( const ArchiveLazyName & lazyName ) const;
+	ArchiveEntry * _materializeLazyName( const ArchiveLazyName & lazyName );
+	ArchiveEntry * _lookupEntry( const QString & filePath );
+	void _buildQueryIndex();
+	void _buildFoldedIndex();
+	bool _lazyEntryInfo( const ArchiveLazyName & lazyName, Archive::EntryInfo & info ) const;
 	bool _addFileHeader( const void * fileHeaderP );
 
 	bool _openInflate( ArchiveFile * file );
 	void _closeInflate( ArchiveFile * file );
+	bool _resumeInflate( ArchiveFile * file );
+	qint64 _inflate( ArchiveFile * file, char * data, qint64 maxlen );
+	bool _startBackgroundInflate( ArchiveFile * file );
+	ArchiveInflateContext * _takeInflateContext();
+	void _detachInflateContext( ArchiveFile * file );
+	void _destroyInflateContexts();
 	bool _seekDataOffset( ArchiveEntry * entry );
 	void _cleanupOpenedFile( ArchiveFile * file );
 
-	void _processFileRequests( QList<ArchiveFileRequest*> & requests );
+	ArchiveFileRequest * _takeNextRequest();
+	void _publishStatistics( qint64 busyTime );
+	void _traceRequest( ArchiveFileRequest * request );
+
+	bool _hasPrefetchJob() const;
+	void _processPrefetch();
+	void _prefetchEntry( const QString & filePath );
+	bool _inflateEntry( ArchiveEntry * entry, QByteArray & data );
+	bool _inflateEntry( ArchiveEntry * entry, char * data );
+	void _loadSmallFiles();
+	void _takePrefetchedData( ArchiveFile * file );
+	void _processFileRequests();
 	bool _processFileOpenRequest( ArchiveFileOpenRequest * openRequest );
 	bool _processFileCloseRequest( ArchiveFileCloseRequest * closeRequest );
 	bool _processFileSeekRequest( ArchiveFileSeekRequest * seekRequest );
 	bool _processFileReadRequest( ArchiveFileReadRequest * readRequest );
+	qint64 _readPacked( ArchiveFile * file, char * data, qint64 maxlen );
 	bool _processFileWriteRequest( ArchiveFileWriteRequest * writeRequest );
 	bool _processFileFlushRequest( ArchiveFileFlushRequest * flushRequest );
 
+	bool _canWriteFile( const QString & filePath );
+	QString _writtenFilePath( ArchiveFile * file );
+	bool _openForWriting( ArchiveFile * file );
+	bool _closeForWriting( ArchiveFile * file );
+	void _abortWriting();
+	bool _deflateWritten( const char * data, uInt size, int flush );
+	bool _commit();
+	bool _syncArchive();
+	QString _commitJournalFileName() const;
+	qint64 _readCommitJournal();
+	bool _writeCommitJournal();
+	void _removeCommitJournal();
+
 private:
 	ArchiveInstance archiveInstance_;
 
@@ -485,12 +761,25 @@ private:
 
 	ArchiveWorker * worker_;
 
-	QReadWriteLock invokationMutex_;
-	QWaitCondition invokationWaiter_;
-	bool isWorkerAborted_;
-	bool isInvoked_;
+	QAtomicInt isWorkerAborted_;
+
+	// state changes are reported by worker without waiting until archive's thread applies them
+	QAtomicInt reportedState_;        // last reported state shifted left by one, lowest bit is broken flag
+	QAtomicInt isStateReportPending_; // invocation of _applyReportedState() is queued
 
 	QFile archiveFile_;
+	QByteArray archiveData_;    // contents set with setData() or null
+	QBuffer archiveBuffer_;     // reads archiveData_
+	QIODevice * customDevice_;  // device set with setDevice() or 0
+	QIODevice * archiveDevice_; // one of above devices that actually holds archive data
+	bool isDeviceOpenedBySelf_; // archiveDevice_ was opened by archive and should be closed by it
+	qint64 archiveOffset_; // offset of archive inside archiveDevice_, non zero for nested archives
+	qint64 archiveSize_;   // size of nested archive or -1 if archive occupies whole archiveDevice_
+
+	// archive file opened for unbuffered reads of readEntry() on first need, closed on closing archive
+	QMutex directHandleMutex_;
+	int directHandle_;           // guarded by directHandleMutex_, -1 if not opened
+	bool wasDirectHandleOpened_; // guarded by directHandleMutex_, opening is not retried after failure
 
 	// blocker waiter
 	QMutex blockMutex_;
@@ -501,34 +790,133 @@ private:
 	QWaitCondition jobWaiter_;
 	bool isWaitingForJob_;
 
-	// file requests
+	// commits are done by worker on behalf of commit() callers
+	int commitRequests_;          // number of commits requested so far
+	int commitsDone_;             // number of requested commits worker has done
+	bool isLastCommitOk_;
+	QWaitCondition commitWaiter_; // waits with jobMutex_
+
+	// file requests, worker takes them one by one ordered by priority and deadline
 	QList<ArchiveFileRequest*> requests_;
 	bool isTimeToUpdate_;
+	Archive::RequestStatistics requestStatistics_[ Archive::Priority_Realtime + 1 ];
+
+	// runtime statistics, guarded by jobMutex_ except counters below
+	Archive::Statistics statistics_;
+	QAtomicInt cacheHits_;  // bumped by reading threads without locking
+	qint64 bytesRead_;      // not published yet, touched only from worker
+	qint64 bytesInflated_;  // not published yet, touched only from worker
 
 	// update
 	bool wasInitialUpdate_;
+	qint64 initialUpdateTime_; // duration of initial update in microseconds, guarded by blockMutex_
+	qint64 readyTime_;         // timestamp when initial update was finished, guarded by blockMutex_
 	QDateTime archiveLastModified_;
 	bool isArchiveDirty_;
 	QTime updateIntervalTime_;
+	int lingerTime_;        // guarded by jobMutex_
+	QTime lingerStartTime_; // null unless archive file lingers opened in non locked mode, touched only from worker
 	QBasicTimer updateTimer_;
 
 	// contents
 	QReadWriteLock contentsMutex_;
 
+	Archive::Type type_;
 	QString globalComment_;
 	QHash<QString,ArchiveEntry*> entryForFilePath_;
+	QHash<QString,ArchiveEntry*> entryForFoldedPath_; // case folded paths, built on update in CaseInsensitive mode
 	ArchiveEntry * rootEntry_;
 
+	// raw central directory and hashes of names for LazyEntries mode,
+	// entries are constructed on demand under lazyMutex_ while contents are locked for reading
+	QMutex lazyMutex_;
+	QByteArray lazyDirectory_;
+	QMultiHash<uint,ArchiveLazyName> lazyNameForPathHash_;
+	QMultiHash<uint,ArchiveLazyName> lazyChildForDirHash_;
+
+	// all paths in sorted order for query(), built on first query after update,
+	// entries are indexed in normal mode and lazy names with LazyEntries
+	QMutex queryMutex_;
+	bool isQueryIndexDirty_;
+	QVector<ArchiveEntry*> queryEntries_;
+	QVector<ArchiveLazyName> queryLazyNames_;
+
+	// contents of small files loaded in one sweep on update, read right in the file threads
+	int smallFileThreshold_; // guarded by jobMutex_
+	QByteArray smallFileArena_;
+
+	// compressed files of this size and larger are inflated whole on thread pool
+	int backgroundInflateThreshold_; // guarded by jobMutex_
+
+	// block table of Grim pack, touched only from worker
+	int packBlockSize_;
+	QVector<ArchivePackBlock> packBlocks_;
+	QVector<quint32> packBlockRefs_; // blocks of each entry one after another, shared blocks are referenced many times
+
+	// appending of written files, committed zip contents end with central directory followed by end record,
+	// written files go after them and become visible only when new central directory is committed
+	qint64 centralDirectoryOffset_; // committed central directory
+	qint64 centralDirectorySize_;
+	qint64 appendOffset_;           // end of committed contents and files written after them or -1
+	qint64 committedSize_;          // end of committed end record, persisted in commit journal while files are appended
+	bool isCommitJournalWritten_;
+	ArchiveWriteContext writeContext_;
+	QMap<QString,QByteArray> pendingRecords_; // central directory records of written files, not committed yet
+
+	// immutable copy of contents published after initial update in Sealed mode,
+	// owns all entries, so file engines may query it without locking
+	QExplicitlySharedDataPointer<ArchiveSealedContents> sealedContents_;
+
 	// registered files
 	QReadWriteLock fileInstancesMutex_;
-	QList<ArchiveFileInstance> fileInstances_;
+	QSet<ArchiveFileInstance> fileInstances_;
 
 	// linked files
 	QReadWriteLock linkedFileInstancesMutex_;
-	QList<ArchiveFileInstance> linkedFileInstances_;
+	QSet<ArchiveFileInstance> linkedFileInstances_;
 
 	// opened files
-	QList<ArchiveFileInstance> openedFileInstances_;
+	QSet<ArchiveFileInstance> openedFileInstances_;
+
+	// access trace
+	QMutex traceMutex_;
+	ArchiveTraceWriter * traceWriter_;
+
+	// prefetch, processed by worker when there are no file requests
+	enum PrefetchState
+	{
+		Prefetch_Queued = 0,
+		Prefetch_Cached,
+		Prefetch_Hinted,
+		Prefetch_Skipped
+	};
+
+	QMutex prefetchMutex_;
+	QList<QString> prefetchQueue_;
+	QHash<QString,int> prefetchStateForFilePath_; // listed files that were not opened yet
+	QHash<QString,QByteArray> prefetchCache_;
+	qint64 prefetchBudget_;
+	bool isPrefetchBlocked_; // next file does not fit into budget until some cached file will be used
+	Archive::PrefetchStatistics prefetchStatistics_;
+
+	// kernel cache hints
+	enum CacheAdvice
+	{
+		CacheAdvice_Normal = 0,
+		CacheAdvice_Random,
+		CacheAdvice_Sequential,
+		CacheAdvice_WillNeed,
+		CacheAdvice_DontNeed
+	};
+
+	bool useCacheHints_;
+	int accessAdvice_; // access pattern currently advised for archiveFile_, touched only from worker
+
+	// pool of inflate contexts, touched only from worker
+	int maxInflateContexts_;
+	QList<ArchiveInflateContext*> freeInflateContexts_;
+	QList<ArchiveInflateContext*> attachedInflateContexts_; // from least to most recently used
+	QByteArray inflateSkipBuffer_;
 
 	friend class ArchiveWorker;
 	friend class Archive;
@@ -544,6 +932,9 @@ public:
 		const QString & internalFileName, bool isRelativePath );
 	~ArchiveFile();
 
+	static void * operator new( size_t size );
+	static void operator delete( void * p, size_t size );
+
 	bool caseSensitive() const;
 	bool isSequential() const;
 	bool isRelativePath() const;
@@ -576,14 +967,25 @@ public:
 	QString owner( FileOwner owner ) const;
 	uint ownerId( FileOwner owner ) const;
 
+	enum
+	{
+		// custom extension for Archive::setFilePriority(), tagged with 'Grim'
+		PriorityExtension = 0x4772696d
+	};
+
 	bool supportsExtension( Extension extension ) const;
 	bool extension( Extension extension, const ExtensionOption * option, ExtensionReturn * output );
 
 private:
 	void _updateFileNames();
+	bool _openForWriting( QIODevice::OpenMode mode );
+	bool _takeInflatedData();
+
+	ArchiveEntry * _sealedEntry() const;
+	bool _isOpenedDirectly() const;
 
 private:
-	ArchiveFileInstance fileInstance_;
+	ArchiveFileInstance fileInstance_; // null until file is registered in archive on first opening
 	ArchiveInstance archiveInstance_;
 
 	QString fileName_;
@@ -600,10 +1002,31 @@ private:
 	// mutable only from file
 	QIODevice::OpenMode openMode_;
 	qint64 pos_;
+	int priority_;
+	int deadline_;
 
 	// linked entry
 	ArchiveEntry * entry_;
 
+	// prefetched contents, set by worker on opening and then read right in the file thread
+	QByteArray cachedDataSource_; // keeps memory archive alive while cachedData_ points inside it
+	QByteArray cachedData_;
+
+	// stored entries of memory archive mapped right inside archive data
+	QByteArray mappedDataSource_; // keeps memory archive alive while it is mapped, even after closing
+	QList<uchar*> mappedAddresses_;
+
+	// contents of sealed archive, queried and read directly from the file thread
+	QExplicitlySharedDataPointer<ArchiveSealedContents> sealedContents_;
+	ArchiveEntry * sealedEntry_;
+	bool isSealedEntryResolved_;
+	qint64 sealedDataOffset_; // data offset when stored entry is opened directly or -1
+	bool isOpenedFromArena_;  // opened with contents from small file arena, worker knows nothing about it
+	bool isOpenedForWriting_; // opened for replacing contents, data is appended to archive by worker
+
+	// whole contents being inflated on thread pool, set by worker on opening and then waited by file thread
+	QExplicitlySharedDataPointer<ArchiveInflateJob> inflateJob_;
+
 	// requests
 	QWaitCondition requestWaiter_;
 	QReadWriteLock requestMutex_;
@@ -611,11 +1034,15 @@ private:
 
 	// mutable only from archive worker
 	quint32 zCrc32_;
-	z_stream zStream_;
-	QByteArray zReadBuffer_;
+	ArchiveInflateContext * zContext_; // attached only while file is actively inflated
 	qint64 zCompressedPos_;
 	qint64 zRestCompressed_;
 	qint64 zRestUncompressed_;
+	QByteArray packBlock_; // last partially read block of Grim pack entry
+	int packBlockIndex_;   // index of packBlock_ in block table or -1
+	qint64 packCrc32Pos_;  // end of leading data of Grim pack entry covered by zCrc32_
+	bool wasRewound_;     // file was seeked backward since opening
+	bool wasReadThrough_; // file was read up to the end since opening
 
 	friend class ArchiveManagerPrivate;
 	friend class ArchivePrivate;
@@ -658,7 +1085,9 @@ inline ArchiveEntryInfo::ArchiveEntryInfo() :
 	crc32( 0 ),
 	canRead( true ),
 	isSequential( false ),
-	isDir( true )
+	isDir( true ),
+	packBlockRef( -1 ),
+	arenaOffset( -1 )
 {}
 
 
@@ -679,11 +1108,20 @@ inline QReadWriteLock * ArchivePrivate::initializationMutex() const
 inline QReadWriteLock * ArchivePrivate::contentsMutex() const
 { return const_cast<QReadWriteLock*>( &contentsMutex_ ); }
 
+inline bool ArchivePrivate::_seekArchive( qint64 pos )
+{ return archiveDevice_->seek( archiveOffset_ + pos ); }
+
+inline qint64 ArchivePrivate::_archivePos() const
+{ return archiveDevice_->pos() - archiveOffset_; }
+
+inline qint64 ArchivePrivate::_archiveSize() const
+{ return archiveSize_ != -1 ? archiveSize_ : archiveDevice_->size(); }
+
 
 
 
-inline bool ArchiveFile::caseSensitive() const
-{ return true; }
+inline bool ArchiveFile::_isOpenedDirectly() const
+{ return sealedDataOffset_ != -1; }
 
 
 
@@ -38,6 +38,12 @@ namespace Grim {
 
 
 
+// maximum number of destroyed file blocks kept for reuse in each thread
+static const int MaxFreeFileBlocks = 64;
+
+
+
+
 static const QString DotFileName    = QLatin1String( "." );
 static const QString DotDotFileName = QLatin1String( ".." );
 
@@ -115,6 +121,69 @@ private:
 
 
 
+static QAbstractFileEngine::FileFlags fileFlagsForEntry( const ArchiveEntry * entry, QAbstractFileEngine::FileFlags type )
+{
+	if ( !entry )
+		return 0;
+
+	QAbstractFileEngine::FileFlags flags =
+		QAbstractFileEngine::ReadOwnerPerm |
+		QAbstractFileEngine::ReadUserPerm |
+		QAbstractFileEngine::ReadGroupPerm |
+		QAbstractFileEngine::ReadOtherPerm |
+		QAbstractFileEngine::ExistsFlag;
+
+	if ( entry->info.isDir )
+	{
+		flags |= QAbstractFileEngine::DirectoryType;
+	}
+	else
+	{
+		flags |= QAbstractFileEngine::FileType;
+	}
+
+	return flags & type;
+}
+
+
+static QStringList entryListForEntry( const ArchiveEntry * entry, QDir::Filters filters, const QStringList & filterNames )
+{
+	if ( !entry )
+		return QStringList();
+
+	if ( !entry->info.isDir )
+		return QStringList();
+
+	Filter filter( filters, filterNames );
+
+	QStringList list;
+
+	if ( !(filters & QDir::NoDotAndDotDot) )
+		list << DotFileName << DotDotFileName;
+
+	QList<ArchiveEntry*>::ConstIterator end = entry->entries.constEnd();
+	for ( QList<ArchiveEntry*>::ConstIterator it = entry->entries.constBegin(); it != end; ++it )
+	{
+		const ArchiveEntry * childEntry = *it;
+
+		if ( childEntry->info.isDir )
+		{
+			if ( filter.testDir( childEntry->info.fileName ) )
+				list << childEntry->info.fileName;
+		}
+		else
+		{
+			if ( filter.testFile( childEntry->info.fileName ) )
+				list << childEntry->info.fileName;
+		}
+	}
+
+	return list;
+}
+
+
+
+
 /** \internal
  *
  * \class ArchiveFile
@@ -129,15 +198,26 @@ private:
 ArchiveFile::ArchiveFile( const ArchiveInstance & archiveInstance,
 	const QString & fileName, const QString & absoluteFilePath,
 	const QString & internalFileName, bool isRelativePath ) :
-	fileInstance_( new ArchiveFileInstanceData( this ) ),
 	archiveInstance_( archiveInstance ),
 	fileName_( fileName ),
 	internalFileName_( internalFileName ),
 	fileNameAbsolute_( absoluteFilePath ),
 	isRelativePath_( isRelativePath ),
 	pos_( -1 ),
+	priority_( archiveThreadCache()->requestPriority ),
+	deadline_( archiveThreadCache()->requestDeadline ),
 	entry_( 0 ),
-	request_( 0 )
+	request_( 0 ),
+	zContext_( 0 ),
+	packBlockIndex_( -1 ),
+	packCrc32Pos_( 0 ),
+	wasRewound_( false ),
+	wasReadThrough_( false ),
+	sealedEntry_( 0 ),
+	isSealedEntryResolved_( false ),
+	sealedDataOffset_( -1 ),
+	isOpenedFromArena_( false ),
+	isOpenedForWriting_( false )
 {
 }
 
@@ -148,6 +228,10 @@ ArchiveFile::~ArchiveFile()
 		"Grim::File::~File()",
 		"File must be closed." );
 
+	// file was only queried for info, archive knows nothing about it
+	if ( !entry_ && fileInstance_.isNull() )
+		return;
+
 	{
 		ArchiveInstanceLocker archiveLocker( archiveInstance_ );
 
@@ -164,13 +248,65 @@ ArchiveFile::~ArchiveFile()
 		}
 	}
 
-	QWriteLocker selfLocker( &fileInstance_.d->mutex );
-	fileInstance_.d->file = 0;
+	if ( !fileInstance_.isNull() )
+	{
+		QWriteLocker selfLocker( &fileInstance_.d->mutex );
+		fileInstance_.d->file = 0;
+	}
+}
+
+
+/**
+ * Allocates memory for file from the per thread pool of destroyed files.
+ * Asset loaders create and destroy file engines for every QFileInfo query,
+ * so this saves a heap allocation on each of them.
+ */
+void * ArchiveFile::operator new( size_t size )
+{
+	if ( size != sizeof(ArchiveFile) )
+		return ::operator new( size );
+
+	ArchiveThreadCache * threadCache = archiveThreadCache();
+
+	if ( !threadCache->freeFileBlocks )
+		return ::operator new( size );
+
+	void * block = threadCache->freeFileBlocks;
+	threadCache->freeFileBlocks = *reinterpret_cast<void**>( block );
+	threadCache->freeFileBlockCount--;
+
+	return block;
+}
+
+
+void ArchiveFile::operator delete( void * p, size_t size )
+{
+	if ( !p )
+		return;
+
+	// do not recreate cache of the finishing thread
+	ArchiveThreadCache * threadCache = existingArchiveThreadCache();
+
+	if ( size != sizeof(ArchiveFile) || !threadCache || threadCache->freeFileBlockCount >= MaxFreeFileBlocks )
+	{
+		::operator delete( p );
+		return;
+	}
+
+	*reinterpret_cast<void**>( p ) = threadCache->freeFileBlocks;
+	threadCache->freeFileBlocks = p;
+	threadCache->freeFileBlockCount++;
 }
 
 
 bool ArchiveFile::isSequential() const
 {
+	if ( sealedContents_ )
+	{
+		const ArchiveEntry * entry = _sealedEntry();
+		return entry ? entry->info.isSequential : false;
+	}
+
 	ArchiveInstanceLocker archiveLocker( archiveInstance_ );
 
 	if ( !archiveLocker.archive() )
@@ -178,12 +314,26 @@ bool ArchiveFile::isSequential() const
 
 	QReadLocker contentsLocker( archiveLocker.archive()->contentsMutex() );
 
-	archiveLocker.archive()->linkFile( const_cast<ArchiveFile*>( this ) );
+	const ArchiveEntry * entry = archiveLocker.archive()->findFileEntry( const_cast<ArchiveFile*>( this ) );
 
-	if ( !entry_ )
+	if ( !entry )
 		return false;
 
-	return entry_->info.isSequential;
+	return entry->info.isSequential;
+}
+
+
+bool ArchiveFile::caseSensitive() const
+{
+	if ( sealedContents_ )
+		return sealedContents_->entryForFoldedPath_.isEmpty();
+
+	ArchiveInstanceLocker archiveLocker( archiveInstance_ );
+
+	if ( !archiveLocker.archive() )
+		return true;
+
+	return !(archiveLocker.archive()->openMode() & Grim::Archive::CaseInsensitive);
 }
 
 
@@ -236,6 +386,23 @@ void ArchiveFile::_updateFileNames()
 }
 
 
+/**
+ * Returns entry of sealed archive for this file or 0 if there is no such.
+ * Entry is looked up once and then remembered, sealed contents never change.
+ */
+ArchiveEntry * ArchiveFile::_sealedEntry() const
+{
+	if ( !isSealedEntryResolved_ )
+	{
+		ArchiveFile * self = const_cast<ArchiveFile*>( this );
+		self->sealedEntry_ = sealedContents_->entryForFilePath( internalFileName_ );
+		self->isSealedEntryResolved_ = true;
+	}
+
+	return sealedEntry_;
+}
+
+
 QString ArchiveFile::fileName( FileName file ) const
 {
 	switch ( file )
@@ -272,6 +439,9 @@ QString ArchiveFile::fileName( FileName file ) const
 
 QAbstractFileEngine::FileFlags ArchiveFile::fileFlags( FileFlags type ) const
 {
+	if ( sealedContents_ )
+		return fileFlagsForEntry( _sealedEntry(), type );
+
 	ArchiveInstanceLocker archiveLocker( archiveInstance_ );
 
 	if ( !archiveLocker.archive() )
@@ -279,33 +449,18 @@ QAbstractFileEngine::FileFlags ArchiveFile::fileFlags( FileFlags type ) const
 
 	QReadLocker contentsLocker( archiveLocker.archive()->contentsMutex() );
 
-	archiveLocker.archive()->linkFile( const_cast<ArchiveFile*>( this ) );
-
-	if ( !entry_ )
-		return 0;
-
-	FileFlags flags =
-		QAbstractFileEngine::ReadOwnerPerm |
-		QAbstractFileEngine::ReadUserPerm |
-		QAbstractFileEngine::ReadGroupPerm |
-		QAbstractFileEngine::ReadOtherPerm |
-		QAbstractFileEngine::ExistsFlag;
-
-	if ( entry_->info.isDir )
-	{
-		flags |= QAbstractFileEngine::DirectoryType;
-	}
-	else
-	{
-		flags |= QAbstractFileEngine::FileType;
-	}
-
-	return flags & type;
+	return fileFlagsForEntry( archiveLocker.archive()->findFileEntry( const_cast<ArchiveFile*>( this ) ), type );
 }
 
 
 QDateTime ArchiveFile::fileTime( FileTime time ) const
 {
+	if ( sealedContents_ )
+	{
+		const ArchiveEntry * entry = _sealedEntry();
+		return entry && time == ModificationTime ? entry->info.modTime : QDateTime();
+	}
+
 	ArchiveInstanceLocker archiveLocker( archiveInstance_ );
 
 	if ( !archiveLocker.archive() )
@@ -313,15 +468,15 @@ QDateTime ArchiveFile::fileTime( FileTime time ) const
 
 	QReadLocker contentsLocker( archiveLocker.archive()->contentsMutex() );
 
-	archiveLocker.archive()->linkFile( const_cast<ArchiveFile*>( this ) );
+	const ArchiveEntry * entry = archiveLocker.archive()->findFileEntry( const_cast<ArchiveFile*>( this ) );
 
-	if ( !entry_ )
+	if ( !entry )
 		return QDateTime();
 
 	switch ( time )
 	{
 	case ModificationTime:
-		return entry_->info.modTime;
+		return entry->info.modTime;
 	}
 
 	return QDateTime();
@@ -330,6 +485,9 @@ QDateTime ArchiveFile::fileTime( FileTime time ) const
 
 QStringList ArchiveFile::entryList( QDir::Filters filters, const QStringList & filterNames ) const
 {
+	if ( sealedContents_ )
+		return entryListForEntry( _sealedEntry(), filters, filterNames );
+
 	ArchiveInstanceLocker archiveLocker( archiveInstance_ );
 
 	if ( !archiveLocker.archive() )
@@ -337,39 +495,10 @@ QStringList ArchiveFile::entryList( QDir::Filters filters, const QStringList & f
 
 	QReadLocker contentsLocker( archiveLocker.archive()->contentsMutex() );
 
-	archiveLocker.archive()->linkFile( const_cast<ArchiveFile*>( this ) );
-
-	if ( !entry_ )
-		return QStringList();
-
-	if ( !entry_->info.isDir )
-		return QStringList();
-
-	Filter filter( filters, filterNames );
-
-	QStringList list;
-
-	if ( !(filters & QDir::NoDotAndDotDot) )
-		list << DotFileName << DotDotFileName;
-
-	QList<ArchiveEntry*>::Iterator end = entry_->entries.end();
-	for ( QList<ArchiveEntry*>::Iterator it = entry_->entries.begin(); it != end; ++it )
-	{
-		const ArchiveEntry * entry = *it;
+	ArchiveEntry * entry = archiveLocker.archive()->findFileEntry( const_cast<ArchiveFile*>( this ) );
+	archiveLocker.archive()->populateEntry( entry );
 
-		if ( entry->info.isDir )
-		{
-			if ( filter.testDir( entry->info.fileName ) )
-				list << entry->info.fileName;
-		}
-		else
-		{
-			if ( filter.testFile( entry->info.fileName ) )
-				list << entry->info.fileName;
-		}
-	}
-
-	return list;
+	return entryListForEntry( entry, filters, filterNames );
 }
 
 
@@ -383,8 +512,33 @@ bool ArchiveFile::open( QIODevice::OpenMode mode )
 {
 	if ( mode & QIODevice::WriteOnly )
 	{
-		qWarning( "Grim::ArchiveFile::open() : Only Read-only opening mode currently possible." );
-		return false;
+		if ( mode & (QIODevice::ReadOnly | QIODevice::Append) )
+		{
+			qWarning( "Grim::ArchiveFile::open() : Files can be opened either for reading or for replacing." );
+			return false;
+		}
+
+		return _openForWriting( mode );
+	}
+
+	if ( sealedContents_ )
+	{
+		// stored entries of sealed archive are read right in this thread, bypassing worker
+		const ArchiveEntry * entry = _sealedEntry();
+		if ( !entry )
+			return false;
+
+		if ( sealedContents_->canReadDirectly( entry ) )
+		{
+			sealedDataOffset_ = sealedContents_->dataOffset( entry );
+			if ( sealedDataOffset_ == -1 )
+				return false;
+
+			openMode_ = mode;
+			pos_ = 0;
+
+			return true;
+		}
 	}
 
 	ArchiveInstanceLocker archiveLocker( archiveInstance_ );
@@ -394,17 +548,67 @@ bool ArchiveFile::open( QIODevice::OpenMode mode )
 
 	QReadLocker contentsLocker( archiveLocker.archive()->contentsMutex() );
 
+	// files are registered and linked only when opened,
+	// so info queries that Qt performs on file engines stay cheap
+	archiveLocker.archive()->registerFile( this );
 	archiveLocker.archive()->linkFile( this );
 
 	// no such file inside archive or file is unreadable for us
 	if ( !entry_ )
 		return false;
 
+	// small file was loaded on update, no need to wake up worker
+	if ( archiveLocker.archive()->openFileFromArena( this ) )
+	{
+		openMode_ = mode;
+		pos_ = 0;
+
+		return true;
+	}
+
+	ArchiveFileOpenRequest openRequest( this, mode );
+	archiveLocker.archive()->processFileRequest( &openRequest );
+
+	if ( !openRequest.isDone() )
+		return false;
+
+	openMode_ = mode;
+	pos_ = 0;
+
+	return true;
+}
+
+
+/**
+ * Opens file for writing new contents, which replace the old ones when archive commits written files.
+ */
+bool ArchiveFile::_openForWriting( QIODevice::OpenMode mode )
+{
+	ArchiveInstanceLocker archiveLocker( archiveInstance_ );
+
+	if ( !archiveLocker.archive() )
+		return false;
+
+	if ( !(archiveLocker.archive()->openMode() & Grim::Archive::WriteOnly) )
+	{
+		qWarning( "Grim::ArchiveFile::open() : Archive is not opened for writing." );
+		return false;
+	}
+
+	QReadLocker contentsLocker( archiveLocker.archive()->contentsMutex() );
+
+	archiveLocker.archive()->registerFile( this );
+
+	isOpenedForWriting_ = true;
+
 	ArchiveFileOpenRequest openRequest( this, mode );
 	archiveLocker.archive()->processFileRequest( &openRequest );
 
 	if ( !openRequest.isDone() )
+	{
+		isOpenedForWriting_ = false;
 		return false;
+	}
 
 	openMode_ = mode;
 	pos_ = 0;
@@ -418,23 +622,51 @@ bool ArchiveFile::close()
 	if ( openMode_ == QIODevice::NotOpen )
 		return true;
 
+	if ( _isOpenedDirectly() )
+	{
+		openMode_ = QIODevice::NotOpen;
+		pos_ = -1;
+		sealedDataOffset_ = -1;
+		return true;
+	}
+
+	if ( isOpenedFromArena_ )
+	{
+		// worker knows nothing about this opening
+		openMode_ = QIODevice::NotOpen;
+		pos_ = -1;
+		cachedData_ = QByteArray();
+		cachedDataSource_ = QByteArray();
+		isOpenedFromArena_ = false;
+		return true;
+	}
+
 	ArchiveInstanceLocker archiveLocker( archiveInstance_ );
 
-	// mark as closed anyway
+	// mark as closed anyway, inflating on thread pool is not waited for
 	openMode_ = QIODevice::NotOpen;
 	pos_ = -1;
+	cachedData_ = QByteArray();
+	cachedDataSource_ = QByteArray();
+	inflateJob_ = QExplicitlySharedDataPointer<ArchiveInflateJob>();
 
 	if ( !archiveLocker.archive() )
+	{
+		isOpenedForWriting_ = false;
 		return false;
+	}
 
 	QReadLocker contentsLocker( archiveLocker.archive()->contentsMutex() );
 
-	if ( !entry_ )
+	// written file may replace nothing, so it has no entry
+	if ( !entry_ && !isOpenedForWriting_ )
 		return false;
 
 	ArchiveFileCloseRequest closeRequest( this );
 	archiveLocker.archive()->processFileRequest( &closeRequest );
 
+	isOpenedForWriting_ = false;
+
 	if ( !closeRequest.isDone() )
 		return false;
 
@@ -463,6 +695,19 @@ bool ArchiveFile::seek( qint64 pos )
 	if ( pos == pos_ )
 		return true;
 
+	if ( _isOpenedDirectly() )
+	{
+		if ( pos > sealedEntry_->info.size )
+			return false;
+
+		pos_ = pos;
+		return true;
+	}
+
+	// written data is compressed right away
+	if ( isOpenedForWriting_ )
+		return false;
+
 	ArchiveInstanceLocker archiveLocker( archiveInstance_ );
 
 	if ( !archiveLocker.archive() )
@@ -476,6 +721,24 @@ bool ArchiveFile::seek( qint64 pos )
 	if ( pos > entry_->info.size )
 		return false;
 
+	if ( inflateJob_ )
+	{
+		// whole contents will be in memory, first read waits for them
+		pos_ = pos;
+		return true;
+	}
+
+	if ( !cachedData_.isNull() )
+	{
+		// whole contents are in memory, so even compressed file can be seeked anywhere,
+		// also cached data may be older than entry when archive was updated meanwhile
+		if ( pos > cachedData_.size() )
+			return false;
+
+		pos_ = pos;
+		return true;
+	}
+
 	if ( entry_->info.isSequential )
 	{
 		// Two policies at this stage for sequential devices.
@@ -520,11 +783,34 @@ qint64 ArchiveFile::read( char * data, qint64 maxlen )
 	if ( maxlen < 0 )
 		return -1;
 
+	if ( _isOpenedDirectly() )
+	{
+		const qint64 bytesToRead = qMin<qint64>( maxlen, sealedEntry_->info.size - pos_ );
+		const qint64 bytes = sealedContents_->read( sealedDataOffset_ + pos_, data, bytesToRead );
+		if ( bytes == -1 )
+			return -1;
+
+		pos_ += bytes;
+		return bytes;
+	}
+
+	// wait for contents being inflated on thread pool before locking archive, so updates are not delayed
+	qint64 bytesInflated = 0;
+	if ( inflateJob_ )
+	{
+		if ( !_takeInflatedData() )
+			return -1;
+		bytesInflated = cachedData_.size();
+	}
+
 	ArchiveInstanceLocker archiveLocker( archiveInstance_ );
 
 	if ( !archiveLocker.archive() )
 		return -1;
 
+	if ( bytesInflated != 0 )
+		archiveLocker.archive()->countBackgroundInflate( bytesInflated );
+
 	QReadLocker contentsLocker( archiveLocker.archive()->contentsMutex() );
 
 	if ( !entry_ )
@@ -536,6 +822,15 @@ qint64 ArchiveFile::read( char * data, qint64 maxlen )
 		return 0;
 	}
 
+	if ( !cachedData_.isNull() )
+	{
+		// contents were prefetched, copy them right here without bothering worker
+		const qint64 bytes = qMin<qint64>( maxlen, cachedData_.size() - pos_ );
+		memcpy( data, cachedData_.constData() + pos_, bytes );
+		pos_ += bytes;
+		return bytes;
+	}
+
 	ArchiveFileReadRequest readRequest( this, data, maxlen );
 	archiveLocker.archive()->processFileRequest( &readRequest );
 
@@ -548,20 +843,92 @@ qint64 ArchiveFile::read( char * data, qint64 maxlen )
 }
 
 
+/**
+ * Waits until contents are inflated on thread pool and moves them into cachedData_,
+ * so they are read in memory from now on.
+ * Returns \c false if inflating failed. Failed job stays with the file, so all further reads fail too,
+ * rather than fall back to worker, which inflating position knows nothing about seeks done meanwhile.
+ */
+bool ArchiveFile::_takeInflatedData()
+{
+	if ( !inflateJob_->wait() )
+	{
+		qWarning( "Grim::ArchiveFile::read() : Failed to inflate file." );
+		return false;
+	}
+
+	cachedDataSource_ = QByteArray();
+	cachedData_ = inflateJob_->data;
+	inflateJob_ = QExplicitlySharedDataPointer<ArchiveInflateJob>();
+
+	return true;
+}
+
+
 qint64 ArchiveFile::write( const char * data, qint64 len )
 {
-	return -1;
+	if ( !isOpenedForWriting_ )
+	{
+		qWarning( "Grim::ArchiveFile::write() : File is not opened for writing." );
+		return -1;
+	}
+
+	if ( len < 0 )
+		return -1;
+
+	if ( len == 0 )
+		return 0;
+
+	ArchiveInstanceLocker archiveLocker( archiveInstance_ );
+
+	if ( !archiveLocker.archive() )
+		return -1;
+
+	QReadLocker contentsLocker( archiveLocker.archive()->contentsMutex() );
+
+	ArchiveFileWriteRequest writeRequest( this, data, len );
+	archiveLocker.archive()->processFileRequest( &writeRequest );
+
+	if ( !writeRequest.isDone() )
+		return -1;
+
+	pos_ += writeRequest.result();
+
+	return writeRequest.result();
 }
 
 
 bool ArchiveFile::flush()
 {
-	return false;
+	if ( !isOpenedForWriting_ )
+		return false;
+
+	ArchiveInstanceLocker archiveLocker( archiveInstance_ );
+
+	if ( !archiveLocker.archive() )
+		return false;
+
+	QReadLocker contentsLocker( archiveLocker.archive()->contentsMutex() );
+
+	ArchiveFileFlushRequest flushRequest( this );
+	archiveLocker.archive()->processFileRequest( &flushRequest );
+
+	return flushRequest.isDone();
 }
 
 
 qint64 ArchiveFile::size() const
 {
+	// new contents are not committed yet, report how much was written
+	if ( isOpenedForWriting_ )
+		return pos_;
+
+	if ( sealedContents_ )
+	{
+		const ArchiveEntry * entry = _sealedEntry();
+		return entry ? entry->info.size : -1;
+	}
+
 	ArchiveInstanceLocker archiveLocker( archiveInstance_ );
 
 	if ( !archiveLocker.archive() )
@@ -569,12 +936,12 @@ qint64 ArchiveFile::size() const
 
 	QReadLocker contentsLocker( archiveLocker.archive()->contentsMutex() );
 
-	archiveLocker.archive()->linkFile( const_cast<ArchiveFile*>( this ) );
+	const ArchiveEntry * entry = archiveLocker.archive()->findFileEntry( const_cast<ArchiveFile*>( this ) );
 
-	if ( !entry_ )
+	if ( !entry )
 		return -1;
 
-	return entry_->info.size;
+	return entry->info.size;
 }
 
 
@@ -611,19 +978,24 @@ uint ArchiveFile::ownerId( FileOwner owner ) const
 
 bool ArchiveFile::supportsExtension( Extension extension ) const
 {
-	return extension == AtEndExtension;
+	return extension == AtEndExtension || extension == MapExtension || extension == UnMapExtension ||
+		extension == (Extension)PriorityExtension;
 }
 
 
 bool ArchiveFile::extension( Extension extension, const ExtensionOption * option, ExtensionReturn * output )
 {
-	switch ( extension )
+	// cast to int, because custom extensions are out of Extension enum range
+	switch ( (int)extension )
 	{
 	case AtEndExtension:
 	{
 		if ( pos_ == -1 )
 			return false;
 
+		if ( _isOpenedDirectly() )
+			return pos_ == sealedEntry_->info.size;
+
 		ArchiveInstanceLocker archiveLocker( archiveInstance_ );
 
 		if ( !archiveLocker.archive() )
@@ -637,6 +1009,57 @@ bool ArchiveFile::extension( Extension extension, const ExtensionOption * option
 		return pos_ == entry_->info.size;
 	}
 
+	case MapExtension:
+	{
+		if ( !option || !output )
+			return false;
+
+		// only stored entries of memory archive point right inside archive data,
+		// other cached contents are private copies that die on closing
+		if ( pos_ == -1 || cachedData_.isNull() || cachedDataSource_.isNull() || isOpenedFromArena_ )
+			return false;
+
+		const MapExtensionOption * mapOption = static_cast<const MapExtensionOption*>( option );
+		if ( mapOption->offset < 0 || mapOption->size < 0 || mapOption->offset + mapOption->size > cachedData_.size() )
+			return false;
+
+		// memory is shared with archive data, so it must not be written to
+		uchar * address = reinterpret_cast<uchar*>( const_cast<char*>( cachedData_.constData() ) ) + mapOption->offset;
+
+		mappedDataSource_ = cachedDataSource_;
+		mappedAddresses_ << address;
+
+		static_cast<MapExtensionReturn*>( output )->address = address;
+		return true;
+	}
+
+	case UnMapExtension:
+	{
+		if ( !option )
+			return false;
+
+		const UnMapExtensionOption * unMapOption = static_cast<const UnMapExtensionOption*>( option );
+		if ( !mappedAddresses_.removeOne( unMapOption->address ) )
+			return false;
+
+		if ( mappedAddresses_.isEmpty() )
+			mappedDataSource_ = QByteArray();
+
+		return true;
+	}
+
+	case PriorityExtension:
+	{
+		if ( !option )
+			return false;
+
+		const ArchiveFilePriorityOption * priorityOption = static_cast<const ArchiveFilePriorityOption*>( option );
+		priority_ = priorityOption->priority;
+		deadline_ = priorityOption->deadline;
+
+		return true;
+	}
+
 	default:
 		return false;
 	}
@@ -687,12 +1110,11 @@ inline void ArchiveFileIterator::_update()
 	if ( path() == file_->fileName_ )
 	{
 		// path() is the same as for the parent file
-		// link it, this can be quicker than locating entry from scratch,
+		// look it up by internal name, this can be quicker than locating entry from scratch,
 		// because parent file can be already linked as well
-		archiveLocker.archive()->linkFile( file_ );
-		if ( !file_->entry_ )
+		entry = archiveLocker.archive()->findFileEntry( file_ );
+		if ( !entry )
 			return;
-		entry = file_->entry_;
 	}
 	else
 	{
@@ -707,6 +1129,8 @@ inline void ArchiveFileIterator::_update()
 		if ( !entry->info.isDir )
 			return;
 
+		archiveLocker.archive()->populateEntry( entry );
+
 		Filter filter( filters(), nameFilters() );
 
 		for ( QListIterator<ArchiveEntry*> it( entry->entries ); it.hasNext(); )
@@ -271,8 +271,9 @@ QAbstractFileEngine * ArchiveManagerPrivate::createFileEngine( const QString & f
 	}
 
 	ArchiveFile * file = new ArchiveFile( archiveInstance, fileName, cleanSoftFilePath, internalFileName, isRelativePath );
+	file->sealedContents_ = archiveInstance.d->archive->sealedContents();
 
-	archiveInstance.d->archive->registerFile( file );
+	// file is registered by archive on the first open(), info queries stay cheap
 
 	// unlock archivePrivate state mutex
 	archiveInstance.d->archive->initializationMutex()->unlock();
@@ -281,6 +282,101 @@ QAbstractFileEngine * ArchiveManagerPrivate::createFileEngine( const QString & f
 }
 
 
+/**
+ * Checks whether \a fileName points to the stored (not compressed) entry inside one of mounted archives.
+ * If so returns \c true and fills \a hostFileName with the name of the real file that holds entry data,
+ * \a offset with absolute offset of entry data inside that file and \a size with entry size.
+ * Used to mount nested archives directly from the outer archive file.
+ */
+bool ArchiveManagerPrivate::resolveStoredEntry( const QString & fileName, QString & hostFileName, qint64 & offset, qint64 & size )
+{
+	ArchiveFile * file = static_cast<ArchiveFile*>( createFileEngine( fileName ) );
+	if ( !file )
+		return false;
+
+	bool isResolved = false;
+
+	// opening is required to locate entry data offset
+	if ( file->open( QIODevice::ReadOnly ) )
+	{
+		{
+			ArchiveInstanceLocker archiveLocker( file->archiveInstance_ );
+			if ( archiveLocker.archive() )
+			{
+				QReadLocker contentsLocker( archiveLocker.archive()->contentsMutex() );
+				isResolved = archiveLocker.archive()->resolveStoredEntry( file, hostFileName, offset, size );
+			}
+		}
+
+		file->close();
+	}
+
+	delete file;
+
+	return isResolved;
+}
+
+
+/**
+ * Starts opening of all \a archives at once and waits until all of them will be initialized.
+ * Archives that are nested into other archives of the batch are started only after their outer archive is mounted.
+ */
+QList<ArchiveManager::MountResult> ArchiveManagerPrivate::openArchives( const QList<Archive*> & archives, Archive::OpenMode openMode )
+{
+	const qint64 startTime = archiveTimestamp();
+
+	QList<ArchiveManager::MountResult> results;
+	QList<bool> isPending;
+
+	// start workers, each of them parses its archive in parallel with others
+	for ( int i = 0; i < archives.count(); ++i )
+	{
+		ArchiveManager::MountResult result;
+		result.archive = archives.at( i );
+
+		ArchivePrivate * archivePrivate = result.archive->d_;
+
+		for ( int j = 0; j < i; ++j )
+		{
+			if ( isPending.at( j ) && archivePrivate->isNestedInto( archives.at( j )->d_ ) )
+			{
+				_endOpenArchive( results[ j ], startTime );
+				isPending[ j ] = false;
+			}
+		}
+
+		const bool isStarted = archivePrivate->beginOpen( openMode | Archive::Block );
+
+		results << result;
+		isPending << isStarted;
+	}
+
+	// now wait for all of them
+	for ( int i = 0; i < results.count(); ++i )
+	{
+		if ( isPending.at( i ) )
+			_endOpenArchive( results[ i ], startTime );
+	}
+
+	return results;
+}
+
+
+/**
+ * Finishes opening of archive started by openArchives() and fills timings of \a result.
+ */
+void ArchiveManagerPrivate::_endOpenArchive( ArchiveManager::MountResult & result, qint64 startTime )
+{
+	ArchivePrivate * archivePrivate = result.archive->d_;
+
+	result.isOpened = archivePrivate->endOpen();
+
+	// timings are kept even for broken archives, they are reset only on next opening
+	result.parseTime = archivePrivate->initialUpdateTime();
+	result.mountTime = archivePrivate->readyTime() - startTime;
+}
+
+
 ArchiveInstanceData * ArchiveManagerPrivate::sharedNullArchiveInstanceData()
 {
 	QWriteLocker locker( &sharedNullArchiveInstanceDataMutex_ );
@@ -309,6 +405,26 @@ ArchiveInstanceData * ArchiveManagerPrivate::sharedNullArchiveInstanceData()
  */
 
 
+/**
+ * \class ArchiveManager::MountResult
+ *
+ * \brief The ArchiveManager::MountResult class holds outcome of opening single archive with ArchiveManager::openArchives().
+ */
+
+
+/**
+ * Constructs result for archive that was not opened.
+ */
+
+ArchiveManager::MountResult::MountResult() :
+	archive( 0 ),
+	isOpened( false ),
+	parseTime( 0 ),
+	mountTime( 0 )
+{
+}
+
+
 /**
  * Returns archive manager singleton.
  */
@@ -370,6 +486,34 @@ void ArchiveManager::setEnabled( bool set )
 }
 
 
+/**
+ * Opens all \a archives with the given \a openMode in parallel and blocks until all of them will be initialized.
+ *
+ * Calling Archive::open() with Archive::Block flag for each archive one after another costs sum of parsing times
+ * of all archives. Instead this method starts all archives at once, so they are parsed simultaneously in their
+ * worker threads, and waits only once. Archive::Block flag is implied.
+ *
+ * Archives nested into other archives of the same batch are started right after their outer archive is mounted,
+ * so outer archives should go first in the list.
+ *
+ * Returns list of results in the same order as \a archives, holding whether each archive was opened
+ * and how long it took to mount it.
+ *
+ * \code
+ * QList<ArchiveManager::MountResult> results = ArchiveManager::sharedManager()->openArchives( archives, Archive::ReadOnly );
+ * foreach ( const ArchiveManager::MountResult & result, results )
+ *     qDebug() << result.archive->fileName() << result.isOpened << result.mountTime / 1000 << "ms";
+ * \endcode
+ *
+ * \sa Archive::open()
+ */
+
+QList<ArchiveManager::MountResult> ArchiveManager::openArchives( const QList<Archive*> & archives, Archive::OpenMode openMode )
+{
+	return d_->openArchives( archives, openMode );
+}
+
+
 
 
 } // namespace Grim
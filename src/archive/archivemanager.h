@@ -25,6 +25,9 @@
 #pragma once
 
 #include "archiveglobal.h"
+#include "archive.h"
+
+#include <QList>
 
 
 
@@ -42,11 +45,24 @@ class ArchiveManagerPrivate;
 class GRIM_ARCHIVE_EXPORT ArchiveManager
 {
 public:
+	class GRIM_ARCHIVE_EXPORT MountResult
+	{
+	public:
+		MountResult();
+
+		Archive * archive;
+		bool isOpened;
+		qint64 parseTime; // time spent on parsing archive contents, in microseconds
+		qint64 mountTime; // time from the start of batch till archive became ready, in microseconds
+	};
+
 	static ArchiveManager * sharedManager();
 
 	bool isEnabled() const;
 	void setEnabled( bool set );
 
+	QList<MountResult> openArchives( const QList<Archive*> & archives, Archive::OpenMode openMode );
+
 private:
 	ArchiveManager();
 	~ArchiveManager();
@@ -25,6 +25,7 @@
 #pragma once
 
 #include "archive_p.h"
+#include "archivemanager.h"
 
 
 
@@ -66,10 +67,15 @@ public:
 
 	QAbstractFileEngine * createFileEngine( const QString & fileName );
 
+	bool resolveStoredEntry( const QString & fileName, QString & hostFileName, qint64 & offset, qint64 & size );
+
+	QList<ArchiveManager::MountResult> openArchives( const QList<Archive*> & archives, Archive::OpenMode openMode );
+
 	ArchiveInstanceData * sharedNullArchiveInstanceData();
 
 private:
 	ArchiveInstance _findArchiveForFilePath( const QString & cleanFilePath );
+	void _endOpenArchive( ArchiveManager::MountResult & result, qint64 startTime );
 
 private:
 	ArchiveFileEngineHandler * fileEngineHandler_;
@@ -0,0 +1,341 @@
+/******************************************************************************
+ *
+ * Grim - Game engine library
+ * Copyright (C) 2009 Daniel Levin (dendy.ua@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3.0 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * The GNU General Public License is contained in the file COPYING in the
+ * packaging of this file. Please review information in this file to ensure
+ * the GNU General Public License version 3.0 requirements will be met.
+ *
+ * Copy of GNU General Public License available at:
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ *****************************************************************************/
+
+
+#include "archivetrace.h"
+#include "archivetrace_p.h"
+#include "archive_p.h"
+
+#include <QSet>
+
+
+
+
+namespace Grim {
+
+
+
+
+// trace file layout, all numbers are little endian:
+// header: magic, version, archive file name
+// then records, each starts with record type:
+// file path record: id, file path; written once before the first event that refers to this path
+// event record: time, duration, thread, file path id, pos, length
+static const quint32 TraceMagic   = 0x4b525447; // "GTRK"
+static const quint16 TraceVersion = 1;
+
+static const quint8 Record_FilePath = 0;
+
+
+
+
+/** \internal
+ *
+ * \class ArchiveTraceWriter
+ *
+ * Writes file operations processed by archive worker into trace file.
+ */
+
+ArchiveTraceWriter::ArchiveTraceWriter() :
+	startTime_( 0 )
+{
+}
+
+
+ArchiveTraceWriter::~ArchiveTraceWriter()
+{
+	close();
+}
+
+
+bool ArchiveTraceWriter::open( const QString & fileName, const QString & archiveFileName )
+{
+	close();
+
+	file_.setFileName( fileName );
+	if ( !file_.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+		return false;
+
+	stream_.setDevice( &file_ );
+	stream_.setByteOrder( QDataStream::LittleEndian );
+
+	stream_ << TraceMagic << TraceVersion << archiveFileName;
+
+	startTime_ = archiveTimestamp();
+
+	return stream_.status() == QDataStream::Ok;
+}
+
+
+void ArchiveTraceWriter::close()
+{
+	if ( !file_.isOpen() )
+		return;
+
+	stream_.setDevice( 0 );
+	file_.close();
+
+	idForFilePath_.clear();
+	idForThread_.clear();
+}
+
+
+/**
+ * Appends event record of the given \a type.
+ * \a time is the archiveTimestamp() of the moment operation was issued.
+ */
+void ArchiveTraceWriter::write( int type, qint64 time, qint64 duration, Qt::HANDLE thread, const QString & filePath, qint64 pos, qint64 length )
+{
+	if ( !file_.isOpen() )
+		return;
+
+	QHash<QString,quint32>::const_iterator filePathIt = idForFilePath_.constFind( filePath );
+	if ( filePathIt == idForFilePath_.constEnd() )
+	{
+		const quint32 filePathId = idForFilePath_.count();
+		filePathIt = idForFilePath_.insert( filePath, filePathId );
+		stream_ << Record_FilePath << filePathId << filePath;
+	}
+
+	QHash<Qt::HANDLE,quint16>::const_iterator threadIt = idForThread_.constFind( thread );
+	if ( threadIt == idForThread_.constEnd() )
+		threadIt = idForThread_.insert( thread, idForThread_.count() );
+
+	stream_ << quint8( type )
+		<< quint64( qMax<qint64>( 0, time - startTime_ ) )
+		<< quint32( qBound<qint64>( 0, duration, 0xffffffff ) )
+		<< threadIt.value()
+		<< filePathIt.value()
+		<< quint64( pos )
+		<< quint32( qBound<qint64>( 0, length, 0xffffffff ) );
+}
+
+
+
+
+/**
+ * \class ArchiveTrace
+ *
+ * \ingroup archive_module
+ *
+ * \brief The ArchiveTrace class reads trace of file operations recorded with Archive::startTrace().
+ *
+ * Trace tells which entries of archive were opened and read, in what order, from which threads
+ * and how long each operation took. This is the input for ordering entries inside archive
+ * and for prefetching them.
+ *
+ * \code
+ * ArchiveTrace trace;
+ * if ( trace.load( "level1.trace" ) )
+ *     foreach ( const QString & filePath, trace.filePaths() )
+ *         qDebug() << filePath;
+ * \endcode
+ *
+ * \sa Archive::startTrace()
+ */
+
+
+/**
+ * \enum ArchiveTrace::EventType
+ *
+ * This enum specifies recorded file operation.
+ */
+/**\var ArchiveTrace::EventType ArchiveTrace::Event_Open
+ * File was opened. Event::length holds entry size.
+ */
+/**\var ArchiveTrace::EventType ArchiveTrace::Event_Read
+ * Event::length bytes were read from file starting from Event::pos.
+ */
+/**\var ArchiveTrace::EventType ArchiveTrace::Event_Close
+ * File was closed.
+ */
+
+
+/**
+ * \class ArchiveTrace::Event
+ *
+ * \brief The ArchiveTrace::Event class holds single file operation from the trace.
+ */
+
+
+/**
+ * Constructs empty event.
+ */
+
+ArchiveTrace::Event::Event() :
+	type( Event_Open ),
+	time( 0 ),
+	duration( 0 ),
+	thread( 0 ),
+	pos( 0 ),
+	length( 0 )
+{
+}
+
+
+/**
+ * Constructs empty trace.
+ */
+
+ArchiveTrace::ArchiveTrace()
+{
+}
+
+
+/**
+ * Returns \c true if trace has no events.
+ */
+
+bool ArchiveTrace::isNull() const
+{
+	return events_.isEmpty();
+}
+
+
+/**
+ * Loads trace from the file with the given \a fileName.
+ * Trace of application that was terminated while recording is loaded up to the last complete event.
+ *
+ * Returns \c false if file cannot be read or is not a trace file.
+ */
+
+bool ArchiveTrace::load( const QString & fileName )
+{
+	archiveFileName_ = QString();
+	events_.clear();
+
+	QFile file( fileName );
+	if ( !file.open( QIODevice::ReadOnly ) )
+		return false;
+
+	QDataStream ds( &file );
+	ds.setByteOrder( QDataStream::LittleEndian );
+
+	quint32 magic;
+	quint16 version;
+	ds >> magic >> version;
+
+	if ( ds.status() != QDataStream::Ok || magic != TraceMagic || version != TraceVersion )
+		return false;
+
+	ds >> archiveFileName_;
+
+	QHash<quint32,QString> filePathForId;
+
+	while ( !ds.atEnd() )
+	{
+		quint8 recordType;
+		ds >> recordType;
+
+		if ( recordType == Record_FilePath )
+		{
+			quint32 filePathId;
+			QString filePath;
+			ds >> filePathId >> filePath;
+
+			if ( ds.status() != QDataStream::Ok )
+				break;
+
+			filePathForId[ filePathId ] = filePath;
+		}
+		else if ( recordType >= Event_Open && recordType <= Event_Close )
+		{
+			quint64 time;
+			quint32 duration;
+			quint16 thread;
+			quint32 filePathId;
+			quint64 pos;
+			quint32 length;
+			ds >> time >> duration >> thread >> filePathId >> pos >> length;
+
+			if ( ds.status() != QDataStream::Ok )
+				break;
+
+			Event event;
+			event.type = (EventType)recordType;
+			event.time = time;
+			event.duration = duration;
+			event.thread = thread;
+			event.filePath = filePathForId.value( filePathId );
+			event.pos = pos;
+			event.length = length;
+			events_ << event;
+		}
+		else
+		{
+			qWarning( "Grim::ArchiveTrace::load() : Unknown record type, rest of trace skipped." );
+			break;
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ * Returns file name of archive this trace was recorded for.
+ */
+
+QString ArchiveTrace::archiveFileName() const
+{
+	return archiveFileName_;
+}
+
+
+/**
+ * Returns all recorded events in order of their completion.
+ */
+
+QList<ArchiveTrace::Event> ArchiveTrace::events() const
+{
+	return events_;
+}
+
+
+/**
+ * Returns paths of opened entries in order of their first opening.
+ */
+
+QStringList ArchiveTrace::filePaths() const
+{
+	QStringList filePaths;
+	QSet<QString> seenFilePaths;
+
+	for ( QListIterator<Event> it( events_ ); it.hasNext(); )
+	{
+		const Event & event = it.next();
+		if ( event.type != Event_Open || seenFilePaths.contains( event.filePath ) )
+			continue;
+
+		seenFilePaths << event.filePath;
+		filePaths << event.filePath;
+	}
+
+	return filePaths;
+}
+
+
+
+
+} // namespace Grim
@@ -0,0 +1,84 @@
+/******************************************************************************
+ *
+ * Grim - Game engine library
+ * Copyright (C) 2009 Daniel Levin (dendy.ua@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3.0 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * The GNU General Public License is contained in the file COPYING in the
+ * packaging of this file. Please review information in this file to ensure
+ * the GNU General Public License version 3.0 requirements will be met.
+ *
+ * Copy of GNU General Public License available at:
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ *****************************************************************************/
+
+
+#pragma once
+
+#include "archiveglobal.h"
+
+#include <QList>
+#include <QStringList>
+
+
+
+
+namespace Grim {
+
+
+
+
+class GRIM_ARCHIVE_EXPORT ArchiveTrace
+{
+public:
+	enum EventType
+	{
+		Event_Open = 1,
+		Event_Read,
+		Event_Close
+	};
+
+	class GRIM_ARCHIVE_EXPORT Event
+	{
+	public:
+		Event();
+
+		EventType type;
+		qint64 time;      // time since trace start when operation was issued, in microseconds
+		qint64 duration;  // time from issuing till completion of operation, in microseconds
+		int thread;       // sequential number of thread that issued operation
+		QString filePath; // path of entry inside archive
+		qint64 pos;       // position of read operation inside entry
+		qint64 length;    // number of read bytes or entry size for open operation
+	};
+
+	ArchiveTrace();
+
+	bool isNull() const;
+
+	bool load( const QString & fileName );
+
+	QString archiveFileName() const;
+
+	QList<Event> events() const;
+	QStringList filePaths() const;
+
+private:
+	QString archiveFileName_;
+	QList<Event> events_;
+};
+
+
+
+
+} // namespace Grim
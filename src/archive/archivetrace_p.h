@@ -0,0 +1,64 @@
+/******************************************************************************
+ *
+ * Grim - Game engine library
+ * Copyright (C) 2009 Daniel Levin (dendy.ua@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3.0 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * The GNU General Public License is contained in the file COPYING in the
+ * packaging of this file. Please review information in this file to ensure
+ * the GNU General Public License version 3.0 requirements will be met.
+ *
+ * Copy of GNU General Public License available at:
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ *****************************************************************************/
+
+
+#pragma once
+
+#include "archivetrace.h"
+
+#include <QFile>
+#include <QDataStream>
+#include <QHash>
+
+
+
+
+namespace Grim {
+
+
+
+
+class ArchiveTraceWriter
+{
+public:
+	ArchiveTraceWriter();
+	~ArchiveTraceWriter();
+
+	bool open( const QString & fileName, const QString & archiveFileName );
+	void close();
+
+	void write( int type, qint64 time, qint64 duration, Qt::HANDLE thread, const QString & filePath, qint64 pos, qint64 length );
+
+private:
+	QFile file_;
+	QDataStream stream_;
+	qint64 startTime_;
+	QHash<QString,quint32> idForFilePath_;
+	QHash<Qt::HANDLE,quint16> idForThread_;
+};
+
+
+
+
+} // namespace Grim
@@ -0,0 +1,196 @@
+#include "packwriter.h"
+
+#include "zipwriter.h"
+
+#include <QDataStream>
+
+
+
+
+// Grim pack signature, "GPAK" when read as little endian bytes
+static const quint32 PackSignature = 0x4b415047;
+static const quint16 PackVersion = 1;
+
+static const int PackHeaderSize = 40;
+
+static const qint64 MaxEntrySize = 0xffffffffLL; // sizes of entries are limited to 32 bits in Grim archive reader
+
+
+
+
+/**
+ * \class PackWriter
+ *
+ * Writes Grim pack archive into seekable device.
+ * Entries are split into blocks of fixed size, which are compressed independently with raw deflate,
+ * so reader can seek inside compressed entry and inflate several blocks in parallel.
+ * Blocks are written once per distinct content, entries with the same blocks reference them.
+ * Index with block table, entry table, block references and file names is written after all data
+ * and header at the beginning of archive is updated to point to it.
+ * Layout matches the one documented for PackHeaderStruct in Grim archive reader.
+ */
+
+PackWriter::PackWriter( QIODevice * device, int blockSize ) :
+	device_( device ),
+	blockSize_( blockSize ),
+	sharedBlockCount_( 0 )
+{
+}
+
+
+int PackWriter::blockSize() const
+{
+	return blockSize_;
+}
+
+
+/**
+ * Returns number of blocks that were referenced again instead of being written.
+ */
+int PackWriter::sharedBlockCount() const
+{
+	return sharedBlockCount_;
+}
+
+
+/**
+ * Reserves space for header, should be called before adding files.
+ */
+bool PackWriter::begin()
+{
+	return _write( QByteArray( PackHeaderSize, '\0' ) );
+}
+
+
+/**
+ * Adds file with the given \a blocks, where all of them except the last one should be
+ * exactly blockSize() bytes long when uncompressed.
+ */
+bool PackWriter::addFile( const QString & filePath, const QDateTime & modTime,
+	const QList<Block> & blocks, quint32 crc32, qint64 size )
+{
+	if ( size > MaxEntrySize )
+		return _setError( QString( "File exceeds 4 GB: %1" ).arg( filePath ) );
+
+	IndexEntry entry;
+	entry.fileName = filePath.toUtf8();
+	entry.size = size;
+	entry.blockRef = blockRefs_.count();
+	entry.crc32 = crc32;
+	to_dos_date_time( modTime, entry.modDate, entry.modTime );
+
+	for ( QListIterator<Block> it( blocks ); it.hasNext(); )
+	{
+		const Block & block = it.next();
+
+		// digest is strong enough to treat equal digests as equal contents
+		const quint32 existingIndex = blockIndexForDigest_.value( block.digest, 0xffffffff );
+		if ( existingIndex != 0xffffffff && blocks_.at( existingIndex ).size == (quint32)block.size )
+		{
+			blockRefs_ << existingIndex;
+			sharedBlockCount_++;
+			continue;
+		}
+
+		IndexBlock indexBlock;
+		indexBlock.offset = device_->pos();
+		indexBlock.compressedSize = block.data.size();
+		indexBlock.size = block.size;
+
+		if ( !_write( block.data ) )
+			return false;
+
+		blockIndexForDigest_[ block.digest ] = blocks_.count();
+		blockRefs_ << blocks_.count();
+		blocks_ << indexBlock;
+	}
+
+	entries_ << entry;
+
+	return true;
+}
+
+
+/**
+ * Writes index and updates header to point to it.
+ */
+bool PackWriter::finish()
+{
+	const qint64 indexOffset = device_->pos();
+
+	QByteArray names;
+	QByteArray index;
+	QDataStream ds( &index, QIODevice::WriteOnly );
+	ds.setByteOrder( QDataStream::LittleEndian );
+
+	for ( QListIterator<IndexBlock> it( blocks_ ); it.hasNext(); )
+	{
+		const IndexBlock & block = it.next();
+		ds << block.offset;
+		ds << block.compressedSize;
+		ds << block.size;
+	}
+
+	for ( QListIterator<IndexEntry> it( entries_ ); it.hasNext(); )
+	{
+		const IndexEntry & entry = it.next();
+		ds << quint32( names.size() );
+		ds << quint32( entry.fileName.size() );
+		ds << entry.size;
+		ds << entry.blockRef;
+		ds << entry.crc32;
+		ds << entry.modTime;
+		ds << entry.modDate;
+		ds << quint32( 0 );     // reserved
+		names.append( entry.fileName );
+	}
+
+	for ( QListIterator<quint32> it( blockRefs_ ); it.hasNext(); )
+		ds << it.next();
+
+	ds.writeRawData( names.constData(), names.size() );
+
+	if ( !_write( index ) )
+		return false;
+
+	QByteArray header;
+	QDataStream hs( &header, QIODevice::WriteOnly );
+	hs.setByteOrder( QDataStream::LittleEndian );
+
+	hs << PackSignature;
+	hs << PackVersion;
+	hs << quint16( 0 );                  // flags
+	hs << quint32( blockSize_ );
+	hs << quint32( blocks_.count() );
+	hs << quint32( entries_.count() );
+	hs << quint32( blockRefs_.count() );
+	hs << quint32( names.size() );
+	hs << quint32( 0 );                  // reserved
+	hs << quint64( indexOffset );
+
+	if ( !device_->seek( 0 ) )
+		return _setError( device_->errorString() );
+
+	return _write( header );
+}
+
+
+QString PackWriter::errorString() const
+{
+	return errorString_;
+}
+
+
+bool PackWriter::_write( const QByteArray & data )
+{
+	if ( device_->write( data ) != data.size() )
+		return _setError( device_->errorString() );
+	return true;
+}
+
+
+bool PackWriter::_setError( const QString & errorString )
+{
+	errorString_ = errorString;
+	return false;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <QDateTime>
+#include <QHash>
+#include <QIODevice>
+#include <QList>
+#include <QString>
+
+
+
+
+class PackWriter
+{
+public:
+	struct Block
+	{
+		QByteArray data;   // raw deflate stream or uncompressed data if its size equals to size
+		int size;          // uncompressed size
+		QByteArray digest; // digest of uncompressed data, identical blocks are written once
+	};
+
+	PackWriter( QIODevice * device, int blockSize );
+
+	int blockSize() const;
+	int sharedBlockCount() const;
+
+	bool begin();
+	bool addFile( const QString & filePath, const QDateTime & modTime,
+		const QList<Block> & blocks, quint32 crc32, qint64 size );
+	bool finish();
+
+	QString errorString() const;
+
+private:
+	struct IndexEntry
+	{
+		QByteArray fileName;
+		quint64 size;
+		quint32 blockRef;
+		quint32 crc32;
+		quint16 modTime;
+		quint16 modDate;
+	};
+
+	struct IndexBlock
+	{
+		quint64 offset;
+		quint32 compressedSize;
+		quint32 size;
+	};
+
+	bool _write( const QByteArray & data );
+	bool _setError( const QString & errorString );
+
+private:
+	QIODevice * device_;
+	int blockSize_;
+	int sharedBlockCount_;
+	QList<IndexEntry> entries_;
+	QList<IndexBlock> blocks_;
+	QList<quint32> blockRefs_;
+	QHash<QByteArray,quint32> blockIndexForDigest_;
+	QString errorString_;
+};
@@ -0,0 +1,249 @@
+#include "zipwriter.h"
+
+#include <QDataStream>
+
+#include <zlib.h>
+
+
+
+
+// ZIP signatures, see PKWARE .ZIP File Format Specification
+static const quint32 LocalFileHeaderSignature       = 0x04034b50;
+static const quint32 CentralFileHeaderSignature     = 0x02014b50;
+static const quint32 EndOfCentralDirectorySignature = 0x06054b50;
+
+static const quint16 VersionNeeded = 20;     // 2.0, deflate
+static const quint16 Utf8NameFlag  = 0x0800; // general purpose bit 11, file name is UTF-8
+
+static const quint16 AlignmentExtraFieldId = 0xd935; // extra field that holds padding of aligned entry
+static const int AlignmentExtraFieldMinSize = 6;     // id + size + alignment
+
+static const qint64 MaxSize = 0xffffffffLL; // no ZIP64 support in Grim archive reader
+static const int MaxEntries = 0xffff;
+
+const int ZipWriter::MaxAlignment;
+
+
+
+
+void to_dos_date_time( const QDateTime & dateTime, quint16 & date, quint16 & time )
+{
+	const QDate d = dateTime.date();
+	const QTime t = dateTime.time();
+
+	if ( !dateTime.isValid() || d.year() < 1980 )
+	{
+		// earliest possible DOS date: 1980-01-01 00:00:00
+		date = (1 << 5) | 1;
+		time = 0;
+		return;
+	}
+
+	date = ((d.year() - 1980) << 9) | (d.month() << 5) | d.day();
+	time = (t.hour() << 11) | (t.minute() << 5) | (t.second() / 2);
+}
+
+
+QByteArray deflate_raw( const QByteArray & data, int level )
+{
+	z_stream zstream;
+	zstream.zalloc = Z_NULL;
+	zstream.zfree = Z_NULL;
+	zstream.opaque = Z_NULL;
+
+	if ( deflateInit2( &zstream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+		return QByteArray();
+
+	QByteArray deflated;
+	deflated.resize( deflateBound( &zstream, data.size() ) );
+
+	zstream.next_in = reinterpret_cast<Bytef*>( const_cast<char*>( data.constData() ) );
+	zstream.avail_in = data.size();
+	zstream.next_out = reinterpret_cast<Bytef*>( deflated.data() );
+	zstream.avail_out = deflated.size();
+
+	const int result = deflate( &zstream, Z_FINISH );
+	const int deflatedSize = zstream.total_out;
+	deflateEnd( &zstream );
+
+	if ( result != Z_STREAM_END )
+		return QByteArray();
+
+	deflated.resize( deflatedSize );
+	return deflated;
+}
+
+
+
+
+/**
+ * \class ZipWriter
+ *
+ * Writes ZIP archive into device sequentially, entry by entry.
+ * Entry data should be already compressed with raw deflate or stored as is.
+ * Data of stored entries can be aligned inside archive to the given boundary with padding
+ * inside extra field of local header.
+ */
+
+ZipWriter::ZipWriter( QIODevice * device ) :
+	device_( device ),
+	alignment_( 1 )
+{
+}
+
+
+int ZipWriter::alignment() const
+{
+	return alignment_;
+}
+
+
+/**
+ * Sets boundary in bytes to which data of stored entries will be aligned.
+ * 1 means no alignment, boundary is limited to MaxAlignment.
+ */
+void ZipWriter::setAlignment( int alignment )
+{
+	alignment_ = qBound( 1, alignment, MaxAlignment );
+}
+
+
+bool ZipWriter::addFile( const QString & filePath, const QDateTime & modTime, Method method,
+	const QByteArray & data, quint32 crc32, qint64 size )
+{
+	if ( entries_.count() >= MaxEntries )
+		return _setError( QLatin1String( "Too many files for ZIP archive" ) );
+
+	CentralEntry entry;
+	entry.fileName = filePath.toUtf8();
+	entry.method = method;
+	entry.crc32 = crc32;
+	entry.compressedSize = data.size();
+	entry.size = size;
+	entry.localHeaderOffset = device_->pos();
+	to_dos_date_time( modTime, entry.modDate, entry.modTime );
+
+	// pad extra field so entry data starts at alignment boundary
+	QByteArray extraField;
+	if ( method == Method_Store && alignment_ > 1 )
+	{
+		const qint64 dataOffset = device_->pos() + 30 + entry.fileName.size();
+
+		int padding = (alignment_ - dataOffset % alignment_) % alignment_;
+		if ( padding != 0 )
+		{
+			while ( padding < AlignmentExtraFieldMinSize )
+				padding += alignment_;
+
+			if ( padding > 0xffff )
+				return _setError( QString( "Alignment padding does not fit into extra field: %1" ).arg( filePath ) );
+
+			QDataStream ds( &extraField, QIODevice::WriteOnly );
+			ds.setByteOrder( QDataStream::LittleEndian );
+			ds << AlignmentExtraFieldId << quint16( padding - 4 ) << quint16( alignment_ );
+			extraField.append( QByteArray( padding - AlignmentExtraFieldMinSize, '\0' ) );
+		}
+	}
+
+	if ( size > MaxSize || device_->pos() + 30 + entry.fileName.size() + extraField.size() + data.size() > MaxSize )
+		return _setError( QString( "Archive exceeds 4 GB: %1" ).arg( filePath ) );
+
+	QByteArray header;
+	QDataStream ds( &header, QIODevice::WriteOnly );
+	ds.setByteOrder( QDataStream::LittleEndian );
+
+	ds << LocalFileHeaderSignature;
+	ds << VersionNeeded;
+	ds << Utf8NameFlag;
+	ds << entry.method;
+	ds << entry.modTime;
+	ds << entry.modDate;
+	ds << entry.crc32;
+	ds << entry.compressedSize;
+	ds << entry.size;
+	ds << quint16( entry.fileName.size() );
+	ds << quint16( extraField.size() );
+
+	header.append( entry.fileName );
+	header.append( extraField );
+
+	if ( !_write( header ) || !_write( data ) )
+		return false;
+
+	entries_ << entry;
+
+	return true;
+}
+
+
+/**
+ * Writes central directory and end of central directory record.
+ */
+bool ZipWriter::finish()
+{
+	const qint64 centralDirectoryOffset = device_->pos();
+
+	QByteArray centralDirectory;
+	QDataStream ds( &centralDirectory, QIODevice::WriteOnly );
+	ds.setByteOrder( QDataStream::LittleEndian );
+
+	for ( QListIterator<CentralEntry> it( entries_ ); it.hasNext(); )
+	{
+		const CentralEntry & entry = it.next();
+
+		ds << CentralFileHeaderSignature;
+		ds << VersionNeeded;    // version made by
+		ds << VersionNeeded;    // version needed to extract
+		ds << Utf8NameFlag;
+		ds << entry.method;
+		ds << entry.modTime;
+		ds << entry.modDate;
+		ds << entry.crc32;
+		ds << entry.compressedSize;
+		ds << entry.size;
+		ds << quint16( entry.fileName.size() );
+		ds << quint16( 0 );     // extra field length
+		ds << quint16( 0 );     // file comment length
+		ds << quint16( 0 );     // disk number start
+		ds << quint16( 0 );     // internal file attributes
+		ds << quint32( 0 );     // external file attributes
+		ds << entry.localHeaderOffset;
+		ds.writeRawData( entry.fileName.constData(), entry.fileName.size() );
+	}
+
+	const qint64 centralDirectorySize = centralDirectory.size();
+	if ( centralDirectoryOffset + centralDirectorySize > MaxSize )
+		return _setError( QLatin1String( "Archive exceeds 4 GB" ) );
+
+	ds << EndOfCentralDirectorySignature;
+	ds << quint16( 0 );                        // number of this disk
+	ds << quint16( 0 );                        // disk where central directory starts
+	ds << quint16( entries_.count() );         // number of central directory records on this disk
+	ds << quint16( entries_.count() );         // total number of central directory records
+	ds << quint32( centralDirectorySize );      // size of central directory
+	ds << quint32( centralDirectoryOffset );
+	ds << quint16( 0 );                        // comment length
+
+	return _write( centralDirectory );
+}
+
+
+QString ZipWriter::errorString() const
+{
+	return errorString_;
+}
+
+
+bool ZipWriter::_write( const QByteArray & data )
+{
+	if ( device_->write( data ) != data.size() )
+		return _setError( device_->errorString() );
+	return true;
+}
+
+
+bool ZipWriter::_setError( const QString & errorString )
+{
+	errorString_ = errorString;
+	return false;
+}
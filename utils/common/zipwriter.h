@@ -0,0 +1,64 @@
+#pragma once
+
+#include <QDateTime>
+#include <QIODevice>
+#include <QList>
+#include <QString>
+
+
+
+
+// converts to DOS date and time as stored in ZIP headers, used by GrimPack writers
+void to_dos_date_time( const QDateTime & dateTime, quint16 & date, quint16 & time );
+
+// compresses data into raw deflate stream without zlib header, as ZIP requires, returns null array on error
+QByteArray deflate_raw( const QByteArray & data, int level );
+
+
+
+
+class ZipWriter
+{
+public:
+	enum Method
+	{
+		Method_Store   = 0,
+		Method_Deflate = 8
+	};
+
+	// padding together with its header must fit into 16-bit extra field length
+	static const int MaxAlignment = 32768;
+
+	ZipWriter( QIODevice * device );
+
+	int alignment() const;
+	void setAlignment( int alignment );
+
+	bool addFile( const QString & filePath, const QDateTime & modTime, Method method,
+		const QByteArray & data, quint32 crc32, qint64 size );
+	bool finish();
+
+	QString errorString() const;
+
+private:
+	struct CentralEntry
+	{
+		QByteArray fileName;
+		quint16 method;
+		quint16 modTime;
+		quint16 modDate;
+		quint32 crc32;
+		quint32 compressedSize;
+		quint32 size;
+		quint32 localHeaderOffset;
+	};
+
+	bool _write( const QByteArray & data );
+	bool _setError( const QString & errorString );
+
+private:
+	QIODevice * device_;
+	int alignment_;
+	QList<CentralEntry> entries_;
+	QString errorString_;
+};
@@ -0,0 +1,329 @@
+#include "suite.h"
+
+#include <QCoreApplication>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+#include <QThread>
+#include <QTime>
+
+#include <grim/archive/archive.h>
+
+#include <stdio.h>
+
+
+
+
+struct Options
+{
+	Options() :
+		iterations( 10 ),
+		threads( 1 ),
+		handles( 0 ),
+		isSuite( false )
+	{}
+
+	QString archiveFileName;
+	int iterations;
+	int threads;
+	int handles;
+	bool isSuite;
+	SuiteOptions suite;
+};
+
+
+enum Query
+{
+	Query_Exists,
+	Query_Size
+};
+
+
+
+
+int usage()
+{
+	printf(
+		"Usage:\n"
+		"  GrimBench [options] <archive>\n"
+		"  GrimBench --suite [suite options]\n\n"
+		"Measures throughput of QFileInfo queries on paths inside mounted archive.\n"
+		"Every archived file is queried together with the same amount of missing paths.\n\n"
+		"Options:\n"
+		"  --iterations <n> Number of passes over all paths, default is 10.\n"
+		"  --threads <n>    Number of threads that issue queries concurrently.\n"
+		"  --handles <n>    Additionally keep up to n files opened simultaneously\n"
+		"                   and report cost of opening and closing as their number grows.\n\n"
+		"Suite generates synthetic archives with many tiny or few huge files, stored or\n"
+		"deflated, in flat or deep trees, and measures mount time, lookups, directory\n"
+		"iteration, sequential and random reading and its scaling with reader threads.\n"
+		"Every archive is measured with page cache hints of Grim Archive on and off.\n"
+		"By default archives are read from page cache, so results reflect costs of\n"
+		"Grim Archive itself. Suite also checks that archive stored inside another one\n"
+		"is mounted right from outer archive mounted at its default mount point.\n\n"
+		"Suite options:\n"
+		"  --json <file>       Also write results in JSON, to compare them between versions.\n"
+		"  --work-dir <dir>    Directory for generated archives, default is system temporary.\n"
+		"  --max-threads <n>   Maximum number of reader threads, default is the number of\n"
+		"                      processor cores.\n"
+		"  --scale <n>         Multiply number of files in archives, default is 1.\n"
+		"  --cold              Drop archive from page cache before every measurement, so\n"
+		"                      data is loaded from disk. Supported on Linux only.\n\n"
+		);
+
+	return 2;
+}
+
+
+int fail( const QString & message )
+{
+	printf( "%s\n", qPrintable( message ) );
+	return 1;
+}
+
+
+bool parse_options( const QStringList & args, Options & options )
+{
+	QStringList positional;
+
+	for ( int i = 1; i < args.count(); ++i )
+	{
+		const QString & arg = args.at( i );
+
+		if ( !arg.startsWith( QLatin1String( "--" ) ) )
+		{
+			positional << arg;
+			continue;
+		}
+
+		if ( arg == QLatin1String( "--suite" ) )
+		{
+			options.isSuite = true;
+			continue;
+		}
+
+		if ( arg == QLatin1String( "--cold" ) )
+		{
+			options.suite.isColdCache = true;
+			continue;
+		}
+
+		if ( i + 1 >= args.count() )
+			return false;
+
+		const QString & value = args.at( ++i );
+
+		if ( arg == QLatin1String( "--json" ) )
+		{
+			options.suite.jsonFileName = value;
+			continue;
+		}
+
+		if ( arg == QLatin1String( "--work-dir" ) )
+		{
+			options.suite.workDirPath = value;
+			continue;
+		}
+
+		bool ok;
+		const int number = value.toInt( &ok );
+		if ( !ok || number < 1 )
+			return false;
+
+		if ( arg == QLatin1String( "--iterations" ) )
+			options.iterations = number;
+		else if ( arg == QLatin1String( "--threads" ) )
+			options.threads = number;
+		else if ( arg == QLatin1String( "--handles" ) )
+			options.handles = number;
+		else if ( arg == QLatin1String( "--max-threads" ) )
+			options.suite.maxThreads = number;
+		else if ( arg == QLatin1String( "--scale" ) )
+			options.suite.scale = number;
+		else
+			return false;
+	}
+
+	if ( options.isSuite )
+		return positional.isEmpty();
+
+	if ( options.suite.isColdCache )
+		return false;
+
+	if ( positional.count() != 1 )
+		return false;
+
+	options.archiveFileName = positional.at( 0 );
+
+	return true;
+}
+
+
+
+
+class QueryThread : public QThread
+{
+public:
+	QueryThread( const QStringList & filePaths, Query query, int iterations ) :
+		filePaths_( filePaths ), query_( query ), iterations_( iterations ), found_( 0 )
+	{}
+
+	qint64 found() const
+	{ return found_; }
+
+protected:
+	void run()
+	{
+		for ( int iteration = 0; iteration < iterations_; ++iteration )
+		{
+			for ( QListIterator<QString> it( filePaths_ ); it.hasNext(); )
+			{
+				// new QFileInfo for every query, as asset loaders do
+				const QFileInfo fileInfo( it.next() );
+
+				switch ( query_ )
+				{
+				case Query_Exists:
+					if ( fileInfo.exists() )
+						found_++;
+					break;
+
+				case Query_Size:
+					if ( fileInfo.size() > 0 )
+						found_++;
+					break;
+				}
+			}
+		}
+	}
+
+private:
+	const QStringList filePaths_;
+	const Query query_;
+	const int iterations_;
+	qint64 found_;
+};
+
+
+void run_benchmark( const char * name, Query query, const QStringList & filePaths, const Options & options )
+{
+	QList<QueryThread*> threads;
+	for ( int i = 0; i < options.threads; ++i )
+		threads << new QueryThread( filePaths, query, options.iterations );
+
+	QTime time;
+	time.start();
+
+	foreach ( QueryThread * thread, threads )
+		thread->start();
+
+	qint64 found = 0;
+	foreach ( QueryThread * thread, threads )
+	{
+		thread->wait();
+		found += thread->found();
+	}
+
+	const int elapsed = qMax( 1, time.elapsed() );
+
+	qDeleteAll( threads );
+
+	const qint64 queries = qint64( filePaths.count() ) * options.iterations * options.threads;
+
+	printf( "%-8s %12lld queries %8d ms %12.0f queries/s (%lld positive)\n",
+		name, (long long)queries, elapsed, queries * 1000.0 / elapsed, (long long)found );
+}
+
+
+void run_handle_stress( const QStringList & filePaths, const Options & options )
+{
+	// report in ten steps, per operation cost should stay flat while number of handles grows
+	const int steps = 10;
+	const int stepSize = qMax( 1, options.handles / steps );
+
+	QList<QFile*> files;
+	files.reserve( options.handles );
+
+	printf( "\n%10s %14s %14s\n", "handles", "open, us/op", "close, us/op" );
+
+	QList<int> stepCounts;
+	QList<double> openCosts;
+	while ( files.count() < options.handles )
+	{
+		const int count = qMin( stepSize, options.handles - files.count() );
+
+		QTime time;
+		time.start();
+
+		for ( int i = 0; i < count; ++i )
+		{
+			QFile * file = new QFile( filePaths.at( files.count() % filePaths.count() ) );
+			file->open( QIODevice::ReadOnly );
+			files << file;
+		}
+
+		stepCounts << count;
+		openCosts << time.elapsed() * 1000.0 / count;
+	}
+
+	// close in reverse order, so each step reports cost at the same number of handles as opening
+	for ( int step = openCosts.count() - 1; step >= 0; --step )
+	{
+		const int handles = files.count();
+		const int count = stepCounts.at( step );
+
+		QTime time;
+		time.start();
+
+		for ( int i = 0; i < count; ++i )
+			delete files.takeLast();
+
+		printf( "%10d %14.2f %14.2f\n", handles, openCosts.at( step ), time.elapsed() * 1000.0 / count );
+	}
+}
+
+
+
+
+int main( int argc, char ** argv )
+{
+	QCoreApplication app( argc, argv );
+
+	Options options;
+	if ( !parse_options( app.arguments(), options ) )
+		return usage();
+
+	if ( options.isSuite )
+		return run_suite( options.suite );
+
+	Grim::Archive archive( options.archiveFileName );
+
+	if ( !archive.open( Grim::Archive::ReadOnly | Grim::Archive::Block ) )
+		return fail( QString( "Cannot open archive: %1" ).arg( options.archiveFileName ) );
+
+	if ( archive.isBroken() )
+		return fail( QString( "Not a ZIP archive: %1" ).arg( options.archiveFileName ) );
+
+	QStringList filePaths;
+	QStringList regularFilePaths;
+	for ( QDirIterator it( options.archiveFileName, QDirIterator::Subdirectories ); it.hasNext(); )
+	{
+		it.next();
+		filePaths << it.filePath();
+		filePaths << it.filePath() + QLatin1String( ".missing" );
+
+		if ( it.fileInfo().isFile() )
+			regularFilePaths << it.filePath();
+	}
+
+	printf( "%d paths, %d iterations, %d threads\n\n", filePaths.count(), options.iterations, options.threads );
+
+	run_benchmark( "exists", Query_Exists, filePaths, options );
+	run_benchmark( "size", Query_Size, filePaths, options );
+
+	if ( options.handles > 0 && !regularFilePaths.isEmpty() )
+		run_handle_stress( regularFilePaths, options );
+
+	return 0;
+}
@@ -0,0 +1,750 @@
+#include "suite.h"
+
+#include "zipwriter.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+#include <QTime>
+#include <QVector>
+
+#include <grim/archive/archive.h>
+
+#include <stdio.h>
+#include <zlib.h>
+
+#if defined(Q_OS_UNIX) && !defined(Q_OS_MAC)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+
+
+static const int MaxFileCount = 60000;    // ZIP archives written by ZipWriter hold up to 65535 entries
+static const int StoredAlignment = 4096;  // the same as GrimPack uses by default
+static const int ReadBufferSize = 64*1024;
+static const int MountRuns = 5;
+static const int LookupPasses = 3;
+static const int IterationPasses = 3;
+static const int RandomReads = 20000;
+static const int RandomReadSize = 4096;
+
+
+struct Dataset
+{
+	const char * name;
+	int fileCount;
+	int fileSize;
+	int depth;                // directory levels above each file, 0 for flat tree
+	ZipWriter::Method method;
+};
+
+
+static const Dataset Datasets[] =
+{
+	{ "tiny-flat-stored",   10000,  512,              0, ZipWriter::Method_Store },
+	{ "tiny-flat-deflated", 10000,  512,              0, ZipWriter::Method_Deflate },
+	{ "tiny-deep-stored",   10000,  512,              8, ZipWriter::Method_Store },
+	{ "tiny-deep-deflated", 10000,  512,              8, ZipWriter::Method_Deflate },
+	{ "huge-stored",        4,      32*1024*1024,     0, ZipWriter::Method_Store },
+	{ "huge-deflated",      4,      32*1024*1024,     0, ZipWriter::Method_Deflate }
+};
+
+static const int DatasetCount = sizeof(Datasets) / sizeof(Datasets[0]);
+
+// stored inside outer archive to check mounting of nested archives
+static const Dataset NestedDataset = { "nested", 16, 4096, 1, ZipWriter::Method_Store };
+
+
+struct ScalingResult
+{
+	int threads;
+	double mbPerSecond;
+};
+
+
+struct DatasetResult
+{
+	DatasetResult() :
+		useCacheHints( true ),
+		files( 0 ),
+		bytes( 0 ),
+		archiveBytes( 0 ),
+		mountMs( 0 ),
+		lookupNs( 0 ),
+		iterationEntriesPerSecond( 0 ),
+		sequentialMbPerSecond( 0 ),
+		randomMbPerSecond( 0 ),
+		randomReadsPerSecond( -1 ),
+		failures( 0 )
+	{}
+
+	QString name;
+	bool useCacheHints;               // Grim::Archive::useCacheHints() of measured archive
+	int files;
+	qint64 bytes;                     // uncompressed size of all files
+	qint64 archiveBytes;
+	double mountMs;                   // average time of opening in Block mode
+	double lookupNs;                  // average time of QFileInfo::exists() on archived file
+	double iterationEntriesPerSecond; // recursive QDirIterator over the whole archive
+	double sequentialMbPerSecond;     // files read one by one in archive order
+	double randomMbPerSecond;         // files read one by one in random order
+	double randomReadsPerSecond;      // 4 KB reads at random offsets of stored files or -1 if not measured
+	QList<ScalingResult> scaling;     // files in archive order split between threads
+	int failures;                     // files that could not be opened or read
+};
+
+
+
+
+// xorshift generator, the same sequence on every platform so archives are identical between runs
+class Random
+{
+public:
+	Random( quint32 seed ) :
+		state_( seed )
+	{}
+
+	quint32 next()
+	{
+		state_ ^= state_ << 13;
+		state_ ^= state_ >> 17;
+		state_ ^= state_ << 5;
+		return state_;
+	}
+
+private:
+	quint32 state_;
+};
+
+
+
+
+class ReadThread : public QThread
+{
+public:
+	ReadThread( const QStringList & filePaths ) :
+		filePaths_( filePaths ), bytes_( 0 ), failures_( 0 )
+	{}
+
+	qint64 bytes() const
+	{ return bytes_; }
+
+	int failures() const
+	{ return failures_; }
+
+protected:
+	void run()
+	{
+		QByteArray buffer;
+		buffer.resize( ReadBufferSize );
+
+		for ( QListIterator<QString> it( filePaths_ ); it.hasNext(); )
+		{
+			QFile file( it.next() );
+			if ( !file.open( QIODevice::ReadOnly ) )
+			{
+				failures_++;
+				continue;
+			}
+
+			while ( true )
+			{
+				const qint64 readBytes = file.read( buffer.data(), buffer.size() );
+				if ( readBytes <= 0 )
+				{
+					if ( readBytes == -1 )
+						failures_++;
+					break;
+				}
+
+				bytes_ += readBytes;
+			}
+		}
+	}
+
+private:
+	const QStringList filePaths_;
+	qint64 bytes_;
+	int failures_;
+};
+
+
+
+
+static QByteArray generate_data( int size, Random & random )
+{
+	// words from small vocabulary, so deflate gets compression ratio close to one of text assets
+	static const char * const Words[] =
+	{
+		"grim", "archive", "entry", "file", "engine", "texture", "sound", "level",
+		"actor", "script", "shader", "mesh", "data", "block", "read", "mount"
+	};
+	static const int WordCount = sizeof(Words) / sizeof(Words[0]);
+
+	QByteArray data;
+	data.reserve( size + 16 );
+
+	while ( data.size() < size )
+	{
+		data += Words[ random.next() % WordCount ];
+		data += ' ';
+	}
+
+	data.resize( size );
+	return data;
+}
+
+
+static QString dataset_file_path( const Dataset & dataset, int index )
+{
+	// four subdirectories on each level
+	QString filePath;
+	int dirIndex = index;
+	for ( int level = 0; level < dataset.depth; ++level )
+	{
+		filePath += QString( "d%1/" ).arg( dirIndex % 4 );
+		dirIndex /= 4;
+	}
+
+	return filePath + QString( "file%1.dat" ).arg( index );
+}
+
+
+static bool generate_archive( const Dataset & dataset, int fileCount, const QString & fileName, QStringList & filePaths,
+	qint64 & bytes, QString & errorString )
+{
+	QFile file( fileName );
+	if ( !file.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+	{
+		errorString = QString( "Cannot create archive: %1" ).arg( fileName );
+		return false;
+	}
+
+	ZipWriter writer( &file );
+	writer.setAlignment( StoredAlignment );
+
+	Random random( 0x9e3779b9 );
+	const QDateTime modTime = QDateTime::currentDateTime();
+
+	for ( int i = 0; i < fileCount; ++i )
+	{
+		const QString filePath = dataset_file_path( dataset, i );
+		const QByteArray data = generate_data( dataset.fileSize, random );
+		const quint32 crc = crc32( crc32( 0, 0, 0 ), reinterpret_cast<const Bytef*>( data.constData() ), data.size() );
+
+		const QByteArray packedData = dataset.method == ZipWriter::Method_Deflate ?
+			deflate_raw( data, Z_DEFAULT_COMPRESSION ) : data;
+
+		if ( packedData.isNull() || !writer.addFile( filePath, modTime, dataset.method, packedData, crc, data.size() ) )
+		{
+			errorString = writer.errorString();
+			return false;
+		}
+
+		filePaths << filePath;
+		bytes += data.size();
+	}
+
+	if ( !writer.finish() )
+	{
+		errorString = writer.errorString();
+		return false;
+	}
+
+	return true;
+}
+
+
+// drops pages of the file from page cache, so the next reading loads it from disk,
+// returns false if platform does not allow this
+static bool drop_page_cache( const QString & fileName )
+{
+#if defined(Q_OS_UNIX) && !defined(Q_OS_MAC)
+	const int fd = ::open( QFile::encodeName( fileName ).constData(), O_RDONLY );
+	if ( fd == -1 )
+		return false;
+
+	// dirty pages of just generated archive are not dropped, write them out first
+	const bool isDropped = fdatasync( fd ) == 0 && posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED ) == 0;
+
+	::close( fd );
+	return isDropped;
+#else
+	Q_UNUSED( fileName );
+	return false;
+#endif
+}
+
+
+
+
+static double measure_mount( const QString & fileName, bool useCacheHints, bool isColdCache )
+{
+	int elapsed = 0;
+
+	for ( int run = 0; run < MountRuns; ++run )
+	{
+		if ( isColdCache )
+			drop_page_cache( fileName );
+
+		QTime time;
+		time.start();
+
+		Grim::Archive archive( fileName );
+		archive.setUseCacheHints( useCacheHints );
+		if ( !archive.open( Grim::Archive::ReadOnly | Grim::Archive::Block ) || archive.isBroken() )
+			return -1;
+
+		elapsed += time.elapsed();
+	}
+
+	return elapsed / double( MountRuns );
+}
+
+
+static double measure_lookup( const QStringList & filePaths )
+{
+	int found = 0;
+
+	QTime time;
+	time.start();
+
+	for ( int pass = 0; pass < LookupPasses; ++pass )
+	{
+		for ( QListIterator<QString> it( filePaths ); it.hasNext(); )
+		{
+			// new QFileInfo for every query, so file engine is created each time
+			if ( QFileInfo( it.next() ).exists() )
+				found++;
+		}
+	}
+
+	const int elapsed = qMax( 1, time.elapsed() );
+
+	// missing files are not expected, but count them anyway to keep compiler from dropping the loop
+	return found == 0 ? -1 : elapsed * 1000000.0 / (double( LookupPasses ) * filePaths.count());
+}
+
+
+static double measure_iteration( const QString & mountPoint )
+{
+	qint64 entries = 0;
+
+	QTime time;
+	time.start();
+
+	for ( int pass = 0; pass < IterationPasses; ++pass )
+	{
+		for ( QDirIterator it( mountPoint, QDir::AllEntries | QDir::NoDotAndDotDot, QDirIterator::Subdirectories ); it.hasNext(); )
+		{
+			it.next();
+			entries++;
+		}
+	}
+
+	return entries * 1000.0 / qMax( 1, time.elapsed() );
+}
+
+
+static double measure_reading( const QStringList & filePaths, int threadCount, int & failures )
+{
+	QVector<QStringList> parts( threadCount );
+	for ( int i = 0; i < filePaths.count(); ++i )
+		parts[ i % threadCount ] << filePaths.at( i );
+
+	QList<ReadThread*> threads;
+	for ( int i = 0; i < threadCount; ++i )
+		threads << new ReadThread( parts.at( i ) );
+
+	QTime time;
+	time.start();
+
+	foreach ( ReadThread * thread, threads )
+		thread->start();
+
+	qint64 bytes = 0;
+	foreach ( ReadThread * thread, threads )
+	{
+		thread->wait();
+		bytes += thread->bytes();
+		failures += thread->failures();
+	}
+
+	const int elapsed = qMax( 1, time.elapsed() );
+
+	qDeleteAll( threads );
+
+	return bytes / (1024.0*1024.0) * 1000.0 / elapsed;
+}
+
+
+static double measure_random_reads( const QStringList & filePaths, int fileSize, int & failures )
+{
+	// keep all files opened, so only seeking and reading are measured
+	QList<QFile*> files;
+	foreach ( const QString & filePath, filePaths )
+	{
+		QFile * file = new QFile( filePath );
+		if ( !file->open( QIODevice::ReadOnly | QIODevice::Unbuffered ) )
+		{
+			delete file;
+			failures++;
+			continue;
+		}
+		files << file;
+	}
+
+	if ( files.isEmpty() )
+		return -1;
+
+	Random random( 0x2545f491 );
+	char buffer[ RandomReadSize ];
+
+	QTime time;
+	time.start();
+
+	for ( int i = 0; i < RandomReads; ++i )
+	{
+		QFile * file = files.at( random.next() % files.count() );
+		const qint64 pos = random.next() % (fileSize - RandomReadSize + 1);
+
+		if ( !file->seek( pos ) || file->read( buffer, RandomReadSize ) != RandomReadSize )
+			failures++;
+	}
+
+	const int elapsed = qMax( 1, time.elapsed() );
+
+	qDeleteAll( files );
+
+	return RandomReads * 1000.0 / elapsed;
+}
+
+
+
+
+static QString json_string( const QString & string )
+{
+	QString escaped = string;
+	escaped.replace( QLatin1Char( '\\' ), QLatin1String( "\\\\" ) );
+	escaped.replace( QLatin1Char( '"' ), QLatin1String( "\\\"" ) );
+	return QLatin1Char( '"' ) + escaped + QLatin1Char( '"' );
+}
+
+
+static QString json_number( double value )
+{
+	return QString::number( value, 'f', 2 );
+}
+
+
+static bool write_json( const QString & fileName, const SuiteOptions & options, const QList<DatasetResult> & results )
+{
+	QStringList datasets;
+	foreach ( const DatasetResult & result, results )
+	{
+		QStringList scaling;
+		foreach ( const ScalingResult & scalingResult, result.scaling )
+			scaling << QString( "{ \"threads\": %1, \"mb_per_s\": %2 }" )
+				.arg( scalingResult.threads ).arg( json_number( scalingResult.mbPerSecond ) );
+
+		QStringList fields;
+		fields << QString( "\"name\": %1" ).arg( json_string( result.name ) );
+		fields << QString( "\"cache_hints\": %1" ).arg( result.useCacheHints ? "true" : "false" );
+		fields << QString( "\"files\": %1" ).arg( result.files );
+		fields << QString( "\"bytes\": %1" ).arg( result.bytes );
+		fields << QString( "\"archive_bytes\": %1" ).arg( result.archiveBytes );
+		fields << QString( "\"mount_ms\": %1" ).arg( json_number( result.mountMs ) );
+		fields << QString( "\"lookup_ns\": %1" ).arg( json_number( result.lookupNs ) );
+		fields << QString( "\"iteration_entries_per_s\": %1" ).arg( json_number( result.iterationEntriesPerSecond ) );
+		fields << QString( "\"sequential_mb_per_s\": %1" ).arg( json_number( result.sequentialMbPerSecond ) );
+		fields << QString( "\"random_mb_per_s\": %1" ).arg( json_number( result.randomMbPerSecond ) );
+		if ( result.randomReadsPerSecond >= 0 )
+			fields << QString( "\"random_4k_reads_per_s\": %1" ).arg( json_number( result.randomReadsPerSecond ) );
+		fields << QString( "\"scaling\": [ %1 ]" ).arg( scaling.join( ", " ) );
+		fields << QString( "\"failures\": %1" ).arg( result.failures );
+
+		datasets << QString( "    {\n      %1\n    }" ).arg( fields.join( ",\n      " ) );
+	}
+
+	const QString json = QString(
+		"{\n"
+		"  \"format\": 2,\n"
+		"  \"qt_version\": %1,\n"
+		"  \"date\": %2,\n"
+		"  \"max_threads\": %3,\n"
+		"  \"scale\": %4,\n"
+		"  \"cold_cache\": %5,\n"
+		"  \"datasets\": [\n%6\n"
+		"  ]\n"
+		"}\n" )
+		.arg( json_string( QLatin1String( qVersion() ) ) )
+		.arg( json_string( QDateTime::currentDateTime().toString( Qt::ISODate ) ) )
+		.arg( options.maxThreads )
+		.arg( options.scale )
+		.arg( options.isColdCache ? "true" : "false" )
+		.arg( datasets.join( ",\n" ) );
+
+	QFile file( fileName );
+	if ( !file.open( QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text ) )
+		return false;
+
+	return file.write( json.toUtf8() ) != -1;
+}
+
+
+
+
+// measures already generated archive with page cache hints turned on or off
+static bool measure_archive( const Dataset & dataset, const SuiteOptions & options, const QString & fileName,
+	const QStringList & filePaths, DatasetResult & result )
+{
+	result.mountMs = measure_mount( fileName, result.useCacheHints, options.isColdCache );
+
+	Grim::Archive archive( fileName );
+	archive.setUseCacheHints( result.useCacheHints );
+	if ( !archive.open( Grim::Archive::ReadOnly | Grim::Archive::Block ) || archive.isBroken() )
+	{
+		printf( "Cannot open archive: %s\n", qPrintable( fileName ) );
+		return false;
+	}
+
+	const QString mountPoint = archive.actualMountPoint();
+
+	QStringList absoluteFilePaths;
+	foreach ( const QString & filePath, filePaths )
+		absoluteFilePaths << mountPoint + QLatin1Char( '/' ) + filePath;
+
+	// lookups and iteration never touch archive file after mount, page cache makes no difference for them
+	result.lookupNs = measure_lookup( absoluteFilePaths );
+	result.iterationEntriesPerSecond = measure_iteration( mountPoint );
+
+	if ( options.isColdCache )
+		drop_page_cache( fileName );
+	result.sequentialMbPerSecond = measure_reading( absoluteFilePaths, 1, result.failures );
+
+	QStringList shuffledFilePaths = absoluteFilePaths;
+	Random random( 0x6c078965 );
+	for ( int i = shuffledFilePaths.count() - 1; i > 0; --i )
+		shuffledFilePaths.swap( i, random.next() % (i + 1) );
+
+	if ( options.isColdCache )
+		drop_page_cache( fileName );
+	result.randomMbPerSecond = measure_reading( shuffledFilePaths, 1, result.failures );
+
+	// compressed files can only be rewound, so random access makes sense for stored ones
+	if ( dataset.method == ZipWriter::Method_Store && dataset.fileSize >= RandomReadSize )
+	{
+		if ( options.isColdCache )
+			drop_page_cache( fileName );
+		result.randomReadsPerSecond = measure_random_reads( absoluteFilePaths, dataset.fileSize, result.failures );
+	}
+
+	for ( int threads = 1; ; threads *= 2 )
+	{
+		const int threadCount = qMin( threads, options.maxThreads );
+
+		if ( options.isColdCache )
+			drop_page_cache( fileName );
+
+		ScalingResult scalingResult;
+		scalingResult.threads = threadCount;
+		scalingResult.mbPerSecond = measure_reading( absoluteFilePaths, threadCount, result.failures );
+		result.scaling << scalingResult;
+
+		if ( threadCount == options.maxThreads )
+			break;
+	}
+
+	return true;
+}
+
+
+// generates archive for the dataset and measures it with page cache hints on and off
+static bool run_dataset( const Dataset & dataset, const SuiteOptions & options, const QDir & workDir,
+	QList<DatasetResult> & results )
+{
+	const int fileCount = qMin( dataset.fileCount * options.scale, MaxFileCount );
+	const QString fileName = workDir.absoluteFilePath( QString( "%1.zip" ).arg( dataset.name ) );
+
+	QStringList filePaths;
+	qint64 bytes = 0;
+	QString errorString;
+	if ( !generate_archive( dataset, fileCount, fileName, filePaths, bytes, errorString ) )
+	{
+		printf( "%s\n", qPrintable( errorString ) );
+		QFile::remove( fileName );
+		return false;
+	}
+
+	if ( options.isColdCache && !drop_page_cache( fileName ) )
+	{
+		printf( "Cannot drop archive from page cache: %s\n", qPrintable( fileName ) );
+		QFile::remove( fileName );
+		return false;
+	}
+
+	bool isMeasured = true;
+
+	for ( int hints = 1; hints >= 0; --hints )
+	{
+		DatasetResult result;
+		result.name = QLatin1String( dataset.name );
+		result.useCacheHints = hints == 1;
+		result.files = filePaths.count();
+		result.bytes = bytes;
+		result.archiveBytes = QFileInfo( fileName ).size();
+
+		if ( !measure_archive( dataset, options, fileName, filePaths, result ) )
+		{
+			isMeasured = false;
+			break;
+		}
+
+		results << result;
+	}
+
+	QFile::remove( fileName );
+
+	return isMeasured;
+}
+
+
+// mounts stored archive right from outer archive mounted at its default mount point,
+// returns false if nested archive could not be mounted or read
+static bool check_nested_mount( const QDir & workDir )
+{
+	const QString innerFileName = workDir.absoluteFilePath( "nested-inner.zip" );
+	const QString outerFileName = workDir.absoluteFilePath( "nested-outer.zip" );
+
+	QStringList filePaths;
+	qint64 bytes = 0;
+	QString errorString;
+	const bool isInnerGenerated = generate_archive( NestedDataset, NestedDataset.fileCount, innerFileName,
+		filePaths, bytes, errorString );
+
+	QFile innerFile( innerFileName );
+	const QByteArray innerData = isInnerGenerated && innerFile.open( QIODevice::ReadOnly ) ? innerFile.readAll() : QByteArray();
+	innerFile.close();
+	QFile::remove( innerFileName );
+
+	if ( innerData.isEmpty() )
+		return false;
+
+	{
+		QFile outerFile( outerFileName );
+		if ( !outerFile.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+			return false;
+
+		ZipWriter writer( &outerFile );
+		writer.setAlignment( StoredAlignment );
+
+		const quint32 crc = crc32( crc32( 0, 0, 0 ), reinterpret_cast<const Bytef*>( innerData.constData() ), innerData.size() );
+		if ( !writer.addFile( "inner.zip", QDateTime::currentDateTime(), ZipWriter::Method_Store, innerData, crc, innerData.size() ) ||
+			!writer.finish() )
+		{
+			QFile::remove( outerFileName );
+			return false;
+		}
+	}
+
+	// the same contents are generated again for comparison
+	Random random( 0x9e3779b9 );
+	const QByteArray expectedData = generate_data( NestedDataset.fileSize, random );
+
+	bool isMounted = false;
+	{
+		Grim::Archive outer( outerFileName );
+		Grim::Archive inner( outerFileName + QLatin1String( "/inner.zip" ) );
+
+		if ( outer.open( Grim::Archive::ReadOnly | Grim::Archive::Block ) && !outer.isBroken() &&
+			inner.open( Grim::Archive::ReadOnly | Grim::Archive::Block ) && !inner.isBroken() )
+		{
+			QFile file( inner.actualMountPoint() + QLatin1Char( '/' ) + filePaths.first() );
+			isMounted = file.open( QIODevice::ReadOnly ) && file.readAll() == expectedData;
+		}
+	}
+
+	QFile::remove( outerFileName );
+
+	return isMounted;
+}
+
+
+static void print_result( const DatasetResult & result )
+{
+	printf( "%-20s %5s %6d %8.1f %9.2f %10.1f %12.0f %9.1f %9.1f",
+		qPrintable( result.name ), result.useCacheHints ? "on" : "off", result.files, result.bytes / (1024.0*1024.0), result.mountMs, result.lookupNs,
+		result.iterationEntriesPerSecond, result.sequentialMbPerSecond, result.randomMbPerSecond );
+
+	if ( result.randomReadsPerSecond >= 0 )
+		printf( " %10.0f\n", result.randomReadsPerSecond );
+	else
+		printf( " %10s\n", "-" );
+
+	QStringList scaling;
+	foreach ( const ScalingResult & scalingResult, result.scaling )
+		scaling << QString( "%1: %2" ).arg( scalingResult.threads ).arg( scalingResult.mbPerSecond, 0, 'f', 1 );
+
+	printf( "%-26s MB/s by threads  %s\n", "", qPrintable( scaling.join( ", " ) ) );
+
+	if ( result.failures > 0 )
+		printf( "%-26s %d failed reads\n", "", result.failures );
+}
+
+
+
+
+int run_suite( const SuiteOptions & options )
+{
+	QDir workDir( options.workDirPath.isEmpty() ? QDir::temp().absoluteFilePath( "grimbench" ) : options.workDirPath );
+	if ( !workDir.mkpath( "." ) )
+	{
+		printf( "Cannot create work directory: %s\n", qPrintable( workDir.path() ) );
+		return 1;
+	}
+
+	printf( "%d datasets, scale %d, up to %d threads, %s page cache, work directory %s\n\n",
+		DatasetCount, options.scale, options.maxThreads, options.isColdCache ? "cold" : "warm",
+		qPrintable( workDir.absolutePath() ) );
+
+	printf( "%-20s %5s %6s %8s %9s %10s %12s %9s %9s %10s\n",
+		"dataset", "hints", "files", "MB", "mount ms", "lookup ns", "iteration/s", "seq MB/s", "rand MB/s", "4k reads/s" );
+
+	QList<DatasetResult> results;
+	bool isFailed = false;
+
+	for ( int i = 0; i < DatasetCount; ++i )
+	{
+		QList<DatasetResult> datasetResults;
+		if ( !run_dataset( Datasets[ i ], options, workDir, datasetResults ) )
+			isFailed = true;
+
+		foreach ( const DatasetResult & result, datasetResults )
+		{
+			print_result( result );
+
+			if ( result.failures > 0 )
+				isFailed = true;
+		}
+
+		results << datasetResults;
+	}
+
+	const bool isNestedMounted = check_nested_mount( workDir );
+	printf( "\nnested archive mount: %s\n", isNestedMounted ? "ok" : "FAILED" );
+	if ( !isNestedMounted )
+		isFailed = true;
+
+	if ( !options.jsonFileName.isEmpty() && !write_json( options.jsonFileName, options, results ) )
+	{
+		printf( "Cannot write results: %s\n", qPrintable( options.jsonFileName ) );
+		return 1;
+	}
+
+	return isFailed ? 1 : 0;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <QString>
+#include <QThread>
+
+
+
+
+struct SuiteOptions
+{
+	SuiteOptions() :
+		maxThreads( QThread::idealThreadCount() ),
+		scale( 1 ),
+		isColdCache( false )
+	{}
+
+	QString workDirPath;  // where synthetic archives are generated
+	QString jsonFileName; // results are also written here in JSON if not empty
+	int maxThreads;       // reading scales from 1 up to this number of threads
+	int scale;            // multiplies number of files in each synthetic archive
+	bool isColdCache;     // archive is dropped from page cache before every measurement
+};
+
+
+
+
+// generates synthetic archives, measures them one by one and returns process exit code
+int run_suite( const SuiteOptions & options );
@@ -0,0 +1,499 @@
+#include "packwriter.h"
+#include "zipwriter.h"
+
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QSet>
+#include <QThread>
+#include <QThreadPool>
+#include <QTime>
+#include <QVector>
+#include <QtConcurrentMap>
+
+#include <grim/archive/archivetrace.h>
+
+#include <stdio.h>
+#include <zlib.h>
+
+
+
+
+struct Options
+{
+	enum Format
+	{
+		Format_Zip,
+		Format_Grim
+	};
+
+	Options() :
+		format( Format_Zip ),
+		blockSize( 65536 ),
+		alignment( 4096 ),
+		level( Z_DEFAULT_COMPRESSION ),
+		storeBelow( 64 ),
+		minRatio( 95 ),
+		jobs( QThread::idealThreadCount() ),
+		isVerbose( false )
+	{
+		storeExtensions << "png" << "jpg" << "jpeg" << "ogg" << "mp3" << "zip" << "gz";
+	}
+
+	QString sourceDirPath;
+	QString archiveFileName;
+	QString traceFileName;
+	Format format;
+	int blockSize;              // uncompressed size of Grim pack blocks
+	int alignment;              // stored entries are aligned to this boundary
+	int level;                  // deflate compression level
+	qint64 storeBelow;          // files smaller than this are always stored
+	int minRatio;               // deflated files that exceed this percent of original size are stored
+	QSet<QString> storeExtensions; // files with these suffixes are always stored
+	int jobs;
+	bool isVerbose;
+};
+
+
+struct Entry
+{
+	QString filePath;           // relative to source directory, with '/' separators
+	QString absoluteFilePath;
+	QDateTime modTime;
+	bool forceStore;
+};
+
+
+struct PackedEntry
+{
+	PackedEntry() :
+		isValid( false ),
+		method( ZipWriter::Method_Store ),
+		crc32( 0 ),
+		size( 0 )
+	{}
+
+	bool isValid;
+	QString errorString;
+	ZipWriter::Method method;
+	QByteArray data;
+	QList<PackWriter::Block> blocks; // data split into blocks for Grim pack
+	quint32 crc32;
+	qint64 size;
+};
+
+
+
+
+int usage()
+{
+	printf(
+		"Usage:\n"
+		"  GrimPack [options] <source directory> <output archive>\n\n"
+		"Packs directory into ZIP archive laid out for fast loading with Grim::Archive.\n\n"
+		"Options:\n"
+		"  --format <zip|grim>   Archive format, default is zip. Grim pack keeps files in\n"
+		"                        independently compressed blocks, identical blocks are\n"
+		"                        written once. Readable with Grim::Archive only.\n"
+		"  --block-size <bytes>  Block size of grim format, default is 65536.\n"
+		"  --trace <file>        Put files in order they were opened in access trace,\n"
+		"                        recorded with Grim::Archive::startTrace(). Files missing\n"
+		"                        in trace follow in directory order.\n"
+		"  --align <bytes>       Align data of stored files in zip format, default is 4096,\n"
+		"                        at most 32768. Use 1 to disable alignment.\n"
+		"  --level <0-9>         Deflate compression level.\n"
+		"  --store-below <bytes> Store files smaller than this size, default is 64.\n"
+		"  --min-ratio <percent> Store files that deflate to more than this percent\n"
+		"                        of original size, default is 95.\n"
+		"  --store-ext <list>    Comma separated list of file suffixes that are always\n"
+		"                        stored, default is png,jpg,jpeg,ogg,mp3,zip,gz.\n"
+		"  --jobs <n>            Number of compression threads.\n"
+		"  --verbose             Print every packed file.\n\n"
+		);
+
+	return 2;
+}
+
+
+int fail( const QString & message )
+{
+	printf( "%s\n", qPrintable( message ) );
+	return 1;
+}
+
+
+bool parse_int( const QString & value, qint64 minimum, qint64 maximum, qint64 & result )
+{
+	bool ok;
+	result = value.toLongLong( &ok );
+	return ok && result >= minimum && result <= maximum;
+}
+
+
+bool parse_options( const QStringList & args, Options & options )
+{
+	QStringList positional;
+
+	for ( int i = 1; i < args.count(); ++i )
+	{
+		const QString & arg = args.at( i );
+
+		if ( arg == QLatin1String( "--verbose" ) )
+		{
+			options.isVerbose = true;
+			continue;
+		}
+
+		if ( !arg.startsWith( QLatin1String( "--" ) ) )
+		{
+			positional << arg;
+			continue;
+		}
+
+		if ( i + 1 >= args.count() )
+			return false;
+
+		const QString value = args.at( ++i );
+		qint64 number;
+
+		if ( arg == QLatin1String( "--trace" ) )
+		{
+			options.traceFileName = value;
+		}
+		else if ( arg == QLatin1String( "--format" ) )
+		{
+			if ( value == QLatin1String( "zip" ) )
+				options.format = Options::Format_Zip;
+			else if ( value == QLatin1String( "grim" ) )
+				options.format = Options::Format_Grim;
+			else
+				return false;
+		}
+		else if ( arg == QLatin1String( "--block-size" ) )
+		{
+			if ( !parse_int( value, 4096, 16*1024*1024, number ) )
+				return false;
+			options.blockSize = number;
+		}
+		else if ( arg == QLatin1String( "--align" ) )
+		{
+			if ( !parse_int( value, 1, ZipWriter::MaxAlignment, number ) )
+				return false;
+			options.alignment = number;
+		}
+		else if ( arg == QLatin1String( "--level" ) )
+		{
+			if ( !parse_int( value, 0, 9, number ) )
+				return false;
+			options.level = number;
+		}
+		else if ( arg == QLatin1String( "--store-below" ) )
+		{
+			if ( !parse_int( value, 0, Q_INT64_C( 0xffffffff ), number ) )
+				return false;
+			options.storeBelow = number;
+		}
+		else if ( arg == QLatin1String( "--min-ratio" ) )
+		{
+			if ( !parse_int( value, 0, 100, number ) )
+				return false;
+			options.minRatio = number;
+		}
+		else if ( arg == QLatin1String( "--store-ext" ) )
+		{
+			options.storeExtensions.clear();
+			foreach ( const QString & suffix, value.split( QLatin1Char( ',' ), QString::SkipEmptyParts ) )
+				options.storeExtensions << suffix.trimmed().toLower();
+		}
+		else if ( arg == QLatin1String( "--jobs" ) )
+		{
+			if ( !parse_int( value, 1, 256, number ) )
+				return false;
+			options.jobs = number;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	if ( positional.count() != 2 )
+		return false;
+
+	options.sourceDirPath = positional.at( 0 );
+	options.archiveFileName = positional.at( 1 );
+
+	return true;
+}
+
+
+bool entry_less_than( const Entry & a, const Entry & b )
+{
+	// group files of the same directory together, directories go in lexical order
+	const int aSlash = a.filePath.lastIndexOf( QLatin1Char( '/' ) );
+	const int bSlash = b.filePath.lastIndexOf( QLatin1Char( '/' ) );
+	const QString aDir = aSlash == -1 ? QString() : a.filePath.left( aSlash );
+	const QString bDir = bSlash == -1 ? QString() : b.filePath.left( bSlash );
+
+	if ( aDir != bDir )
+		return aDir < bDir;
+
+	return a.filePath < b.filePath;
+}
+
+
+QList<Entry> collect_entries( const Options & options, const QStringList & tracedFilePaths )
+{
+	const QDir sourceDir( options.sourceDirPath );
+
+	QList<Entry> entries;
+
+	for ( QDirIterator it( options.sourceDirPath, QDir::Files | QDir::Hidden | QDir::NoSymLinks,
+		QDirIterator::Subdirectories ); it.hasNext(); )
+	{
+		it.next();
+
+		const QFileInfo fileInfo = it.fileInfo();
+
+		Entry entry;
+		entry.filePath = QDir::fromNativeSeparators( sourceDir.relativeFilePath( fileInfo.absoluteFilePath() ) );
+		entry.absoluteFilePath = fileInfo.absoluteFilePath();
+		entry.modTime = fileInfo.lastModified();
+		entry.forceStore = fileInfo.size() < options.storeBelow ||
+			options.storeExtensions.contains( fileInfo.suffix().toLower() );
+		entries << entry;
+	}
+
+	qSort( entries.begin(), entries.end(), entry_less_than );
+
+	if ( tracedFilePaths.isEmpty() )
+		return entries;
+
+	// move traced files to the beginning, in order of their first access
+	QHash<QString, int> indexForFilePath;
+	for ( int i = 0; i < entries.count(); ++i )
+		indexForFilePath[ entries.at( i ).filePath ] = i;
+
+	QList<Entry> orderedEntries;
+	QVector<bool> isTaken( entries.count(), false );
+
+	foreach ( const QString & filePath, tracedFilePaths )
+	{
+		const int index = indexForFilePath.value( filePath, -1 );
+		if ( index == -1 || isTaken.at( index ) )
+			continue;
+
+		isTaken[ index ] = true;
+		orderedEntries << entries.at( index );
+	}
+
+	for ( int i = 0; i < entries.count(); ++i )
+		if ( !isTaken.at( i ) )
+			orderedEntries << entries.at( i );
+
+	return orderedEntries;
+}
+
+
+class PackFunctor
+{
+public:
+	typedef PackedEntry result_type;
+
+	PackFunctor( const Options & options ) :
+		options_( options )
+	{}
+
+	PackedEntry operator()( const Entry & entry ) const
+	{
+		PackedEntry packed;
+
+		QFile file( entry.absoluteFilePath );
+		if ( !file.open( QIODevice::ReadOnly ) )
+		{
+			packed.errorString = QString( "Cannot read %1: %2" ).arg( entry.absoluteFilePath ).arg( file.errorString() );
+			return packed;
+		}
+
+		const QByteArray data = file.readAll();
+
+		packed.size = data.size();
+		packed.crc32 = crc32( crc32( 0, 0, 0 ), reinterpret_cast<const Bytef*>( data.constData() ), data.size() );
+		packed.isValid = true;
+
+		if ( options_.format == Options::Format_Grim )
+		{
+			_packBlocks( entry, data, packed );
+			return packed;
+		}
+
+		if ( !entry.forceStore && options_.level != 0 && !data.isEmpty() )
+		{
+			const QByteArray deflated = _deflate( data );
+			if ( !deflated.isNull() && qint64( deflated.size() ) * 100 <= qint64( data.size() ) * options_.minRatio )
+			{
+				packed.method = ZipWriter::Method_Deflate;
+				packed.data = deflated;
+				return packed;
+			}
+		}
+
+		packed.method = ZipWriter::Method_Store;
+		packed.data = data;
+		return packed;
+	}
+
+private:
+	void _packBlocks( const Entry & entry, const QByteArray & data, PackedEntry & packed ) const
+	{
+		packed.method = ZipWriter::Method_Store;
+
+		for ( int pos = 0; pos < data.size(); pos += options_.blockSize )
+		{
+			PackWriter::Block block;
+			block.size = qMin( options_.blockSize, data.size() - pos );
+			block.data = QByteArray::fromRawData( data.constData() + pos, block.size );
+			block.digest = QCryptographicHash::hash( block.data, QCryptographicHash::Sha1 );
+
+			if ( !entry.forceStore && options_.level != 0 )
+			{
+				const QByteArray deflated = _deflate( block.data );
+				if ( !deflated.isNull() && qint64( deflated.size() ) * 100 <= qint64( block.size ) * options_.minRatio &&
+					deflated.size() < block.size )
+				{
+					packed.method = ZipWriter::Method_Deflate;
+					block.data = deflated;
+				}
+			}
+
+			// detach from the source buffer
+			if ( block.data.size() == block.size )
+				block.data = QByteArray( block.data.constData(), block.size );
+
+			packed.blocks << block;
+		}
+	}
+
+	QByteArray _deflate( const QByteArray & data ) const
+	{
+		return deflate_raw( data, options_.level );
+	}
+
+private:
+	const Options & options_;
+};
+
+
+
+
+int main( int argc, char ** argv )
+{
+	QCoreApplication app( argc, argv );
+
+	Options options;
+	if ( !parse_options( app.arguments(), options ) )
+		return usage();
+
+	if ( !QFileInfo( options.sourceDirPath ).isDir() )
+		return fail( QString( "Not a directory: %1" ).arg( options.sourceDirPath ) );
+
+	QStringList tracedFilePaths;
+	if ( !options.traceFileName.isNull() )
+	{
+		Grim::ArchiveTrace trace;
+		if ( !trace.load( options.traceFileName ) )
+			return fail( QString( "Cannot load trace: %1" ).arg( options.traceFileName ) );
+		tracedFilePaths = trace.filePaths();
+	}
+
+	QTime time;
+	time.start();
+
+	const QList<Entry> entries = collect_entries( options, tracedFilePaths );
+
+	QFile archiveFile( options.archiveFileName );
+	if ( !archiveFile.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+		return fail( QString( "Cannot create archive %1: %2" ).arg( options.archiveFileName ).arg( archiveFile.errorString() ) );
+
+	ZipWriter writer( &archiveFile );
+	writer.setAlignment( options.alignment );
+
+	PackWriter packWriter( &archiveFile, options.blockSize );
+	if ( options.format == Options::Format_Grim && !packWriter.begin() )
+		return fail( packWriter.errorString() );
+
+	QThreadPool::globalInstance()->setMaxThreadCount( options.jobs );
+
+	int storedCount = 0;
+	int deflatedCount = 0;
+	qint64 totalSize = 0;
+
+	// compress in chunks, so memory usage stays bounded while entries are written in order
+	const int chunkSize = options.jobs * 4;
+	for ( int chunkStart = 0; chunkStart < entries.count(); chunkStart += chunkSize )
+	{
+		const QList<Entry> chunk = entries.mid( chunkStart, chunkSize );
+		const QList<PackedEntry> packedChunk = QtConcurrent::blockingMapped( chunk, PackFunctor( options ) );
+
+		for ( int i = 0; i < chunk.count(); ++i )
+		{
+			const Entry & entry = chunk.at( i );
+			const PackedEntry & packed = packedChunk.at( i );
+
+			if ( !packed.isValid )
+				return fail( packed.errorString );
+
+			if ( options.format == Options::Format_Grim )
+			{
+				if ( !packWriter.addFile( entry.filePath, entry.modTime, packed.blocks, packed.crc32, packed.size ) )
+					return fail( packWriter.errorString() );
+			}
+			else
+			{
+				if ( !writer.addFile( entry.filePath, entry.modTime, packed.method, packed.data, packed.crc32, packed.size ) )
+					return fail( writer.errorString() );
+			}
+
+			if ( packed.method == ZipWriter::Method_Store )
+				storedCount++;
+			else
+				deflatedCount++;
+			totalSize += packed.size;
+
+			if ( options.isVerbose )
+			{
+				qint64 packedSize = packed.data.size();
+				foreach ( const PackWriter::Block & block, packed.blocks )
+					packedSize += block.data.size();
+
+				printf( "%s %s (%lld -> %lld)\n", packed.method == ZipWriter::Method_Store ? "stored  " : "deflated",
+					qPrintable( entry.filePath ), (long long)packed.size, (long long)packedSize );
+			}
+		}
+	}
+
+	if ( options.format == Options::Format_Grim )
+	{
+		if ( !packWriter.finish() )
+			return fail( packWriter.errorString() );
+	}
+	else
+	{
+		if ( !writer.finish() )
+			return fail( writer.errorString() );
+	}
+
+	const qint64 archiveSize = archiveFile.size();
+	archiveFile.close();
+
+	printf( "Packed %d files (%d stored, %d deflated), %lld -> %lld bytes in %.2f s\n",
+		entries.count(), storedCount, deflatedCount, (long long)totalSize, (long long)archiveSize, time.elapsed() / 1000.0 );
+
+	if ( options.format == Options::Format_Grim )
+		printf( "Block size %d, %d duplicate blocks shared\n", packWriter.blockSize(), packWriter.sharedBlockCount() );
+
+	return 0;
+}
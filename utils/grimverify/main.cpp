@@ -0,0 +1,250 @@
+#include <QAtomicInt>
+#include <QCoreApplication>
+#include <QFile>
+#include <QMutex>
+#include <QRunnable>
+#include <QStringList>
+#include <QThread>
+#include <QThreadPool>
+#include <QTime>
+
+#include <grim/archive/archive.h>
+
+#include <stdio.h>
+#include <zlib.h>
+
+
+
+
+static const int ReadBufferSize = 256*1024;
+
+
+
+
+struct Options
+{
+	Options() :
+		threads( QThread::idealThreadCount() )
+	{}
+
+	QString archiveFileName;
+	int threads;
+};
+
+
+struct Result
+{
+	Result() :
+		bytes( 0 ),
+		entries( 0 )
+	{}
+
+	QMutex mutex;
+	qint64 bytes;
+	int entries;
+	QStringList failures;
+};
+
+
+
+
+int usage()
+{
+	printf(
+		"Usage:\n"
+		"  GrimVerify [options] <archive>\n\n"
+		"Reads every file inside archive through Grim Archive and checks its size and CRC32\n"
+		"against ones stored in archive. Prints failed files and throughput.\n"
+		"Exits with non zero code if archive cannot be opened or any file failed.\n\n"
+		"Options:\n"
+		"  --threads <n>    Number of threads that read files concurrently,\n"
+		"                   default is the number of processor cores.\n\n"
+		);
+
+	return 2;
+}
+
+
+int fail( const QString & message )
+{
+	printf( "%s\n", qPrintable( message ) );
+	return 1;
+}
+
+
+bool parse_options( const QStringList & args, Options & options )
+{
+	QStringList positional;
+
+	for ( int i = 1; i < args.count(); ++i )
+	{
+		const QString & arg = args.at( i );
+
+		if ( !arg.startsWith( QLatin1String( "--" ) ) )
+		{
+			positional << arg;
+			continue;
+		}
+
+		if ( i + 1 >= args.count() )
+			return false;
+
+		bool ok;
+		const int value = args.at( ++i ).toInt( &ok );
+		if ( !ok || value < 1 )
+			return false;
+
+		if ( arg == QLatin1String( "--threads" ) )
+			options.threads = value;
+		else
+			return false;
+	}
+
+	if ( positional.count() != 1 )
+		return false;
+
+	options.archiveFileName = positional.at( 0 );
+
+	return true;
+}
+
+
+
+
+class VerifyRunnable : public QRunnable
+{
+public:
+	VerifyRunnable( const QString & mountPoint, const QList<Grim::Archive::EntryInfo> & entries,
+		QAtomicInt & nextEntry, Result & result ) :
+		mountPoint_( mountPoint ), entries_( entries ), nextEntry_( nextEntry ), result_( result )
+	{}
+
+	void run()
+	{
+		QByteArray buffer;
+		buffer.resize( ReadBufferSize );
+
+		qint64 bytes = 0;
+		int entries = 0;
+		QStringList failures;
+
+		// entries are taken one by one, so threads stay busy until the very end regardless of file sizes
+		while ( true )
+		{
+			const int index = nextEntry_.fetchAndAddRelaxed( 1 );
+			if ( index >= entries_.count() )
+				break;
+
+			const Grim::Archive::EntryInfo & entry = entries_.at( index );
+			const QString error = verify( entry, buffer, bytes );
+
+			if ( !error.isNull() )
+				failures << QString( "%1: %2" ).arg( entry.filePath ).arg( error );
+
+			entries++;
+		}
+
+		QMutexLocker locker( &result_.mutex );
+		result_.bytes += bytes;
+		result_.entries += entries;
+		result_.failures << failures;
+	}
+
+private:
+	QString verify( const Grim::Archive::EntryInfo & entry, QByteArray & buffer, qint64 & bytes ) const
+	{
+		QFile file( mountPoint_ + QLatin1Char( '/' ) + entry.filePath );
+		if ( !file.open( QIODevice::ReadOnly ) )
+			return QLatin1String( "cannot open" );
+
+		uLong crc = crc32( 0, 0, 0 );
+		qint64 size = 0;
+
+		while ( true )
+		{
+			const qint64 readBytes = file.read( buffer.data(), buffer.size() );
+			if ( readBytes == -1 )
+				return QLatin1String( "read error" );
+			if ( readBytes == 0 )
+				break;
+
+			crc = crc32( crc, reinterpret_cast<const Bytef*>( buffer.constData() ), (uInt)readBytes );
+			size += readBytes;
+		}
+
+		bytes += size;
+
+		if ( size != entry.size )
+			return QString( "size %1, expected %2" ).arg( size ).arg( entry.size );
+
+		if ( (quint32)crc != entry.crc32 )
+			return QString( "CRC32 %1, expected %2" )
+				.arg( (quint32)crc, 8, 16, QLatin1Char( '0' ) ).arg( entry.crc32, 8, 16, QLatin1Char( '0' ) );
+
+		return QString();
+	}
+
+private:
+	const QString mountPoint_;
+	const QList<Grim::Archive::EntryInfo> & entries_;
+	QAtomicInt & nextEntry_;
+	Result & result_;
+};
+
+
+
+
+int main( int argc, char ** argv )
+{
+	QCoreApplication app( argc, argv );
+
+	Options options;
+	if ( !parse_options( app.arguments(), options ) )
+		return usage();
+
+	Grim::Archive archive( options.archiveFileName );
+
+	if ( !archive.open( Grim::Archive::ReadOnly | Grim::Archive::Block ) )
+		return fail( QString( "Cannot open archive: %1" ).arg( options.archiveFileName ) );
+
+	if ( archive.isBroken() )
+		return fail( QString( "Broken archive: %1" ).arg( options.archiveFileName ) );
+
+	const QList<Grim::Archive::EntryInfo> entries = archive.query( QString() );
+
+	printf( "%d files, %d threads\n\n", entries.count(), options.threads );
+
+	QAtomicInt nextEntry( 0 );
+	Result result;
+
+	QThreadPool threadPool;
+	threadPool.setMaxThreadCount( options.threads );
+
+	QTime time;
+	time.start();
+
+	for ( int i = 0; i < options.threads; ++i )
+		threadPool.start( new VerifyRunnable( archive.actualMountPoint(), entries, nextEntry, result ) );
+
+	threadPool.waitForDone();
+
+	const int elapsed = qMax( 1, time.elapsed() );
+
+	result.failures.sort();
+	foreach ( const QString & failure, result.failures )
+		printf( "FAILED %s\n", qPrintable( failure ) );
+
+	if ( !result.failures.isEmpty() )
+		printf( "\n" );
+
+	printf( "%d files, %.1f MB in %d ms: %.1f MB/s, %.0f files/s\n",
+		result.entries, result.bytes / (1024.0*1024.0), elapsed,
+		result.bytes * 1000.0 / (1024.0*1024.0) / elapsed, result.entries * 1000.0 / elapsed );
+
+	if ( !result.failures.isEmpty() )
+		return fail( QString( "%1 of %2 files failed" ).arg( result.failures.count() ).arg( result.entries ) );
+
+	printf( "All files are OK\n" );
+
+	return 0;
+}